@@ -0,0 +1,38 @@
+'use strict';
+
+// Compares device lookup cost with a forced bus rescan on every call (the
+// previous behaviour) against lookups served from the cached device list.
+//
+//   node bench/enumerate.js [iterations]
+
+var path = require('path');
+var sosNative = require(path.join(__dirname, '../build/Release/sos.node'));
+
+var iterations = parseInt(process.argv[2], 10) || 1000;
+
+function run(name, options, callback) {
+  var remaining = iterations;
+  var start = process.hrtime();
+
+  return next();
+
+  function next() {
+    if (remaining-- === 0) {
+      var elapsed = process.hrtime(start);
+      var totalUs = elapsed[0] * 1e6 + elapsed[1] / 1e3;
+      console.log(name + ': ' + (totalUs / iterations).toFixed(1) + ' us/lookup (' + iterations + ' lookups)');
+      return callback();
+    }
+    return sosNative.findDevices(options, function(err) {
+      if (err) {
+        console.error(err);
+        return process.exit(1);
+      }
+      return next();
+    });
+  }
+}
+
+run('rescan', { refresh: true }, function() {
+  run('cached', { refresh: false }, function() {});
+});
@@ -0,0 +1,44 @@
+'use strict';
+
+// Measures the cost of turning a raw UsbInfoPacket into the readInfo result
+// object, without any USB I/O.
+//
+//   node bench/marshal.js [iterations]
+
+var path = require('path');
+var sosNative = require(path.join(__dirname, '../build/Release/sos.node'));
+
+var iterations = parseInt(process.argv[2], 10) || 1000000;
+
+var packet = new Buffer(sosNative.SosDevice.INFO_PACKET_SIZE);
+packet.fill(0);
+packet.writeUInt16LE(1, 0);
+packet.writeUInt32LE(1024 * 1024, 4);
+
+function run(name, fn) {
+  var sink = 0;
+  var heapBefore = process.memoryUsage().heapUsed;
+  var start = process.hrtime();
+  for (var i = 0; i < iterations; i++) {
+    sink += fn(packet).version;
+  }
+  var elapsed = process.hrtime(start);
+  var totalNs = elapsed[0] * 1e9 + elapsed[1];
+  var heapDelta = process.memoryUsage().heapUsed - heapBefore;
+  console.log(name + ': ' + (totalNs / iterations).toFixed(1) + ' ns/op, heap delta ' +
+    (heapDelta / 1024).toFixed(0) + ' KiB (' + iterations + ' ops, ' + sink + ')');
+}
+
+run('native parseInfo', sosNative.parseInfo);
+run('js decode', function(buffer) {
+  return {
+    version: buffer.readUInt16LE(0),
+    hardwareType: buffer[2],
+    hardwareVersion: buffer[3],
+    externalMemorySize: buffer.readUInt32LE(4),
+    audioMode: buffer[8],
+    audioPlayDuration: buffer.readUInt16LE(9),
+    ledMode: buffer[11],
+    ledPlayDuration: buffer.readUInt16LE(12)
+  };
+});
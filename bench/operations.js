@@ -0,0 +1,205 @@
+'use strict';
+
+// Measures per-operation latency and throughput of the native binding.
+// Each operation is driven with a fixed number of calls in flight against an
+// emulated device (default) or the first attached one. The sos_bench build
+// reports how long each call spent on device I/O, which is split out from the
+// total as "io"; the rest is queueing and marshalling.
+//
+//   node --expose-gc bench/operations.js [options]
+//
+//   --device mock|usb     device to run against (default mock)
+//   --ops a,b,...         operations (default all)
+//   --iterations n        calls per operation (default 10000)
+//   --concurrency n       calls in flight (default 1)
+//   --latency ms          mock transfer latency (default 0)
+//   --json                print one JSON object per operation
+
+var path = require('path');
+var sosNative;
+try {
+  sosNative = require(path.join(__dirname, '../build/Release/sos_bench.node'));
+} catch (e) {
+  sosNative = require(path.join(__dirname, '../build/Release/sos.node'));
+}
+
+var options = parseArgs(process.argv.slice(2));
+
+// Control packets alternate LED 0 so that none are skipped as redundant by
+// the device's shadow state.
+var MANUAL_LEDS0_OFFSET = 10;
+var controlBuffers = [0, 1].map(function(led) {
+  var buffer = new Buffer(sosNative.SosDevice.CONTROL_PACKET_SIZE);
+  buffer.fill(0xff);
+  buffer[0] = 0;
+  buffer[1] = 0;
+  buffer[MANUAL_LEDS0_OFFSET] = led;
+  return buffer;
+});
+var infoBuffer = new Buffer(sosNative.SosDevice.INFO_PACKET_SIZE);
+var controlPackets = [{ ledMode: 0, manualLeds0: 1 }, { ledMode: 0, manualLeds0: 0 }];
+var controlCalls = 0;
+
+var operations = {
+  readInfo: function(device, callback) {
+    device.readInfo(callback);
+  },
+  readInfoInto: function(device, callback) {
+    device.readInfoInto(infoBuffer, callback);
+  },
+  readLedPatterns: function(device, callback) {
+    device.readLedPatterns(callback);
+  },
+  readAudioPatterns: function(device, callback) {
+    device.readAudioPatterns(callback);
+  },
+  readAllInfo: function(device, callback) {
+    device.readAllInfo(callback);
+  },
+  sendControlPacket: function(device, callback) {
+    device.sendControlPacket(controlPackets[controlCalls++ % 2], callback);
+  },
+  sendControlBuffer: function(device, callback) {
+    device.sendControlBuffer(controlBuffers[controlCalls++ % 2], callback);
+  }
+};
+
+function parseArgs(args) {
+  var result = {
+    device: 'mock',
+    ops: Object.keys(operations),
+    iterations: 10000,
+    concurrency: 1,
+    latency: 0,
+    json: false
+  };
+  for (var i = 0; i < args.length; i++) {
+    switch (args[i]) {
+    case '--device': result.device = args[++i]; break;
+    case '--ops': result.ops = args[++i].split(','); break;
+    case '--iterations': result.iterations = parseInt(args[++i], 10); break;
+    case '--concurrency': result.concurrency = parseInt(args[++i], 10); break;
+    case '--latency': result.latency = parseInt(args[++i], 10); break;
+    case '--json': result.json = true; break;
+    default:
+      console.error('unknown option ' + args[i]);
+      process.exit(1);
+    }
+  }
+  return result;
+}
+
+function percentile(sorted, p) {
+  if (sorted.length === 0) {
+    return 0;
+  }
+  return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+function gc() {
+  if (global.gc) {
+    global.gc();
+  }
+}
+
+function run(device, name, callback) {
+  var op = operations[name];
+  var latencies = new Float64Array(options.iterations);
+  var ioTimes = new Float64Array(options.iterations);
+  var started = 0;
+  var completed = 0;
+  var errors = 0;
+
+  gc();
+  var heapBefore = process.memoryUsage().heapUsed;
+  var start = process.hrtime();
+
+  for (var i = 0; i < options.concurrency && started < options.iterations; i++) {
+    next();
+  }
+
+  function next() {
+    var index = started++;
+    var callStart = process.hrtime();
+    op(device, function(err, result, ioTime) {
+      var elapsed = process.hrtime(callStart);
+      latencies[index] = elapsed[0] * 1e9 + elapsed[1];
+      ioTimes[index] = ioTime || 0;
+      if (err) {
+        errors++;
+      }
+      if (++completed === options.iterations) {
+        return done();
+      }
+      if (started < options.iterations) {
+        return next();
+      }
+    });
+  }
+
+  function done() {
+    var elapsed = process.hrtime(start);
+    var totalNs = elapsed[0] * 1e9 + elapsed[1];
+    var heapDelta = process.memoryUsage().heapUsed - heapBefore;
+    var sorted = Array.prototype.slice.call(latencies).sort(function(a, b) { return a - b; });
+    var ioTotal = 0;
+    var latencyTotal = 0;
+    for (var i = 0; i < options.iterations; i++) {
+      ioTotal += ioTimes[i];
+      latencyTotal += latencies[i];
+    }
+    callback({
+      operation: name,
+      device: options.device,
+      iterations: options.iterations,
+      concurrency: options.concurrency,
+      errors: errors,
+      opsPerSecond: options.iterations * 1e9 / totalNs,
+      p50Us: percentile(sorted, 0.5) / 1e3,
+      p99Us: percentile(sorted, 0.99) / 1e3,
+      meanUs: latencyTotal / options.iterations / 1e3,
+      meanIoUs: ioTotal / options.iterations / 1e3,
+      heapBytesPerOp: heapDelta / options.iterations
+    });
+  }
+}
+
+function report(result) {
+  if (options.json) {
+    return console.log(JSON.stringify(result));
+  }
+  console.log(result.operation + ': ' +
+    result.opsPerSecond.toFixed(0) + ' ops/s, p50 ' + result.p50Us.toFixed(1) + ' us, p99 ' +
+    result.p99Us.toFixed(1) + ' us, io ' + result.meanIoUs.toFixed(1) + ' of ' + result.meanUs.toFixed(1) +
+    ' us, heap ' + result.heapBytesPerOp.toFixed(0) + ' B/op' + (result.errors ? ', ' + result.errors + ' errors' : ''));
+}
+
+function connect(callback) {
+  if (options.device === 'mock') {
+    sosNative.addMockDevice({ latency: options.latency });
+    return sosNative.findDevice({ transport: 'mock' }, callback);
+  }
+  return sosNative.findDevice(callback);
+}
+
+connect(function(err, device) {
+  if (err) {
+    console.error(err);
+    return process.exit(1);
+  }
+  var remaining = options.ops.slice();
+  (function nextOp() {
+    var name = remaining.shift();
+    if (!name) {
+      return;
+    }
+    if (!operations[name]) {
+      console.error('unknown operation ' + name);
+      return process.exit(1);
+    }
+    run(device, name, function(result) {
+      report(result);
+      nextOp();
+    });
+  })();
+});
@@ -0,0 +1,64 @@
+'use strict';
+
+// Compares getting a device back with a fresh connect (a lookup, then
+// opening it) against reconnect(), which reopens it at its known location.
+//
+//   node bench/reconnect.js [iterations] [transport]
+
+var path = require('path');
+var sosNative = require(path.join(__dirname, '../build/Release/sos.node'));
+
+var iterations = parseInt(process.argv[2], 10) || 100;
+var transport = process.argv[3] || 'usb';
+
+function check(err) {
+  if (err) {
+    console.error(err);
+    return process.exit(1);
+  }
+}
+
+function run(name, iteration, callback) {
+  var remaining = iterations;
+  var start = process.hrtime();
+
+  return next();
+
+  function next() {
+    if (remaining-- === 0) {
+      var elapsed = process.hrtime(start);
+      var totalUs = elapsed[0] * 1e6 + elapsed[1] / 1e3;
+      console.log(name + ': ' + (totalUs / iterations).toFixed(1) + ' us/open (' + iterations + ' opens)');
+      return callback();
+    }
+    return iteration(next);
+  }
+}
+
+if (transport === 'mock') {
+  sosNative.addMockDevice();
+}
+
+sosNative.findDevice({ transport: transport }, function(err, device) {
+  check(err);
+
+  run('connect (rescan)', function(next) {
+    device.close(function(err) {
+      check(err);
+      sosNative.findDevice({ transport: transport, refresh: true }, function(err, opened) {
+        check(err);
+        device = opened;
+        return next();
+      });
+    });
+  }, function() {
+    run('reconnect', function(next) {
+      device.reconnect(function(err) {
+        check(err);
+        return next();
+      });
+    }, function() {
+      device.close();
+    });
+  });
+});
@@ -1,37 +1,64 @@
 {
+  "variables": {
+    "sos_sources": [
+      "src/binding.cpp",
+      "src/broker.cpp",
+      "src/hidrawTransport.cpp",
+      "src/hotplug.cpp",
+      "src/ledAnimation.cpp",
+      "src/mockTransport.cpp",
+      "src/nodeSos.cpp",
+      "src/statusPoller.cpp",
+      "src/usbEvents.cpp"
+    ]
+  },
+  "target_defaults": {
+    'include_dirs': [
+      "<!(node -e \"require('nan')\")",
+    ],
+    "cflags": ['-fexceptions'],
+    "cflags_cc": ['-fexceptions'],
+    "conditions" : [
+      [
+        'OS=="mac"', {
+          'xcode_settings': {
+            'GCC_ENABLE_CPP_EXCEPTIONS': 'YES'
+          }
+        }
+      ],
+      [
+        'OS!="win"', {
+          'include_dirs': [
+            "<!@(pkg-config --cflags-only-I libusb-1.0 | sed s/-I//g)"
+          ],
+          "libraries" : [
+            "<!@(pkg-config --libs libusb-1.0)"
+          ]
+        }
+      ],
+      [
+        'OS=="win"', {
+          "libraries" : [
+          ]
+        }
+      ]
+    ]
+  },
   "targets": [
     {
       "target_name": "sos",
       "sources": [
-        "src/binding.cpp",
-        "src/nodeSos.cpp"
-      ],
-      'include_dirs': [
-        "<!(node -e \"require('nan')\")",
+        "<@(sos_sources)"
+      ]
+    },
+    {
+      # same module with per-call device I/O timing, used by bench/operations.js
+      "target_name": "sos_bench",
+      "sources": [
+        "<@(sos_sources)"
       ],
-      "cflags": ['-fexceptions'],
-      "cflags_cc": ['-fexceptions'],
-      "conditions" : [
-        [
-          'OS=="mac"', {
-            'xcode_settings': {
-              'GCC_ENABLE_CPP_EXCEPTIONS': 'YES'
-            }
-          }
-        ],
-        [
-          'OS!="win"', {
-            "libraries" : [
-              '-lusb'
-            ]
-          }
-        ],
-        [
-          'OS=="win"', {
-            "libraries" : [
-            ]
-          }
-        ]
+      "defines": [
+        "SOS_BENCH"
       ]
     }
   ]
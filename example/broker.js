@@ -0,0 +1,23 @@
+// Shares the first Siren of Shame found with other processes:
+//   node example/broker.js /tmp/sos.sock
+// and elsewhere sos.connect({ transport: 'broker', path: '/tmp/sos.sock' }, ...).
+var sos = require('../');
+
+var socketPath = process.argv[2] || '/tmp/sos-device.sock';
+
+sos.connect(function(err, sosDevice) {
+  if (err) {
+    console.error(err);
+    process.exit(1);
+  }
+
+  sosDevice.startBroker(socketPath);
+  console.log('Serving the siren on ' + socketPath);
+
+  process.on('SIGINT', function() {
+    sosDevice.stopBroker();
+  });
+  process.on('SIGTERM', function() {
+    sosDevice.stopBroker();
+  });
+});
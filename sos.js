@@ -1,46 +1,255 @@
 'use strict';
 
 var path = require('path');
+var EventEmitter = require('events').EventEmitter;
 var sosNative = require(path.join(__dirname, 'build/Release/sos.node'));
 
-exports.connect = function(callback) {
-  return sosNative.findDevice(function(err, device) {
+exports.list = function(options, callback) {
+  if (typeof options === 'function') {
+    return sosNative.findDevices(options);
+  }
+  return sosNative.findDevices(options, callback);
+};
+
+exports.connect = function(descriptor, callback) {
+  if (typeof descriptor === 'function') {
+    return sosNative.findDevice(onOpen(descriptor));
+  }
+  return sosNative.openDevice(descriptor, onOpen(callback));
+};
+
+exports.connectAll = function(callback) {
+  return exports.list(function(err, descriptors) {
     if (err) {
       return callback(err);
     }
-    device.readInfo(function(err, info) {
+
+    var devices = [];
+    var remaining = descriptors.length;
+    var failed = false;
+    if (remaining === 0) {
+      return callback(null, devices);
+    }
+    descriptors.forEach(function(descriptor, i) {
+      exports.connect(descriptor, function(err, device) {
+        if (failed) {
+          return;
+        }
+        if (err) {
+          failed = true;
+          return callback(err);
+        }
+        devices[i] = device;
+        if (--remaining === 0) {
+          return callback(null, devices);
+        }
+      });
+    });
+  });
+};
+
+// Several devices driven as one; see sendControlPackets.
+function DeviceGroup(devices) {
+  this.devices = devices.slice();
+}
+
+DeviceGroup.prototype.sendControlPacket = function(packets, options, callback) {
+  if (typeof options === 'function') {
+    return sosNative.sendControlPackets(this.devices, packets, options);
+  }
+  return sosNative.sendControlPackets(this.devices, packets, options, callback);
+};
+
+exports.group = function(devices) {
+  return new DeviceGroup(devices);
+};
+
+exports.CONTROL_PACKET_SIZE = sosNative.SosDevice.CONTROL_PACKET_SIZE;
+exports.INFO_PACKET_SIZE = sosNative.SosDevice.INFO_PACKET_SIZE;
+exports.parseInfo = sosNative.parseInfo;
+
+// Emulated devices for running without hardware; list and connect to them
+// with { transport: 'mock' }.
+exports.addMockDevice = sosNative.addMockDevice;
+exports.removeMockDevice = sosNative.removeMockDevice;
+exports.inspectMockDevice = sosNative.inspectMockDevice;
+
+// Returns a UsbControlPacket buffer with every field set to "don't change".
+exports.createControlBuffer = function() {
+  var buffer;
+  if (Buffer.alloc) {
+    buffer = Buffer.alloc(exports.CONTROL_PACKET_SIZE, 0xff);
+  } else {
+    buffer = new Buffer(exports.CONTROL_PACKET_SIZE);
+    buffer.fill(0xff);
+  }
+  buffer[0] = 0; // reportId
+  buffer[1] = 0; // controlByte1
+  return buffer;
+};
+
+// Bytes handed to the native uploader at a time when uploading a stream; a
+// multiple of the 32 byte UsbDataPacket payload.
+var UPLOAD_STREAM_CHUNK_SIZE = 32 * 128;
+
+sosNative.SosDevice.prototype.upload = function(address, source, onProgress, callback) {
+  if (!callback) {
+    callback = onProgress;
+    onProgress = null;
+  }
+  if (Buffer.isBuffer(source)) {
+    return this.uploadData(address, source, onProgress, callback);
+  }
+  return uploadStream(this, address, source, onProgress, callback);
+};
+
+function uploadStream(device, address, stream, onProgress, callback) {
+  var pending = [];
+  var pendingLength = 0;
+  var bytesSent = 0;
+  var elapsedMs = 0;
+  var uploading = false;
+  var ended = false;
+  var failed = false;
+
+  stream.on('data', function(chunk) {
+    pending.push(chunk);
+    pendingLength += chunk.length;
+    if (pendingLength >= UPLOAD_STREAM_CHUNK_SIZE) {
+      stream.pause();
+      flush();
+    }
+  });
+  stream.on('end', function() {
+    ended = true;
+    flush();
+  });
+  stream.on('error', fail);
+
+  function flush() {
+    if (uploading || failed) {
+      return;
+    }
+    var data = Buffer.concat(pending, pendingLength);
+    var length = ended ? data.length : data.length - (data.length % UPLOAD_STREAM_CHUNK_SIZE);
+    if (length === 0) {
+      return ended ? done() : stream.resume();
+    }
+    pending = [data.slice(length)];
+    pendingLength = data.length - length;
+
+    uploading = true;
+    var progress = onProgress ? function(sent) {
+      onProgress(bytesSent + sent);
+    } : null;
+    device.uploadData(address + bytesSent, data.slice(0, length), progress, function(err, result) {
+      uploading = false;
       if (err) {
-        return callback(err);
+        return fail(err);
       }
+      bytesSent += result.bytes;
+      elapsedMs += result.elapsedMs;
+      if (ended) {
+        return flush();
+      }
+      return stream.resume();
+    });
+  }
 
-      device.readAllInfo = readAllInfo.bind(device);
-
-      return callback(null, device);
+  function done() {
+    return callback(null, {
+      bytes: bytesSent,
+      elapsedMs: elapsedMs,
+      bytesPerSecond: elapsedMs > 0 ? bytesSent * 1000 / elapsedMs : 0
     });
-  });
+  }
+
+  function fail(err) {
+    if (failed) {
+      return;
+    }
+    failed = true;
+    return callback(err);
+  }
+}
+
+// Returns an EventEmitter for the device's playback state, polled natively;
+// see startStatusPoller. Calling it again returns the same emitter.
+sosNative.SosDevice.prototype.watchStatus = function(options) {
+  if (this._statusWatcher) {
+    return this._statusWatcher;
+  }
+
+  var watcher = this._statusWatcher = new EventEmitter();
+  // A failed poll is not fatal, so it must not throw when nobody listens.
+  watcher.on('error', function() {});
+  var onEvent = function(event, data) {
+    watcher.emit(event, data);
+  };
+  if (options) {
+    this.startStatusPoller(options, onEvent);
+  } else {
+    this.startStatusPoller(onEvent);
+  }
+  return watcher;
+};
+
+sosNative.SosDevice.prototype.unwatchStatus = function() {
+  if (!this._statusWatcher) {
+    return;
+  }
+  this.stopStatusPoller();
+  this._statusWatcher = null;
 };
 
-function readAllInfo(callback) {
-  var self = this;
-  self.readInfo(function(err, deviceInfo) {
+// close and reconnect stop the poller natively, so the old watcher is dropped
+// and the next watchStatus starts a new one.
+['close', 'reconnect'].forEach(function(name) {
+  var release = sosNative.SosDevice.prototype[name];
+  sosNative.SosDevice.prototype[name] = function(callback) {
+    this._statusWatcher = null;
+    return release.call(this, callback);
+  };
+});
+
+var monitor = null;
+
+exports.monitor = function(options) {
+  if (monitor) {
+    return monitor;
+  }
+
+  monitor = new EventEmitter();
+  var onEvent = function(event, descriptor) {
+    monitor.emit(event, descriptor);
+  };
+  if (options) {
+    sosNative.startHotplug(options, onEvent);
+  } else {
+    sosNative.startHotplug(onEvent);
+  }
+  return monitor;
+};
+
+exports.stopMonitor = function() {
+  if (!monitor) {
+    return;
+  }
+  sosNative.stopHotplug();
+  monitor = null;
+};
+
+function onOpen(callback) {
+  return function(err, device) {
     if (err) {
       return callback(err);
     }
-
-    return self.readLedPatterns(function(err, ledPatterns) {
+    device.readInfo(function(err, info) {
       if (err) {
         return callback(err);
       }
 
-      deviceInfo.ledPatterns = ledPatterns;
-      return self.readAudioPatterns(function(err, audioPatterns) {
-        if (err) {
-          return callback(err);
-        }
-
-        deviceInfo.audioPatterns = audioPatterns;
-        return callback(null, deviceInfo);
-      });
-    })
-  });
-}
\ No newline at end of file
+      return callback(null, device);
+    });
+  };
+}
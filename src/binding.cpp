@@ -5,8 +5,22 @@ extern "C" {
   void init (v8::Handle<v8::Object> target)
   {
     Nan::SetMethod(target, "findDevice", findDevice);
+    Nan::SetMethod(target, "findDevices", findDevices);
+    Nan::SetMethod(target, "openDevice", openDevice);
+    Nan::SetMethod(target, "startHotplug", startHotplug);
+    Nan::SetMethod(target, "stopHotplug", stopHotplug);
+    Nan::SetMethod(target, "parseInfo", parseInfo);
+    Nan::SetMethod(target, "addMockDevice", addMockDevice);
+    Nan::SetMethod(target, "removeMockDevice", removeMockDevice);
+    Nan::SetMethod(target, "inspectMockDevice", inspectMockDevice);
+    Nan::SetMethod(target, "sendControlPackets", sendControlPackets);
     SosDevice::Init(target);
   }
 }
 
-NODE_MODULE(sos, init);
+// binding.gyp also builds the sources as sos_bench, see bench/operations.js
+#ifdef SOS_BENCH
+  NODE_MODULE(sos_bench, init);
+#else
+  NODE_MODULE(sos, init);
+#endif
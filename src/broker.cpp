@@ -0,0 +1,799 @@
+#ifndef WIN32
+
+#include "nodeSos.h"
+#include "brokerProtocol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <deque>
+#include <list>
+
+/*
+ * Lets several processes share one siren. The process that opened it serves
+ * its reports on a Unix domain socket (device.startBroker) and the others
+ * connect with { transport: 'broker', path }, so only the broker ever claims
+ * the interface.
+ *
+ * A client sends one report at a time and holds the device from the first
+ * report after taking its transfer lock until it releases the lock. For that
+ * whole operation the broker takes a turn in the device's call queue and
+ * keeps the device's transfer lock, so multi-report operations such as
+ * pattern enumeration are never interleaved with other clients' reports or
+ * with this process's own calls. Clients waiting for the device are served
+ * round robin, one operation each, and this process's calls get the device
+ * between operations. A client that holds the device without sending its
+ * next report for holdTimeoutMs is disconnected, which fails its operation
+ * and frees the device.
+ * An operation that starts with an info read while another client's info
+ * read is in flight is answered with that read's result; other reports are
+ * never shared, since pattern reads advance a cursor on the device.
+ *
+ * The broker runs on the loop thread and transfers on the thread pool. The
+ * client side blocks the worker thread holding the device's transfer lock,
+ * like every other transport.
+ */
+
+// A broker that goes away must fail the send rather than raise SIGPIPE:
+// MSG_NOSIGNAL where send() takes it, SO_NOSIGPIPE on the socket elsewhere
+// (macOS).
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
+
+struct BrokerRequest {
+  BrokerRequestHeader header;
+  char payload[BROKER_MAX_PAYLOAD];
+};
+
+struct BrokerResponse {
+  BrokerResponseHeader header;
+  char payload[BROKER_MAX_PAYLOAD];
+};
+
+static int connectBroker(const std::string &path, bool retryable) {
+  struct sockaddr_un addr;
+
+  if(path.empty() || path.size() >= sizeof(addr.sun_path)) {
+    throw NodeSosException(SOS_ERROR_NOT_FOUND, SOS_PHASE_OPEN, -1, 0, false, "Invalid broker socket path: '%s'", path.c_str());
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd >= 0) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    #ifdef SO_NOSIGPIPE
+      int noSigpipe = 1;
+      setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &noSigpipe, sizeof(noSigpipe));
+    #endif
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+      return fd;
+    }
+  }
+  int error = errno;
+  if(fd >= 0) {
+    close(fd);
+  }
+  throw NodeSosException(errnoErrorCode(error), SOS_PHASE_OPEN, -1, error, retryable,
+    "Could not connect to broker %s: %s", path.c_str(), strerror(error));
+}
+
+// Returns 0 if something accepts connections at path, or an errno value.
+// Never blocks, so a busy listener counts as one.
+static int probeBroker(const std::string &path) {
+  struct sockaddr_un addr;
+
+  if(path.size() >= sizeof(addr.sun_path)) {
+    return ENAMETOOLONG;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0) {
+    return errno;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  int error = 0;
+  if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 && errno != EAGAIN && errno != EINPROGRESS) {
+    error = errno;
+  }
+  close(fd);
+  return error;
+}
+
+// Returns 0 once fd is readable, or an errno value.
+static int waitReadable(int fd, uint64_t deadline) {
+  struct pollfd pollFd;
+  pollFd.fd = fd;
+  pollFd.events = POLLIN;
+
+  for(;;) {
+    int timeout = -1;
+    if(deadline != 0) {
+      uint64_t now = uv_hrtime();
+      if(now >= deadline) {
+        return ETIMEDOUT;
+      }
+      timeout = (int)((deadline - now + 999999) / 1000000);
+    }
+    int result = poll(&pollFd, 1, timeout);
+    if(result > 0) {
+      return 0;
+    }
+    if(result < 0 && errno != EINTR) {
+      return errno;
+    }
+  }
+}
+
+class BrokerTransport : public SosTransport {
+  std::string path;
+  int fd;           // -1 after a failure; reconnected by the next request
+  bool inOperation; // a report was sent since the last release
+
+public:
+  BrokerTransport(const std::string &path, int fd) : path(path), fd(fd), inOperation(false) {
+  }
+
+  ~BrokerTransport() {
+    disconnect();
+  }
+
+  void getInputReport(int reportId, char *buf, int bufSize, unsigned int timeoutMs) {
+    request(BROKER_REQUEST_INPUT, reportId, buf, bufSize, timeoutMs);
+  }
+
+  void setOutputReport(int reportId, char *buf, int bufSize, unsigned int timeoutMs) {
+    request(BROKER_REQUEST_OUTPUT, reportId, buf, bufSize, timeoutMs);
+  }
+
+  void endOperation() {
+    if(!inOperation) {
+      return;
+    }
+    inOperation = false;
+    BrokerRequestHeader release;
+    memset(&release, 0, sizeof(release));
+    release.type = BROKER_REQUEST_RELEASE;
+    if(sendAll(&release, sizeof(release)) != 0) {
+      disconnect();
+    }
+  }
+
+private:
+  void disconnect() {
+    if(fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+    // the broker releases a client's hold when it goes away
+    inOperation = false;
+  }
+
+  void request(uint8_t type, int reportId, char *buf, int bufSize, unsigned int timeoutMs) {
+    BrokerRequest request;
+    BrokerResponse response;
+
+    if(bufSize < 1 || bufSize > BROKER_MAX_PAYLOAD) {
+      throw NodeSosException(SOS_ERROR_OUT_OF_RANGE, SOS_PHASE_TRANSFER, reportId, 0, false, "Report of %d bytes cannot be brokered", bufSize);
+    }
+    if(fd < 0) {
+      fd = connectBroker(path, !inOperation);
+    }
+
+    bool first = !inOperation;
+    request.header.type = type;
+    request.header.flags = first ? BROKER_FLAG_FIRST : 0;
+    request.header.reportId = (uint8_t)reportId;
+    request.header.length = (uint8_t)bufSize;
+    size_t requestSize = sizeof(BrokerRequestHeader);
+    if(type == BROKER_REQUEST_OUTPUT) {
+      memcpy(request.payload, buf, bufSize);
+      requestSize += bufSize;
+    }
+    inOperation = true;
+
+    uint64_t deadline = timeoutMs > 0 ? uv_hrtime() + timeoutMs * 1000000ULL : 0;
+    int error = sendAll(&request, requestSize);
+    if(error == 0) {
+      error = receiveAll(&response.header, sizeof(response.header), deadline);
+    }
+    if(error == 0) {
+      error = receiveAll(response.payload, response.header.length, deadline);
+    }
+    if(error != 0) {
+      disconnect();
+      if(error == ETIMEDOUT && stats != NULL) {
+        stats->recordTimeout(type == BROKER_REQUEST_OUTPUT, reportId);
+      }
+      // the hold is lost with the connection, so only an operation's first
+      // report can safely be sent again
+      throw NodeSosException(errnoErrorCode(error), SOS_PHASE_TRANSFER, reportId, error, first,
+        "Broker %s: %s", path.c_str(), strerror(error));
+    }
+
+    if(response.header.status != 0) {
+      throw NodeSosException((SosErrorCode)(response.header.status - 1), (SosErrorPhase)response.header.phase, reportId,
+        response.header.nativeError, response.header.retryable != 0, "%.*s", (int)response.header.length, response.payload);
+    }
+    if(type == BROKER_REQUEST_INPUT) {
+      memcpy(buf, response.payload, response.header.length < bufSize ? response.header.length : bufSize);
+    }
+  }
+
+  // Both return 0 or an errno value.
+  int sendAll(const void *data, size_t length) {
+    size_t sent = 0;
+    while(sent < length) {
+      ssize_t result = send(fd, (const char*)data + sent, length - sent, MSG_NOSIGNAL);
+      if(result < 0) {
+        if(errno == EINTR) {
+          continue;
+        }
+        return errno;
+      }
+      sent += result;
+    }
+    return 0;
+  }
+
+  int receiveAll(void *data, size_t length, uint64_t deadline) {
+    size_t received = 0;
+    while(received < length) {
+      int error = waitReadable(fd, deadline);
+      if(error != 0) {
+        return error;
+      }
+      ssize_t result = recv(fd, (char*)data + received, length - received, 0);
+      if(result == 0) {
+        return ECONNRESET;
+      }
+      if(result < 0) {
+        if(errno == EINTR) {
+          continue;
+        }
+        return errno;
+      }
+      received += result;
+    }
+    return 0;
+  }
+};
+
+SosTransport *openBrokerTransport(const SosDeviceDescriptor &descriptor) {
+  return new BrokerTransport(descriptor.address, connectBroker(descriptor.address, false));
+}
+
+struct BrokerClient {
+  uv_pipe_t pipe;
+  SosBroker *broker;
+  std::deque<BrokerRequest> pending;
+  bool queued;          // waiting in the broker's rotation
+  BrokerRequest inbound; // the frame being read
+  size_t inboundLength;
+  char readBuffer[1024];
+};
+
+struct BrokerWrite {
+  uv_write_t req;
+  BrokerResponse response;
+};
+
+class SosBroker : public SosDeviceCall {
+public:
+  SosBroker(SosDevice *sosDevice, v8::Local<v8::Object> device, const std::string &path, uint32_t holdTimeoutMs);
+
+  // Throws NodeSosException when the socket cannot be bound.
+  void listen();
+  // Closes every connection; the broker deletes itself once all are closed.
+  void close();
+  // The broker's turn in the device's call queue has come.
+  void start();
+
+private:
+  SosDevice *sosDevice;
+  Nan::Persistent<v8::Object> device;
+  std::string path;
+  uv_pipe_t server;
+  uv_timer_t holdTimer; // runs while holder has the device but sends nothing
+  uint32_t holdTimeoutMs;
+  int openHandles;
+  bool closing;
+
+  std::list<BrokerClient*> clients;
+  std::deque<BrokerClient*> rotation; // clients with pending requests, in turn order
+  BrokerClient *holder;               // client whose operation holds the device
+  bool waitingForTurn;                // queued on the device for holder
+  bool hasTurn;                       // local calls wait until endTurn
+  bool locked;                        // the transfer lock is held for holder
+
+  // the transfer in flight
+  uv_work_t work;
+  bool busy;
+  BrokerClient *current; // NULL once its client went away
+  BrokerRequest request;
+  bool failed;
+  NodeSosException error;
+
+  ~SosBroker();
+
+  void accept();
+  void received(BrokerClient *client, ssize_t nread, const char *data);
+  void receive(BrokerClient *client, const BrokerRequest &request);
+  void closeClient(BrokerClient *client);
+  void handleClosed();
+  void deleteIfDone();
+  void schedule();
+  void endTurn();
+  void respond(BrokerClient *client);
+  void shareInfo();
+  void leaveRotation(BrokerClient *client);
+
+  static void onConnection(uv_stream_t *server, int status);
+  static void onAlloc(uv_handle_t *handle, size_t suggestedSize, uv_buf_t *buf);
+  static void onRead(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+  static void onWriteDone(uv_write_t *req, int status);
+  static void onHandleClosed(uv_handle_t *handle);
+  static void onHoldExpired(uv_timer_t *handle);
+  static void onClientClosed(uv_handle_t *handle);
+  static void doTransfer(uv_work_t *req);
+  static void afterTransfer(uv_work_t *req, int status);
+};
+
+SosBroker::SosBroker(SosDevice *sosDevice, v8::Local<v8::Object> device, const std::string &path, uint32_t holdTimeoutMs)
+  : sosDevice(sosDevice), path(path), holdTimeoutMs(holdTimeoutMs), openHandles(0), closing(false), holder(NULL), waitingForTurn(false), hasTurn(false),
+    locked(false), busy(false), current(NULL), failed(false) {
+  // keep the device object alive while serving it
+  this->device.Reset(device);
+  work.data = this;
+}
+
+SosBroker::~SosBroker() {
+  device.Reset();
+}
+
+void SosBroker::listen() {
+  struct stat socketStat;
+
+  uv_pipe_init(uv_default_loop(), &server, 0);
+  server.data = this;
+  openHandles++;
+  uv_timer_init(uv_default_loop(), &holdTimer);
+  holdTimer.data = this;
+  uv_unref((uv_handle_t*)&holdTimer);
+  openHandles++;
+  int result = 0;
+  if(stat(path.c_str(), &socketStat) == 0 && S_ISSOCK(socketStat.st_mode)) {
+    int error = probeBroker(path);
+    if(error == 0) {
+      result = UV_EADDRINUSE;
+    } else if(error == ECONNREFUSED) {
+      // a socket left behind by a broker that did not shut down
+      unlink(path.c_str());
+    }
+  }
+  if(result == 0) {
+    result = uv_pipe_bind(&server, path.c_str());
+  }
+  if(result == 0) {
+    result = uv_listen((uv_stream_t*)&server, 16, onConnection);
+  }
+  if(result != 0) {
+    closing = true;
+    uv_close((uv_handle_t*)&server, onHandleClosed);
+    uv_close((uv_handle_t*)&holdTimer, onHandleClosed);
+    throw NodeSosException(errnoErrorCode(-result), SOS_PHASE_OPEN, -1, -result, false,
+      "Could not listen on %s: %s", path.c_str(), uv_strerror(result));
+  }
+}
+
+void SosBroker::close() {
+  closing = true;
+  unlink(path.c_str());
+  uv_close((uv_handle_t*)&server, onHandleClosed);
+  uv_close((uv_handle_t*)&holdTimer, onHandleClosed);
+  while(!clients.empty()) {
+    closeClient(clients.front());
+  }
+  if(!busy) {
+    endTurn();
+  }
+}
+
+void SosBroker::start() {
+  waitingForTurn = false;
+  hasTurn = true;
+  if(closing) {
+    endTurn();
+    deleteIfDone();
+    return;
+  }
+  schedule();
+}
+
+// Hands the device back to this process's queued calls once no operation is
+// in flight.
+void SosBroker::endTurn() {
+  if(!hasTurn) {
+    return;
+  }
+  if(!closing) {
+    uv_timer_stop(&holdTimer);
+  }
+  if(locked) {
+    sosDevice->unlock();
+    locked = false;
+  }
+  hasTurn = false;
+  sosDevice->callFinished();
+}
+
+void SosBroker::onConnection(uv_stream_t *server, int status) {
+  if(status == 0) {
+    ((SosBroker*)server->data)->accept();
+  }
+}
+
+void SosBroker::accept() {
+  BrokerClient *client = new BrokerClient;
+  client->broker = this;
+  client->queued = false;
+  client->inboundLength = 0;
+  uv_pipe_init(uv_default_loop(), &client->pipe, 0);
+  client->pipe.data = client;
+  openHandles++;
+
+  if(uv_accept((uv_stream_t*)&server, (uv_stream_t*)&client->pipe) != 0) {
+    uv_close((uv_handle_t*)&client->pipe, onClientClosed);
+    return;
+  }
+  clients.push_back(client);
+  uv_read_start((uv_stream_t*)&client->pipe, onAlloc, onRead);
+}
+
+void SosBroker::onAlloc(uv_handle_t *handle, size_t suggestedSize, uv_buf_t *buf) {
+  BrokerClient *client = (BrokerClient*)handle->data;
+  buf->base = client->readBuffer;
+  buf->len = sizeof(client->readBuffer);
+}
+
+void SosBroker::onRead(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+  BrokerClient *client = (BrokerClient*)stream->data;
+  client->broker->received(client, nread, buf->base);
+}
+
+// Only output requests carry their report; input requests just say how many
+// bytes they want.
+static size_t requestFrameLength(const BrokerRequestHeader &header) {
+  size_t length = sizeof(BrokerRequestHeader);
+  if(header.type == BROKER_REQUEST_OUTPUT) {
+    length += header.length;
+  }
+  return length;
+}
+
+// Splits the byte stream into frames.
+void SosBroker::received(BrokerClient *client, ssize_t nread, const char *data) {
+  if(nread < 0) {
+    closeClient(client);
+    schedule();
+    return;
+  }
+
+  for(ssize_t i = 0; i < nread; ) {
+    size_t frameLength = sizeof(BrokerRequestHeader);
+    if(client->inboundLength >= frameLength) {
+      frameLength = requestFrameLength(client->inbound.header);
+    }
+    size_t count = frameLength - client->inboundLength;
+    if(count > (size_t)(nread - i)) {
+      count = nread - i;
+    }
+    memcpy((char*)&client->inbound + client->inboundLength, data + i, count);
+    client->inboundLength += count;
+    i += count;
+
+    if(client->inboundLength < sizeof(BrokerRequestHeader)
+      || client->inboundLength < requestFrameLength(client->inbound.header)) {
+      continue;
+    }
+    client->inboundLength = 0;
+    receive(client, client->inbound);
+    if(uv_is_closing((uv_handle_t*)&client->pipe)) {
+      break;
+    }
+  }
+  schedule();
+}
+
+void SosBroker::receive(BrokerClient *client, const BrokerRequest &request) {
+  switch(request.header.type) {
+    case BROKER_REQUEST_RELEASE:
+      if(holder == client) {
+        holder = NULL;
+      }
+      return;
+
+    case BROKER_REQUEST_INPUT:
+    case BROKER_REQUEST_OUTPUT:
+      if(request.header.length > 0) {
+        break;
+      }
+      // fall through
+
+    default:
+      closeClient(client);
+      return;
+  }
+
+  client->pending.push_back(request);
+  if(client != holder && !client->queued) {
+    client->queued = true;
+    rotation.push_back(client);
+  }
+}
+
+void SosBroker::leaveRotation(BrokerClient *client) {
+  if(!client->queued) {
+    return;
+  }
+  client->queued = false;
+  for(std::deque<BrokerClient*>::iterator it = rotation.begin(); it != rotation.end(); ++it) {
+    if(*it == client) {
+      rotation.erase(it);
+      break;
+    }
+  }
+}
+
+void SosBroker::closeClient(BrokerClient *client) {
+  if(uv_is_closing((uv_handle_t*)&client->pipe)) {
+    return;
+  }
+  clients.remove(client);
+  leaveRotation(client);
+  client->pending.clear();
+  if(holder == client) {
+    holder = NULL;
+  }
+  if(current == client) {
+    current = NULL;
+  }
+  uv_close((uv_handle_t*)&client->pipe, onClientClosed);
+}
+
+void SosBroker::onClientClosed(uv_handle_t *handle) {
+  BrokerClient *client = (BrokerClient*)handle->data;
+  SosBroker *broker = client->broker;
+  delete client;
+  broker->handleClosed();
+}
+
+void SosBroker::onHandleClosed(uv_handle_t *handle) {
+  ((SosBroker*)handle->data)->handleClosed();
+}
+
+void SosBroker::handleClosed() {
+  openHandles--;
+  deleteIfDone();
+}
+
+// The device may still run the broker's turn, so the broker waits for that
+// as well as for its handles.
+void SosBroker::deleteIfDone() {
+  if(closing && openHandles == 0 && !busy && !waitingForTurn) {
+    delete this;
+  }
+}
+
+// Starts the next transfer: the holder's, or that of the next client in turn
+// once the device is the broker's.
+void SosBroker::schedule() {
+  if(busy || waitingForTurn || closing) {
+    return;
+  }
+  BrokerClient *client = holder;
+  if(client == NULL) {
+    // the last operation is over
+    endTurn();
+    if(rotation.empty()) {
+      return;
+    }
+    client = rotation.front();
+    rotation.pop_front();
+    client->queued = false;
+    holder = client;
+  }
+  if(client->pending.empty()) {
+    if(hasTurn) {
+      // the device waits for the holder's next report from now on
+      uv_timer_start(&holdTimer, onHoldExpired, holdTimeoutMs, 0);
+    }
+    return;
+  }
+  if(!hasTurn) {
+    // start() may run right away and schedule again
+    waitingForTurn = true;
+    sosDevice->queueCall(this);
+    return;
+  }
+
+  uv_timer_stop(&holdTimer);
+  request = client->pending.front();
+  client->pending.pop_front();
+  current = client;
+  failed = false;
+  busy = true;
+  uv_queue_work(uv_default_loop(), &work, doTransfer, afterTransfer);
+}
+
+// The holder stalled in the middle of an operation, so it loses the device;
+// with its connection gone its next report fails.
+void SosBroker::onHoldExpired(uv_timer_t *handle) {
+  SosBroker *broker = (SosBroker*)handle->data;
+  BrokerClient *client = broker->holder;
+
+  if(client == NULL || broker->busy || !client->pending.empty()) {
+    return;
+  }
+  broker->closeClient(client);
+  broker->schedule();
+}
+
+void SosBroker::doTransfer(uv_work_t *req) {
+  SosBroker *broker = (SosBroker*)req->data;
+  BrokerRequest &request = broker->request;
+
+  // the lock is kept until the operation ends, see endTurn
+  if(broker->locked) {
+    broker->sosDevice->beginCall(broker->sosDevice->getCallOptions(), uv_hrtime());
+  } else {
+    broker->sosDevice->lock();
+    broker->locked = true;
+  }
+  try {
+    if(request.header.type == BROKER_REQUEST_OUTPUT && request.header.reportId == USB_REPORTID_OUT_CONTROL
+      && request.header.length == sizeof(UsbControlPacket)) {
+      // keeps the broker's shadow state current for every client
+      broker->sosDevice->writeControlPacket((UsbControlPacket*)request.payload);
+    } else {
+      broker->sosDevice->transfer(request.header.type == BROKER_REQUEST_OUTPUT, request.header.reportId, request.payload, request.header.length);
+    }
+  } catch(NodeSosException &ex) {
+    broker->failed = true;
+    broker->error = ex;
+  }
+}
+
+void SosBroker::afterTransfer(uv_work_t *req, int status) {
+  SosBroker *broker = (SosBroker*)req->data;
+
+  broker->busy = false;
+  if(broker->closing) {
+    broker->endTurn();
+    broker->deleteIfDone();
+    return;
+  }
+  if(broker->current != NULL) {
+    broker->respond(broker->current);
+    broker->current = NULL;
+  }
+  broker->shareInfo();
+  broker->schedule();
+}
+
+// Answers waiting operations that start with the info read just made.
+void SosBroker::shareInfo() {
+  if(failed || request.header.type != BROKER_REQUEST_INPUT || request.header.reportId != USB_REPORTID_IN_INFO) {
+    return;
+  }
+  for(size_t i = 0; i < rotation.size(); ) {
+    BrokerClient *client = rotation[i];
+    const BrokerRequestHeader &next = client->pending.front().header;
+    if(next.type != BROKER_REQUEST_INPUT || !(next.flags & BROKER_FLAG_FIRST)
+      || next.reportId != request.header.reportId || next.length != request.header.length) {
+      i++;
+      continue;
+    }
+    client->pending.pop_front();
+    respond(client);
+    if(client->pending.empty()) {
+      leaveRotation(client);
+    } else {
+      i++;
+    }
+  }
+}
+
+void SosBroker::respond(BrokerClient *client) {
+  BrokerWrite *write = new BrokerWrite;
+  BrokerResponseHeader &header = write->response.header;
+
+  memset(&header, 0, sizeof(header));
+  if(failed) {
+    header.status = (uint8_t)(error.code() + 1);
+    header.phase = (uint8_t)error.phase();
+    header.retryable = error.isRetryable() ? 1 : 0;
+    header.nativeError = error.nativeError();
+    size_t length = strlen(error.message());
+    header.length = (uint8_t)(length < BROKER_MAX_PAYLOAD ? length : BROKER_MAX_PAYLOAD);
+    memcpy(write->response.payload, error.message(), header.length);
+  } else if(request.header.type == BROKER_REQUEST_INPUT) {
+    header.length = request.header.length;
+    memcpy(write->response.payload, request.payload, header.length);
+  }
+
+  uv_buf_t buf = uv_buf_init((char*)&write->response, (unsigned int)(sizeof(header) + header.length));
+  if(uv_write(&write->req, (uv_stream_t*)&client->pipe, &buf, 1, onWriteDone) != 0) {
+    delete write;
+    closeClient(client);
+  }
+}
+
+void SosBroker::onWriteDone(uv_write_t *req, int status) {
+  delete (BrokerWrite*)req;
+}
+
+/*
+ * startBroker(path, [options]). Serves this device to other processes on a
+ * Unix domain socket at path, which they open with
+ * connect({ transport: 'broker', path }). options.holdTimeout is how many ms
+ * (default 5000) a client may hold the device between two of its reports.
+ * A socket at path is only replaced when nothing is listening on it; a
+ * running broker makes this fail with SOS_BUSY. The broker keeps the process running
+ * until stopBroker is called.
+ */
+NAN_METHOD(SosDevice::startBroker) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  if(!info[0]->IsString()) {
+    return Nan::ThrowTypeError("startBroker needs the socket path");
+  }
+  if(sosDevice->broker != NULL) {
+    return Nan::ThrowError("Broker is already running");
+  }
+
+  uint32_t holdTimeoutMs = getUint32Option(info[1], "holdTimeout", 5000);
+  if(holdTimeoutMs < 1) {
+    return Nan::ThrowRangeError("holdTimeout must be at least 1 ms");
+  }
+
+  Nan::Utf8String path(info[0]);
+  SosBroker *broker = new SosBroker(sosDevice, info.This(), *path, holdTimeoutMs);
+  try {
+    broker->listen();
+  } catch(NodeSosException &ex) {
+    // the broker deletes itself once its socket is closed
+    return Nan::ThrowError(ex.toV8());
+  }
+  sosDevice->broker = broker;
+}
+
+void closeBroker(SosBroker *broker) {
+  broker->close();
+}
+
+/*
+ * stopBroker(). Disconnects all clients and removes the socket. Does nothing
+ * when no broker is running.
+ */
+NAN_METHOD(SosDevice::stopBroker) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  if(sosDevice->broker != NULL) {
+    closeBroker(sosDevice->broker);
+    sosDevice->broker = NULL;
+  }
+}
+
+#endif
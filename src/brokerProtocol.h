@@ -0,0 +1,43 @@
+#ifndef _broker_protocol_h_
+#define _broker_protocol_h_
+
+#include <stdint.h>
+
+/*
+ * Framing between broker clients and the broker over its Unix domain socket,
+ * see broker.cpp. A request is a header, followed by length payload bytes
+ * for output requests only; input and output requests get exactly one
+ * response, a release gets none.
+ * Output payloads are the report as laid out in usbPackets.h, e.g. a
+ * UsbControlPacket.
+ */
+#define BROKER_REQUEST_INPUT   1
+#define BROKER_REQUEST_OUTPUT  2
+#define BROKER_REQUEST_RELEASE 3
+
+// Set on the first request after the client took its transfer lock; the
+// client holds the device from then until it sends a release.
+#define BROKER_FLAG_FIRST 0x01
+
+#define BROKER_MAX_PAYLOAD 255
+
+#pragma pack(push, 1)
+
+typedef struct _BrokerRequestHeader {
+  uint8_t type;
+  uint8_t flags;
+  uint8_t reportId;
+  uint8_t length; // bytes wanted for input requests, payload bytes otherwise
+} BrokerRequestHeader;
+
+typedef struct _BrokerResponseHeader {
+  uint8_t status;      // 0, or the SosErrorCode + 1
+  uint8_t phase;       // SosErrorPhase on error
+  uint8_t retryable;
+  uint8_t length;      // report bytes, or message bytes on error
+  int32_t nativeError;
+} BrokerResponseHeader;
+
+#pragma pack(pop)
+
+#endif
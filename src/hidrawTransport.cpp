@@ -0,0 +1,230 @@
+#ifdef __linux__
+
+#include "nodeSos.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+// Older kernel headers lack the input/output report ioctls (added in 5.11).
+#ifndef HIDIOCGINPUT
+  #define HIDIOCGINPUT(len) _IOC(_IOC_WRITE|_IOC_READ, 'H', 0x0A, len)
+#endif
+
+/*
+ * Talks to the Siren of Shame through the kernel's usbhid driver via
+ * /dev/hidrawN, so nothing is detached and the daemon only needs access to
+ * the hidraw node (e.g. from a udev rule) instead of the raw USB device.
+ * Input reports are fetched with HIDIOCGINPUT, which issues the same
+ * GET_REPORT request as the libusb transport; output reports are written to
+ * the node with the report id as first byte.
+ *
+ * Devices are located at bus "hidraw" with the node number as the address.
+ */
+
+static const char *HIDRAW_CLASS_DIR = "/sys/class/hidraw";
+
+/*
+ * The fd is non-blocking. Input reports the device sends unasked queue up in
+ * the kernel until read, so every transfer drains them first; the reports
+ * asked for are fetched with HIDIOCGINPUT rather than from that queue.
+ * Nothing here needs the event loop, so the transport can be opened and
+ * closed on any thread.
+ *
+ * Writes the node cannot take yet are polled for until timeoutMs. The
+ * HIDIOCGINPUT ioctl cannot be polled; usbhid ends each report request after
+ * its own 5 second control timeout, which bounds how long a wedged device
+ * holds the calling thread, and a report that arrives after timeoutMs counts
+ * as timed out.
+ */
+class HidrawTransport : public SosTransport {
+  int fd;
+
+public:
+  HidrawTransport(int fd) : fd(fd) {
+  }
+
+  ~HidrawTransport() {
+    close(fd);
+  }
+
+  void getInputReport(int reportId, char *buf, int bufSize, unsigned int timeoutMs) {
+    char report[64];
+
+    int length = bufSize < (int)sizeof(report) ? bufSize : (int)sizeof(report);
+    uint64_t deadline = timeoutMs > 0 ? uv_hrtime() + timeoutMs * 1000000ULL : 0;
+    drainInputReports();
+    report[0] = reportId;
+    int result = ioctl(fd, HIDIOCGINPUT(length), report);
+    int error = result < 0 ? errno : 0;
+    if(error == 0 && deadline != 0 && uv_hrtime() > deadline) {
+      error = ETIMEDOUT;
+    }
+    if(error != 0) {
+      recordTimeout(false, reportId, error);
+      throw NodeSosException(errnoErrorCode(error), SOS_PHASE_TRANSFER, reportId, error, isRetryableError(error), "HIDIOCGINPUT: %s", strerror(error));
+    }
+    memcpy(buf, report, length);
+  }
+
+  // The report is copied so the caller's packet keeps its own first byte. A
+  // write that takes less than the whole report is an error, not a success.
+  void setOutputReport(int reportId, char *buf, int bufSize, unsigned int timeoutMs) {
+    char report[64];
+
+    if(bufSize > (int)sizeof(report)) {
+      throw NodeSosException(SOS_ERROR_PROTOCOL, SOS_PHASE_TRANSFER, reportId, 0, false, "Output report too large: %d bytes", bufSize);
+    }
+    memcpy(report, buf, bufSize);
+    report[0] = reportId;
+    uint64_t deadline = timeoutMs > 0 ? uv_hrtime() + timeoutMs * 1000000ULL : 0;
+    drainInputReports();
+    ssize_t written;
+    int error = 0;
+    while((written = write(fd, report, bufSize)) < 0 && (errno == EAGAIN || errno == EINTR)) {
+      if((error = waitWritable(deadline)) != 0) {
+        break;
+      }
+    }
+    if(written < 0) {
+      if(error == 0) {
+        error = errno;
+      }
+      recordTimeout(true, reportId, error);
+      throw NodeSosException(errnoErrorCode(error), SOS_PHASE_TRANSFER, reportId, error, isRetryableError(error), "hidraw write: %s", strerror(error));
+    }
+    if(written != bufSize) {
+      throw NodeSosException(SOS_ERROR_IO, SOS_PHASE_TRANSFER, reportId, 0, true, "hidraw write: wrote %d of %d bytes", (int)written, bufSize);
+    }
+  }
+
+private:
+  // Returns 0 once the node takes writes again, or an errno value.
+  int waitWritable(uint64_t deadline) {
+    struct pollfd pollFd;
+    pollFd.fd = fd;
+    pollFd.events = POLLOUT;
+
+    int timeout = -1;
+    if(deadline != 0) {
+      uint64_t now = uv_hrtime();
+      if(now >= deadline) {
+        return ETIMEDOUT;
+      }
+      timeout = (int)((deadline - now + 999999) / 1000000);
+    }
+    int result = poll(&pollFd, 1, timeout);
+    if(result == 0) {
+      return ETIMEDOUT;
+    }
+    if(result < 0 && errno != EINTR) {
+      return errno;
+    }
+    return 0;
+  }
+
+  void drainInputReports() {
+    char report[64];
+    while(read(fd, report, sizeof(report)) > 0) {
+    }
+  }
+
+  static bool isRetryableError(int error) {
+    return error == ETIMEDOUT || error == EAGAIN || error == EINTR || error == EIO || error == EPIPE;
+  }
+
+  void recordTimeout(bool output, int reportId, int error) {
+    if(error == ETIMEDOUT && stats != NULL) {
+      stats->recordTimeout(output, reportId);
+    }
+  }
+};
+
+// Reads the HID_ID and HID_UNIQ (serial) entries of a hidraw node's uevent.
+static bool readHidrawUevent(const char *name, unsigned int *vendorId, unsigned int *productId, std::string &serial) {
+  char path[256];
+  char line[256];
+
+  snprintf(path, sizeof(path), "%s/%s/device/uevent", HIDRAW_CLASS_DIR, name);
+  FILE *uevent = fopen(path, "r");
+  if(uevent == NULL) {
+    return false;
+  }
+
+  bool found = false;
+  unsigned int busType;
+  while(fgets(line, sizeof(line), uevent) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    if(strncmp(line, "HID_ID=", 7) == 0) {
+      found = sscanf(line + 7, "%x:%x:%x", &busType, vendorId, productId) == 3;
+    } else if(strncmp(line, "HID_UNIQ=", 9) == 0) {
+      serial = line + 9;
+    }
+  }
+  fclose(uevent);
+  return found;
+}
+
+static int openHidrawNode(const std::string &address) {
+  std::string path = "/dev/hidraw" + address;
+  return open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+}
+
+void listHidrawDevices(std::vector<SosDeviceDescriptor> &descriptors) {
+  descriptors.clear();
+
+  DIR *dir = opendir(HIDRAW_CLASS_DIR);
+  if(dir == NULL) {
+    return;
+  }
+
+  struct dirent *entry;
+  while((entry = readdir(dir)) != NULL) {
+    if(strncmp(entry->d_name, "hidraw", 6) != 0) {
+      continue;
+    }
+    unsigned int vendorId, productId;
+    SosDeviceDescriptor descriptor;
+    if(!readHidrawUevent(entry->d_name, &vendorId, &productId, descriptor.serial)
+      || (int)vendorId != sosVendorId || (int)productId != sosProductId) {
+      continue;
+    }
+    descriptor.transport = TRANSPORT_HIDRAW;
+    descriptor.bus = "hidraw";
+    descriptor.address = entry->d_name + 6;
+    descriptors.push_back(descriptor);
+  }
+  closedir(dir);
+}
+
+void readHidrawInfo(SosDeviceDescriptor &descriptor) {
+  char report[64];
+
+  int fd = openHidrawNode(descriptor.address);
+  if(fd < 0) {
+    return;
+  }
+  report[0] = USB_REPORTID_IN_INFO;
+  if(ioctl(fd, HIDIOCGINPUT(sizeof(UsbInfoPacket)), report) >= 0) {
+    memcpy(&descriptor.info, report, sizeof(UsbInfoPacket));
+    descriptor.hasInfo = true;
+  }
+  close(fd);
+}
+
+SosTransport *openHidrawTransport(const SosDeviceDescriptor &descriptor) {
+  int fd = openHidrawNode(descriptor.address);
+  if(fd < 0) {
+    int error = errno;
+    throw NodeSosException(errnoErrorCode(error), SOS_PHASE_OPEN, -1, error, false,
+      "Could not open Siren of Shame: /dev/hidraw%s: %s", descriptor.address.c_str(), strerror(error));
+  }
+  return new HidrawTransport(fd);
+}
+
+#endif
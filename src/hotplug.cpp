@@ -0,0 +1,390 @@
+
+#include "nodeSos.h"
+
+#ifdef __linux__
+  #include <errno.h>
+  #include <unistd.h>
+  #include <arpa/inet.h>
+  #include <sys/socket.h>
+  #include <linux/netlink.h>
+#endif
+
+/*
+ * Watches for Siren of Shame devices being attached or detached and reports
+ * them to a single JS callback as callback(event, descriptor). On Linux the
+ * uevent netlink socket is polled from the event loop; elsewhere, or when the
+ * socket cannot be opened, a background thread rescans the busses.
+ */
+
+struct HotplugEvent {
+  bool attached;
+  SosDeviceDescriptor descriptor;
+};
+
+static uv_mutex_t eventLock;
+static uv_cond_t stopCond;
+static std::vector<HotplugEvent> pendingEvents;
+static uv_async_t *eventAsync = NULL;
+static Nan::Callback *hotplugCallback = NULL;
+
+static uv_thread_t pollThread;
+static bool pollThreadRunning = false;
+static bool stopRequested = false;
+static uint64_t pollIntervalMs = 1000;
+
+static void queueEvent(bool attached, const SosDeviceDescriptor &descriptor) {
+  HotplugEvent event;
+  event.attached = attached;
+  event.descriptor = descriptor;
+
+  uv_mutex_lock(&eventLock);
+  pendingEvents.push_back(event);
+  uv_mutex_unlock(&eventLock);
+  uv_async_send(eventAsync);
+}
+
+static void deviceAttached(const SosDeviceDescriptor &descriptor) {
+  sosDeviceAttached(descriptor);
+  queueEvent(true, descriptor);
+}
+
+static void deviceDetached(SosDeviceDescriptor &descriptor) {
+  sosDeviceDetached(descriptor);
+  queueEvent(false, descriptor);
+}
+
+#if NODE_MODULE_VERSION >= NODE_0_12_MODULE_VERSION
+static void onEvents(uv_async_t *handle) {
+#else
+static void onEvents(uv_async_t *handle, int status) {
+#endif
+  Nan::HandleScope scope;
+  std::vector<HotplugEvent> events;
+
+  uv_mutex_lock(&eventLock);
+  events.swap(pendingEvents);
+  uv_mutex_unlock(&eventLock);
+
+  for(size_t i = 0; i < events.size() && hotplugCallback != NULL; i++) {
+    v8::Local<v8::Value> callbackArgs[2];
+    callbackArgs[0] = Nan::New<v8::String>(events[i].attached ? "attach" : "detach").ToLocalChecked();
+    callbackArgs[1] = descriptorToV8(events[i].descriptor);
+    hotplugCallback->Call(2, callbackArgs);
+  }
+}
+
+static void onAsyncClosed(uv_handle_t *handle) {
+  delete (uv_async_t*)handle;
+}
+
+static void pollThreadMain(void *arg) {
+  std::vector<SosDeviceDescriptor> previous;
+  rescanSosDevices(previous);
+
+  uv_mutex_lock(&eventLock);
+  while(!stopRequested) {
+    uv_cond_timedwait(&stopCond, &eventLock, pollIntervalMs * 1000000);
+    if(stopRequested) {
+      break;
+    }
+    uv_mutex_unlock(&eventLock);
+
+    // compare locations rather than trusting the change count, another
+    // lookup may already have consumed it
+    std::vector<SosDeviceDescriptor> current;
+    rescanSosDevices(current);
+    for(size_t i = 0; i < previous.size(); i++) {
+      bool found = false;
+      for(size_t j = 0; j < current.size() && !found; j++) {
+        found = isSameLocation(previous[i], current[j]);
+      }
+      if(!found) {
+        deviceDetached(previous[i]);
+      }
+    }
+    for(size_t i = 0; i < current.size(); i++) {
+      bool found = false;
+      for(size_t j = 0; j < previous.size() && !found; j++) {
+        found = isSameLocation(current[i], previous[j]);
+      }
+      if(!found) {
+        deviceAttached(current[i]);
+      }
+    }
+    previous.swap(current);
+
+    uv_mutex_lock(&eventLock);
+  }
+  uv_mutex_unlock(&eventLock);
+}
+
+#ifdef __linux__
+  static int netlinkFd = -1;
+  static uv_poll_t *netlinkPoll = NULL;
+
+  /*
+   * The kernel multicasts uevents to group 1 as soon as a device appears,
+   * before udev has set up its nodes and permissions, so an open on attach
+   * could fail. udev passes each event on to group 2 once it has processed
+   * it, so that group is used whenever udev is running.
+   */
+  static const unsigned int KERNEL_UEVENT_GROUP = 1;
+  static const unsigned int UDEV_EVENT_GROUP = 2;
+  static bool udevEvents = false;
+
+  // Prefixes the messages udev sends, see libudev's monitor. The properties
+  // are the same NUL separated KEY=VALUE strings as in a kernel uevent.
+  struct UdevMonitorHeader {
+    char prefix[8];
+    uint32_t magic;
+    uint32_t headerSize;
+    uint32_t propertiesOffset;
+    uint32_t propertiesLength;
+    uint32_t filterSubsystemHash;
+    uint32_t filterDevtypeHash;
+    uint32_t filterTagBloomHigh;
+    uint32_t filterTagBloomLow;
+  };
+
+  static const uint32_t UDEV_MONITOR_MAGIC = 0xfeedcafe;
+
+  // hidraw nodes sit below their HID device, which is named
+  // bus:vendor:product.instance, e.g. .../0003:1D50:6037.0001/hidraw/hidraw3
+  static bool parseHidrawDevpath(const char *devpath, unsigned int *vendorId, unsigned int *productId, std::string &node) {
+    const char *hidraw = strstr(devpath, "/hidraw/hidraw");
+    if(hidraw == NULL) {
+      return false;
+    }
+    node = hidraw + strlen("/hidraw/hidraw");
+    const char *hidDevice = hidraw;
+    while(hidDevice > devpath && hidDevice[-1] != '/') {
+      hidDevice--;
+    }
+    unsigned int busType;
+    return sscanf(hidDevice, "%x:%x:%x", &busType, vendorId, productId) == 3;
+  }
+
+  /*
+   * A removed hidraw node fails the device opened on it. Nodes come and go
+   * with the USB device they belong to, which is what attach and detach
+   * report, so they raise no events of their own.
+   */
+  static void parseHidrawUevent(const char *action, const char *devpath) {
+    unsigned int vendorId, productId;
+    SosDeviceDescriptor descriptor;
+
+    if(strcmp(action, "remove") != 0 || !parseHidrawDevpath(devpath, &vendorId, &productId, descriptor.address)
+      || (int)vendorId != sosVendorId || (int)productId != sosProductId) {
+      return;
+    }
+    descriptor.transport = TRANSPORT_HIDRAW;
+    descriptor.bus = "hidraw";
+    sosDeviceDetached(descriptor);
+  }
+
+  static void parseUevent(char *buf, ssize_t length) {
+    const char *action = NULL;
+    const char *subsystem = NULL;
+    const char *devtype = NULL;
+    const char *devpath = NULL;
+    const char *product = NULL;
+    const char *busnum = NULL;
+    const char *devnum = NULL;
+    unsigned int vendorId, productId;
+
+    for(char *p = buf; p < buf + length; p += strlen(p) + 1) {
+      if(strncmp(p, "ACTION=", 7) == 0) {
+        action = p + 7;
+      } else if(strncmp(p, "SUBSYSTEM=", 10) == 0) {
+        subsystem = p + 10;
+      } else if(strncmp(p, "DEVTYPE=", 8) == 0) {
+        devtype = p + 8;
+      } else if(strncmp(p, "DEVPATH=", 8) == 0) {
+        devpath = p + 8;
+      } else if(strncmp(p, "PRODUCT=", 8) == 0) {
+        product = p + 8;
+      } else if(strncmp(p, "BUSNUM=", 7) == 0) {
+        busnum = p + 7;
+      } else if(strncmp(p, "DEVNUM=", 7) == 0) {
+        devnum = p + 7;
+      }
+    }
+
+    if(action == NULL || subsystem == NULL) {
+      return;
+    }
+    if(strcmp(subsystem, "hidraw") == 0 && devpath != NULL) {
+      parseHidrawUevent(action, devpath);
+      return;
+    }
+    if(devtype == NULL || product == NULL || busnum == NULL || devnum == NULL) {
+      return;
+    }
+    if(strcmp(subsystem, "usb") != 0 || strcmp(devtype, "usb_device") != 0) {
+      return;
+    }
+    if(sscanf(product, "%x/%x", &vendorId, &productId) != 2
+      || (int)vendorId != sosVendorId || (int)productId != sosProductId) {
+      return;
+    }
+
+    // BUSNUM/DEVNUM are zero padded like the bus and address from scanSosDevices
+    SosDeviceDescriptor descriptor;
+    descriptor.bus = busnum;
+    descriptor.address = devnum;
+    descriptor.hasInfo = false;
+    if(strcmp(action, "add") == 0) {
+      deviceAttached(descriptor);
+    } else if(strcmp(action, "remove") == 0) {
+      deviceDetached(descriptor);
+    }
+  }
+
+  static void onNetlinkReadable(uv_poll_t *handle, int status, int events) {
+    char buf[8192];
+
+    if(status < 0) {
+      return;
+    }
+    for(;;) {
+      ssize_t length = recv(netlinkFd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+      if(length <= 0) {
+        break;
+      }
+      buf[length] = '\0';
+      if(!udevEvents) {
+        parseUevent(buf, length);
+        continue;
+      }
+
+      UdevMonitorHeader header;
+      if((size_t)length < sizeof(header)) {
+        continue;
+      }
+      memcpy(&header, buf, sizeof(header));
+      if(memcmp(header.prefix, "libudev", 8) != 0 || ntohl(header.magic) != UDEV_MONITOR_MAGIC
+        || header.propertiesOffset > (uint32_t)length || header.propertiesLength > (uint32_t)length - header.propertiesOffset) {
+        continue;
+      }
+      parseUevent(buf + header.propertiesOffset, header.propertiesLength);
+    }
+  }
+
+  static bool startNetlink() {
+    struct sockaddr_nl addr;
+
+    netlinkFd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if(netlinkFd < 0) {
+      return false;
+    }
+
+    // without udev nothing waits for nodes or permissions
+    udevEvents = access("/run/udev/control", F_OK) == 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_pid = 0;
+    addr.nl_groups = udevEvents ? UDEV_EVENT_GROUP : KERNEL_UEVENT_GROUP;
+    if(bind(netlinkFd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+      close(netlinkFd);
+      netlinkFd = -1;
+      return false;
+    }
+
+    netlinkPoll = new uv_poll_t;
+    uv_poll_init(uv_default_loop(), netlinkPoll, netlinkFd);
+    uv_poll_start(netlinkPoll, UV_READABLE, onNetlinkReadable);
+    return true;
+  }
+
+  static void onNetlinkClosed(uv_handle_t *handle) {
+    delete (uv_poll_t*)handle;
+  }
+
+  static void stopNetlink() {
+    if(netlinkPoll == NULL) {
+      return;
+    }
+    uv_poll_stop(netlinkPoll);
+    uv_close((uv_handle_t*)netlinkPoll, onNetlinkClosed);
+    netlinkPoll = NULL;
+    close(netlinkFd);
+    netlinkFd = -1;
+  }
+#endif
+
+void initHotplug() {
+  uv_mutex_init(&eventLock);
+  uv_cond_init(&stopCond);
+}
+
+/*
+ * startHotplug([options], callback). options.pollInterval (ms) sets the rescan
+ * interval of the fallback thread and options.poll forces its use.
+ */
+NAN_METHOD(startHotplug) {
+  Nan::HandleScope scope;
+
+  if(hotplugCallback != NULL) {
+    return Nan::ThrowError("Hotplug monitor is already running");
+  }
+
+  bool forcePolling = false;
+  int callbackIndex = 0;
+  if(info.Length() > 1 && info[0]->IsObject()) {
+    v8::Local<v8::Object> options = info[0].As<v8::Object>();
+    v8::Local<v8::String> pollKey = Nan::New<v8::String>("poll").ToLocalChecked();
+    v8::Local<v8::String> pollIntervalKey = Nan::New<v8::String>("pollInterval").ToLocalChecked();
+    if(Nan::Has(options, pollKey).FromMaybe(false)) {
+      forcePolling = Nan::To<bool>(Nan::Get(options, pollKey).ToLocalChecked()).FromMaybe(false);
+    }
+    if(Nan::Has(options, pollIntervalKey).FromMaybe(false)) {
+      pollIntervalMs = Nan::To<uint32_t>(Nan::Get(options, pollIntervalKey).ToLocalChecked()).FromMaybe(1000);
+    }
+    callbackIndex = 1;
+  }
+
+  hotplugCallback = new Nan::Callback(info[callbackIndex].As<v8::Function>());
+  eventAsync = new uv_async_t;
+  uv_async_init(uv_default_loop(), eventAsync, onEvents);
+
+  #ifdef __linux__
+    if(!forcePolling && startNetlink()) {
+      return;
+    }
+  #endif
+
+  stopRequested = false;
+  uv_thread_create(&pollThread, pollThreadMain, NULL);
+  pollThreadRunning = true;
+}
+
+NAN_METHOD(stopHotplug) {
+  Nan::HandleScope scope;
+
+  if(hotplugCallback == NULL) {
+    return;
+  }
+
+  #ifdef __linux__
+    stopNetlink();
+  #endif
+
+  if(pollThreadRunning) {
+    uv_mutex_lock(&eventLock);
+    stopRequested = true;
+    uv_cond_signal(&stopCond);
+    uv_mutex_unlock(&eventLock);
+    uv_thread_join(&pollThread);
+    pollThreadRunning = false;
+  }
+
+  uv_close((uv_handle_t*)eventAsync, onAsyncClosed);
+  eventAsync = NULL;
+  uv_mutex_lock(&eventLock);
+  pendingEvents.clear();
+  uv_mutex_unlock(&eventLock);
+
+  delete hotplugCallback;
+  hotplugCallback = NULL;
+}
@@ -0,0 +1,155 @@
+#include "nodeSos.h"
+#include "ledAnimation.h"
+
+LedAnimation::LedAnimation(SosDevice *sosDevice, v8::Local<v8::Object> self, const std::vector<uint8_t> &frames, uint32_t frameRate, uint32_t repeat, Nan::Callback *callback)
+  : sosDevice(sosDevice), callback(callback), frames(frames), repeat(repeat) {
+  // keep the device object alive while the animation runs
+  this->self.Reset(self);
+  periodNs = 1000000000ULL / frameRate;
+  doneAsync = NULL;
+  stopRequested = false;
+  framesSent = 0;
+  framesDropped = 0;
+  elapsedNs = 0;
+  failed = false;
+  uv_mutex_init(&stopLock);
+  uv_cond_init(&stopCond);
+}
+
+LedAnimation::~LedAnimation() {
+  uv_cond_destroy(&stopCond);
+  uv_mutex_destroy(&stopLock);
+  self.Reset();
+  delete callback;
+}
+
+void LedAnimation::start() {
+  doneAsync = new uv_async_t;
+  doneAsync->data = this;
+  uv_async_init(uv_default_loop(), doneAsync, onDone);
+  uv_thread_create(&thread, threadMain, this);
+}
+
+void LedAnimation::stop() {
+  uv_mutex_lock(&stopLock);
+  stopRequested = true;
+  uv_cond_signal(&stopCond);
+  uv_mutex_unlock(&stopLock);
+}
+
+void LedAnimation::threadMain(void *arg) {
+  LedAnimation *animation = (LedAnimation*)arg;
+  animation->run();
+  uv_async_send(animation->doneAsync);
+}
+
+// Sleeps until the deadline; returns false if the animation was stopped.
+bool LedAnimation::waitUntil(uint64_t deadline) {
+  uv_mutex_lock(&stopLock);
+  while(!stopRequested) {
+    uint64_t now = uv_hrtime();
+    if(now >= deadline) {
+      break;
+    }
+    uv_cond_timedwait(&stopCond, &stopLock, deadline - now);
+  }
+  bool stopped = stopRequested;
+  uv_mutex_unlock(&stopLock);
+  return !stopped;
+}
+
+void LedAnimation::sendFrame(size_t frameIndex) {
+  UsbControlPacket usbControlPacket;
+  const uint8_t *leds = &frames[frameIndex * LED_COUNT];
+
+  initControlPacket(&usbControlPacket);
+  usbControlPacket.ledMode = LED_MODE_MANUAL;
+  usbControlPacket.manualLeds0 = leds[0];
+  usbControlPacket.manualLeds1 = leds[1];
+  usbControlPacket.manualLeds2 = leds[2];
+  usbControlPacket.manualLeds3 = leds[3];
+  usbControlPacket.manualLeds4 = leds[4];
+
+  sosDevice->lock();
+  try {
+    sosDevice->writeControlPacket(&usbControlPacket);
+  } catch(NodeSosException &ex) {
+    sosDevice->unlock();
+    throw;
+  }
+  sosDevice->unlock();
+}
+
+void LedAnimation::run() {
+  uint64_t frameCount = frames.size() / LED_COUNT;
+  uint64_t totalFrames = repeat == 0 ? 0 : frameCount * repeat;
+  uint64_t start = uv_hrtime();
+
+  for(uint64_t frame = 0; totalFrames == 0 || frame < totalFrames; frame++) {
+    if(!waitUntil(start + frame * periodNs)) {
+      break;
+    }
+
+    // skip ahead to the newest frame that is due instead of catching up
+    uint64_t due = (uv_hrtime() - start) / periodNs;
+    if(due > frame) {
+      if(totalFrames != 0 && due >= totalFrames) {
+        due = totalFrames - 1;
+      }
+      framesDropped += (uint32_t)(due - frame);
+      frame = due;
+    }
+
+    try {
+      sendFrame((size_t)(frame % frameCount));
+    } catch(NodeSosException &ex) {
+      failed = true;
+      error = ex;
+      break;
+    }
+    framesSent++;
+  }
+  elapsedNs = uv_hrtime() - start;
+}
+
+#if NODE_MODULE_VERSION >= NODE_0_12_MODULE_VERSION
+void LedAnimation::onDone(uv_async_t *handle) {
+#else
+void LedAnimation::onDone(uv_async_t *handle, int status) {
+#endif
+  LedAnimation *animation = (LedAnimation*)handle->data;
+  uv_thread_join(&animation->thread);
+  uv_close((uv_handle_t*)handle, onDoneClosed);
+  animation->complete();
+}
+
+void LedAnimation::onDoneClosed(uv_handle_t *handle) {
+  delete (uv_async_t*)handle;
+}
+
+void LedAnimation::complete() {
+  Nan::HandleScope scope;
+  v8::Local<v8::Value> callbackArgs[2];
+
+  sosDevice->animationFinished(this);
+
+  if(failed) {
+    callbackArgs[0] = error.toV8();
+    callbackArgs[1] = Nan::Undefined();
+  } else {
+    v8::Local<v8::Object> result = Nan::New<v8::Object>();
+    Nan::Set(result, Nan::New<v8::String>("framesSent").ToLocalChecked(), Nan::New<v8::Number>(framesSent));
+    Nan::Set(result, Nan::New<v8::String>("framesDropped").ToLocalChecked(), Nan::New<v8::Number>(framesDropped));
+    Nan::Set(result, Nan::New<v8::String>("elapsedMs").ToLocalChecked(), Nan::New<v8::Number>(elapsedNs / 1e6));
+    Nan::Set(result, Nan::New<v8::String>("stopped").ToLocalChecked(), Nan::New<v8::Boolean>(stopRequested));
+    callbackArgs[0] = Nan::Undefined();
+    callbackArgs[1] = result;
+  }
+
+  // the callback may start another animation on this device
+  Nan::Callback *done = callback;
+  callback = NULL;
+  done->Call(2, callbackArgs);
+  delete done;
+  delete this;
+}
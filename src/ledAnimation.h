@@ -0,0 +1,70 @@
+#ifndef _led_animation_h_
+#define _led_animation_h_
+
+#include <nan.h>
+#include <vector>
+#include "usbPackets.h"
+#include "sosTransport.h"
+
+class SosDevice;
+
+#define LED_COUNT 5
+
+/*
+ * Plays a sequence of manual LED frames on a dedicated thread. Frame i is
+ * due at start + i * period, so a late frame never pushes back the ones
+ * after it; when the thread falls a whole frame behind, the frames it missed
+ * are skipped and counted as dropped rather than sent in a burst.
+ * A brightness of 255 is the packet's "don't change" value and leaves that
+ * LED as it was.
+ *
+ * Created and completed on the main thread. The callback gets
+ * (err, { framesSent, framesDropped, elapsedMs, stopped }) once the sequence
+ * has finished, failed or been stopped.
+ */
+class LedAnimation {
+public:
+  LedAnimation(SosDevice *sosDevice, v8::Local<v8::Object> self, const std::vector<uint8_t> &frames, uint32_t frameRate, uint32_t repeat, Nan::Callback *callback);
+
+  void start();
+  // Safe to call more than once; the callback still fires exactly once.
+  void stop();
+
+private:
+  SosDevice *sosDevice;
+  Nan::Persistent<v8::Object> self;
+  Nan::Callback *callback;
+  std::vector<uint8_t> frames; // LED_COUNT brightness values per frame
+  uint64_t periodNs;
+  uint32_t repeat;             // 0 plays forever
+
+  uv_thread_t thread;
+  uv_async_t *doneAsync;
+  uv_mutex_t stopLock;
+  uv_cond_t stopCond;
+  bool stopRequested;
+
+  // written by the animation thread, read after it has been joined
+  uint32_t framesSent;
+  uint32_t framesDropped;
+  uint64_t elapsedNs;
+  bool failed;
+  NodeSosException error;
+
+  ~LedAnimation();
+
+  static void threadMain(void *arg);
+  void run();
+  bool waitUntil(uint64_t deadline);
+  void sendFrame(size_t frameIndex);
+  void complete();
+
+  #if NODE_MODULE_VERSION >= NODE_0_12_MODULE_VERSION
+    static void onDone(uv_async_t *handle);
+  #else
+    static void onDone(uv_async_t *handle, int status);
+  #endif
+  static void onDoneClosed(uv_handle_t *handle);
+};
+
+#endif
@@ -0,0 +1,536 @@
+#include "nodeSos.h"
+
+#include <stdlib.h>
+
+/*
+ * In-process Siren of Shame emulator for testing and benchmarking without
+ * hardware. Each mock device speaks the same report protocol as the firmware:
+ * control packets change the audio/LED modes and select a pattern table to
+ * read, info and read packets report the current state, and data upload
+ * packets are written to an emulated external memory. Transfers can be slowed
+ * down and made to fail to exercise timing and error paths.
+ *
+ * Mock devices are listed and opened with { transport: 'mock' } and are
+ * located at bus "mock" with their id as the address (path "mock:<id>" on
+ * Windows).
+ */
+
+struct MockDeviceOptions {
+  std::string serial;
+  uint16_t version;
+  uint8_t hardwareType;
+  uint8_t hardwareVersion;
+  uint32_t externalMemorySize;
+  std::vector<std::string> ledPatterns;
+  std::vector<std::string> audioPatterns;
+  uint32_t latencyMs;   // added to every transfer
+  uint32_t failEvery;   // fail every nth transfer, 0 to disable
+  double errorRate;     // probability of a transfer failing
+  bool transientErrors; // injected failures may be retried
+  uint32_t seed;
+};
+
+static const char *defaultLedPatterns[] = { "Flash", "Fade", "Chase", "Strobe" };
+static const char *defaultAudioPatterns[] = { "Siren", "Horn", "Chirp" };
+
+class MockSosDevice {
+public:
+  int id;
+  MockDeviceOptions options;
+  int refs;
+
+  // state below is guarded by mockLock
+  UsbInfoPacket info;
+  uint64_t audioStartTime;
+  uint64_t ledStartTime;
+  uint8_t readAudioIndex;
+  uint8_t readLedIndex;
+  uint8_t manualLeds[5];
+  std::vector<uint8_t> memory;
+  uint32_t transfers;
+  uint32_t failures;
+  uint32_t randomState;
+
+  MockSosDevice(int id, const MockDeviceOptions &options) : id(id), options(options), refs(1) {
+    memset(&info, 0, sizeof(info));
+    info.version = options.version;
+    info.hardwareType = options.hardwareType;
+    info.hardwareVersion = options.hardwareVersion;
+    info.externalMemorySize = options.externalMemorySize;
+    audioStartTime = 0;
+    ledStartTime = 0;
+    readAudioIndex = 0;
+    readLedIndex = 0;
+    memset(manualLeds, 0, sizeof(manualLeds));
+    transfers = 0;
+    failures = 0;
+    randomState = options.seed;
+  }
+
+  void getInputReport(int reportId, char *buf, int bufSize);
+  void setOutputReport(int reportId, char *buf, int bufSize);
+
+private:
+  void beginTransfer();
+  void expirePlayback();
+  void readPattern(const std::vector<std::string> &patterns, uint8_t firstId, uint8_t *index, char *buf, int bufSize);
+  void writeControlPacket(const UsbControlPacket *usbControlPacket);
+  void writeDataPacket(const UsbDataPacket *usbDataPacket);
+};
+
+static uv_mutex_t mockLock;
+static std::vector<MockSosDevice*> mockDevices;
+static int nextMockId = 1;
+
+static void releaseMockDevice(MockSosDevice *device) {
+  if(--device->refs == 0) {
+    delete device;
+  }
+}
+
+// remaining play time in 1/10 s, or 0 once it has elapsed
+static uint16_t remainingDuration(uint16_t duration, uint64_t startTime) {
+  if(duration == PLAY_DURATION_FOREVER || duration == 0) {
+    return duration;
+  }
+  uint64_t elapsed = (uv_hrtime() - startTime) / 100000000;
+  return elapsed >= duration ? 0 : (uint16_t)(duration - elapsed);
+}
+
+void MockSosDevice::beginTransfer() {
+  transfers++;
+  bool fail = options.failEvery > 0 && transfers % options.failEvery == 0;
+  if(options.errorRate > 0) {
+    randomState = randomState * 1103515245 + 12345;
+    fail = fail || ((randomState >> 16) & 0x7fff) / 32768.0 < options.errorRate;
+  }
+  if(fail) {
+    failures++;
+    throw NodeSosException(SOS_ERROR_IO, SOS_PHASE_TRANSFER, -1, 0, options.transientErrors, "Mock transfer failed");
+  }
+}
+
+void MockSosDevice::expirePlayback() {
+  if(info.audioMode != AUDIO_MODE_OFF && remainingDuration(info.audioPlayDuration, audioStartTime) == 0 && info.audioPlayDuration != 0) {
+    info.audioMode = AUDIO_MODE_OFF;
+    info.audioPlayDuration = 0;
+  }
+  if(info.ledMode != LED_MODE_OFF && remainingDuration(info.ledPlayDuration, ledStartTime) == 0 && info.ledPlayDuration != 0) {
+    info.ledMode = LED_MODE_OFF;
+    info.ledPlayDuration = 0;
+  }
+}
+
+void MockSosDevice::readPattern(const std::vector<std::string> &patterns, uint8_t firstId, uint8_t *index, char *buf, int bufSize) {
+  // UsbReadLedPacket and UsbReadAudioPacket share a layout
+  UsbReadLedPacket packet;
+  memset(&packet, 0, sizeof(packet));
+  if(*index < patterns.size()) {
+    packet.id = firstId + *index;
+    strncpy(packet.name, patterns[*index].c_str(), USB_NAME_SIZE);
+    (*index)++;
+  } else {
+    packet.id = 0xff;
+  }
+  memcpy(buf, &packet, bufSize < (int)sizeof(packet) ? bufSize : sizeof(packet));
+}
+
+void MockSosDevice::getInputReport(int reportId, char *buf, int bufSize) {
+  beginTransfer();
+  switch(reportId) {
+    case USB_REPORTID_IN_INFO: {
+      expirePlayback();
+      UsbInfoPacket current = info;
+      current.audioPlayDuration = remainingDuration(info.audioPlayDuration, audioStartTime);
+      current.ledPlayDuration = remainingDuration(info.ledPlayDuration, ledStartTime);
+      memcpy(buf, &current, bufSize < (int)sizeof(current) ? bufSize : sizeof(current));
+      break;
+    }
+    case USB_REPORTID_IN_READ_LED:
+      readPattern(options.ledPatterns, LED_MODE_INTERNAL_START, &readLedIndex, buf, bufSize);
+      break;
+    case USB_REPORTID_IN_READ_AUDIO:
+      readPattern(options.audioPatterns, AUDIO_MODE_INTERNAL_START, &readAudioIndex, buf, bufSize);
+      break;
+    default:
+      throw NodeSosException(SOS_ERROR_PROTOCOL, "Mock device: unknown input report");
+  }
+}
+
+void MockSosDevice::writeControlPacket(const UsbControlPacket *usbControlPacket) {
+  uint64_t now = uv_hrtime();
+
+  expirePlayback();
+  if(usbControlPacket->audioMode != 0xff) {
+    info.audioMode = usbControlPacket->audioMode;
+    audioStartTime = now;
+  }
+  if(usbControlPacket->audioPlayDuration != 0xffff) {
+    info.audioPlayDuration = usbControlPacket->audioPlayDuration;
+    audioStartTime = now;
+  }
+  if(usbControlPacket->ledMode != 0xff) {
+    info.ledMode = usbControlPacket->ledMode;
+    ledStartTime = now;
+  }
+  if(usbControlPacket->ledPlayDuration != 0xffff) {
+    info.ledPlayDuration = usbControlPacket->ledPlayDuration;
+    ledStartTime = now;
+  }
+  if(usbControlPacket->readAudioIndex != 0xff) {
+    readAudioIndex = usbControlPacket->readAudioIndex;
+  }
+  if(usbControlPacket->readLedIndex != 0xff) {
+    readLedIndex = usbControlPacket->readLedIndex;
+  }
+  const uint8_t *leds = &usbControlPacket->manualLeds0;
+  for(int i = 0; i < 5; i++) {
+    if(leds[i] != 0xff) {
+      manualLeds[i] = leds[i];
+    }
+  }
+}
+
+// Like the firmware, every packet is written whole, padding included.
+void MockSosDevice::writeDataPacket(const UsbDataPacket *usbDataPacket) {
+  if((uint64_t)usbDataPacket->address + USB_DATA_SIZE > info.externalMemorySize) {
+    throw NodeSosException(SOS_ERROR_OUT_OF_RANGE, "Mock device: upload address out of range");
+  }
+  if(memory.empty()) {
+    memory.resize(info.externalMemorySize, 0xff);
+  }
+  memcpy(&memory[usbDataPacket->address], usbDataPacket->data, USB_DATA_SIZE);
+}
+
+void MockSosDevice::setOutputReport(int reportId, char *buf, int bufSize) {
+  beginTransfer();
+  switch(reportId) {
+    case USB_REPORTID_OUT_CONTROL: {
+      UsbControlPacket usbControlPacket;
+      if(bufSize < (int)sizeof(usbControlPacket)) {
+        throw NodeSosException(SOS_ERROR_PROTOCOL, "Mock device: short control packet");
+      }
+      memcpy(&usbControlPacket, buf, sizeof(usbControlPacket));
+      writeControlPacket(&usbControlPacket);
+      break;
+    }
+    case USB_REPORTID_OUT_DATA_UPLOAD: {
+      UsbDataPacket usbDataPacket;
+      if(bufSize < 1 + (int)sizeof(usbDataPacket)) {
+        throw NodeSosException(SOS_ERROR_PROTOCOL, "Mock device: short data packet");
+      }
+      memcpy(&usbDataPacket, buf + 1, sizeof(usbDataPacket));
+      writeDataPacket(&usbDataPacket);
+      break;
+    }
+    default:
+      throw NodeSosException(SOS_ERROR_PROTOCOL, "Mock device: unknown output report");
+  }
+}
+
+/*
+ * Transport of an opened mock device. Holds a reference so the emulator
+ * outlives removeMockDevice; removal detaches the SosDevice instead.
+ */
+class MockTransport : public SosTransport {
+  MockSosDevice *device;
+
+public:
+  MockTransport(MockSosDevice *device) : device(device) {
+  }
+
+  ~MockTransport() {
+    uv_mutex_lock(&mockLock);
+    releaseMockDevice(device);
+    uv_mutex_unlock(&mockLock);
+  }
+
+  void getInputReport(int reportId, char *buf, int bufSize, unsigned int timeoutMs) {
+    delay(false, reportId, timeoutMs);
+    uv_mutex_lock(&mockLock);
+    try {
+      device->getInputReport(reportId, buf, bufSize);
+    } catch(NodeSosException &ex) {
+      uv_mutex_unlock(&mockLock);
+      throw;
+    }
+    uv_mutex_unlock(&mockLock);
+  }
+
+  void setOutputReport(int reportId, char *buf, int bufSize, unsigned int timeoutMs) {
+    delay(true, reportId, timeoutMs);
+    uv_mutex_lock(&mockLock);
+    try {
+      device->setOutputReport(reportId, buf, bufSize);
+    } catch(NodeSosException &ex) {
+      uv_mutex_unlock(&mockLock);
+      throw;
+    }
+    uv_mutex_unlock(&mockLock);
+  }
+
+private:
+  // Applies the configured latency; a transfer slower than its timeout is
+  // abandoned once the timeout has passed, like a real one.
+  void delay(bool output, int reportId, unsigned int timeoutMs) {
+    uint32_t latencyMs = device->options.latencyMs;
+    if(timeoutMs != 0 && latencyMs > timeoutMs) {
+      sleepMs(timeoutMs);
+      if(stats != NULL) {
+        stats->recordTimeout(output, reportId);
+      }
+      throw NodeSosException(SOS_ERROR_TIMEOUT, SOS_PHASE_TRANSFER, reportId, 0, true, "Mock transfer timed out");
+    }
+    if(latencyMs > 0) {
+      sleepMs(latencyMs);
+    }
+  }
+};
+
+static void mockDescriptor(const MockSosDevice *device, SosDeviceDescriptor &descriptor) {
+  char id[16];
+
+  sprintf(id, "%d", device->id);
+  descriptor.transport = TRANSPORT_MOCK;
+  #ifdef WIN32
+    descriptor.path = std::string("mock:") + id;
+  #else
+    descriptor.bus = "mock";
+    descriptor.address = id;
+  #endif
+  descriptor.serial = device->options.serial;
+  descriptor.info = device->info;
+  descriptor.hasInfo = true;
+}
+
+static int mockIdOf(const std::string &location) {
+  #ifdef WIN32
+    if(location.compare(0, 5, "mock:") != 0) {
+      return 0;
+    }
+    return atoi(location.c_str() + 5);
+  #else
+    return atoi(location.c_str());
+  #endif
+}
+
+// Caller holds mockLock.
+static MockSosDevice *findMockDevice(int id) {
+  for(size_t i = 0; i < mockDevices.size(); i++) {
+    if(mockDevices[i]->id == id) {
+      return mockDevices[i];
+    }
+  }
+  return NULL;
+}
+
+void initMockTransport() {
+  uv_mutex_init(&mockLock);
+}
+
+void listMockDevices(std::vector<SosDeviceDescriptor> &descriptors) {
+  descriptors.clear();
+  uv_mutex_lock(&mockLock);
+  for(size_t i = 0; i < mockDevices.size(); i++) {
+    SosDeviceDescriptor descriptor;
+    mockDescriptor(mockDevices[i], descriptor);
+    descriptors.push_back(descriptor);
+  }
+  uv_mutex_unlock(&mockLock);
+}
+
+SosTransport *openMockTransport(const SosDeviceDescriptor &descriptor) {
+  #ifdef WIN32
+    int id = mockIdOf(descriptor.path);
+  #else
+    int id = mockIdOf(descriptor.address);
+  #endif
+
+  uv_mutex_lock(&mockLock);
+  MockSosDevice *device = findMockDevice(id);
+  if(device == NULL) {
+    uv_mutex_unlock(&mockLock);
+    throw NodeSosException(SOS_ERROR_NO_DEVICE, "Could not open Siren of Shame");
+  }
+  device->refs++;
+  uv_mutex_unlock(&mockLock);
+  return new MockTransport(device);
+}
+
+static uint32_t getUint32Option(v8::Local<v8::Object> options, const char *name, uint32_t defaultValue) {
+  v8::Local<v8::String> key = Nan::New<v8::String>(name).ToLocalChecked();
+  if(!Nan::Has(options, key).FromMaybe(false)) {
+    return defaultValue;
+  }
+  return Nan::To<uint32_t>(Nan::Get(options, key).ToLocalChecked()).FromMaybe(defaultValue);
+}
+
+static bool getBoolOption(v8::Local<v8::Object> options, const char *name) {
+  v8::Local<v8::String> key = Nan::New<v8::String>(name).ToLocalChecked();
+  if(!Nan::Has(options, key).FromMaybe(false)) {
+    return false;
+  }
+  return Nan::To<bool>(Nan::Get(options, key).ToLocalChecked()).FromMaybe(false);
+}
+
+static void getPatternsOption(v8::Local<v8::Object> options, const char *name, std::vector<std::string> &patterns) {
+  v8::Local<v8::String> key = Nan::New<v8::String>(name).ToLocalChecked();
+  if(!Nan::Has(options, key).FromMaybe(false)) {
+    return;
+  }
+  v8::Local<v8::Value> value = Nan::Get(options, key).ToLocalChecked();
+  if(!value->IsArray()) {
+    return;
+  }
+  v8::Local<v8::Array> names = value.As<v8::Array>();
+  patterns.clear();
+  for(uint32_t i = 0; i < names->Length(); i++) {
+    Nan::Utf8String patternName(Nan::Get(names, i).ToLocalChecked());
+    patterns.push_back(*patternName ? *patternName : "");
+  }
+}
+
+static int getMockId(v8::Local<v8::Object> descriptor) {
+  #ifdef WIN32
+    v8::Local<v8::String> key = Nan::New<v8::String>("path").ToLocalChecked();
+  #else
+    v8::Local<v8::String> key = Nan::New<v8::String>("address").ToLocalChecked();
+  #endif
+  if(!Nan::Has(descriptor, key).FromMaybe(false)) {
+    return 0;
+  }
+  Nan::Utf8String location(Nan::Get(descriptor, key).ToLocalChecked());
+  return *location ? mockIdOf(*location) : 0;
+}
+
+/*
+ * addMockDevice([options]). Registers an emulated device and returns its
+ * descriptor.
+ */
+NAN_METHOD(addMockDevice) {
+  Nan::HandleScope scope;
+  char serial[32];
+
+  MockDeviceOptions options;
+  options.version = 1;
+  options.hardwareType = HARDWARE_TYPE_PRO;
+  options.hardwareVersion = 1;
+  options.externalMemorySize = 65536;
+  options.ledPatterns.assign(defaultLedPatterns, defaultLedPatterns + sizeof(defaultLedPatterns) / sizeof(defaultLedPatterns[0]));
+  options.audioPatterns.assign(defaultAudioPatterns, defaultAudioPatterns + sizeof(defaultAudioPatterns) / sizeof(defaultAudioPatterns[0]));
+  options.latencyMs = 0;
+  options.failEvery = 0;
+  options.errorRate = 0;
+  options.transientErrors = false;
+  options.seed = 1;
+
+  if(info.Length() > 0 && info[0]->IsObject()) {
+    v8::Local<v8::Object> wanted = info[0].As<v8::Object>();
+    v8::Local<v8::String> serialKey = Nan::New<v8::String>("serial").ToLocalChecked();
+    v8::Local<v8::String> errorRateKey = Nan::New<v8::String>("errorRate").ToLocalChecked();
+    if(Nan::Has(wanted, serialKey).FromMaybe(false)) {
+      Nan::Utf8String value(Nan::Get(wanted, serialKey).ToLocalChecked());
+      options.serial = *value ? *value : "";
+    }
+    if(Nan::Has(wanted, errorRateKey).FromMaybe(false)) {
+      options.errorRate = Nan::To<double>(Nan::Get(wanted, errorRateKey).ToLocalChecked()).FromMaybe(0);
+    }
+    options.version = (uint16_t)getUint32Option(wanted, "version", options.version);
+    options.hardwareType = (uint8_t)getUint32Option(wanted, "hardwareType", options.hardwareType);
+    options.hardwareVersion = (uint8_t)getUint32Option(wanted, "hardwareVersion", options.hardwareVersion);
+    options.externalMemorySize = getUint32Option(wanted, "externalMemorySize", options.externalMemorySize);
+    options.latencyMs = getUint32Option(wanted, "latency", options.latencyMs);
+    options.failEvery = getUint32Option(wanted, "failEvery", options.failEvery);
+    options.seed = getUint32Option(wanted, "seed", options.seed);
+    options.transientErrors = getBoolOption(wanted, "transientErrors");
+    getPatternsOption(wanted, "ledPatterns", options.ledPatterns);
+    getPatternsOption(wanted, "audioPatterns", options.audioPatterns);
+  }
+
+  SosDeviceDescriptor descriptor;
+  uv_mutex_lock(&mockLock);
+  int id = nextMockId++;
+  if(options.serial.empty()) {
+    sprintf(serial, "MOCK%04d", id);
+    options.serial = serial;
+  }
+  MockSosDevice *device = new MockSosDevice(id, options);
+  mockDevices.push_back(device);
+  mockDescriptor(device, descriptor);
+  uv_mutex_unlock(&mockLock);
+
+  info.GetReturnValue().Set(descriptorToV8(descriptor));
+}
+
+/*
+ * removeMockDevice(descriptor). Unplugs an emulated device; an open SosDevice
+ * for it fails all further calls, as after a real detach.
+ */
+NAN_METHOD(removeMockDevice) {
+  Nan::HandleScope scope;
+
+  if(info.Length() < 1 || !info[0]->IsObject()) {
+    return Nan::ThrowTypeError("descriptor must be an object");
+  }
+  int id = getMockId(info[0].As<v8::Object>());
+
+  SosDeviceDescriptor descriptor;
+  uv_mutex_lock(&mockLock);
+  MockSosDevice *device = NULL;
+  for(size_t i = 0; i < mockDevices.size(); i++) {
+    if(mockDevices[i]->id == id) {
+      device = mockDevices[i];
+      mockDevices.erase(mockDevices.begin() + i);
+      break;
+    }
+  }
+  if(device != NULL) {
+    mockDescriptor(device, descriptor);
+    releaseMockDevice(device);
+  }
+  uv_mutex_unlock(&mockLock);
+
+  if(device != NULL) {
+    sosDeviceDetached(descriptor);
+  }
+  info.GetReturnValue().Set(Nan::New<v8::Boolean>(device != NULL));
+}
+
+/*
+ * inspectMockDevice(descriptor). Returns the emulator state, including what
+ * the host has written to it, or undefined if the device was removed.
+ */
+NAN_METHOD(inspectMockDevice) {
+  Nan::HandleScope scope;
+
+  if(info.Length() < 1 || !info[0]->IsObject()) {
+    return Nan::ThrowTypeError("descriptor must be an object");
+  }
+  int id = getMockId(info[0].As<v8::Object>());
+
+  uv_mutex_lock(&mockLock);
+  MockSosDevice *device = findMockDevice(id);
+  if(device == NULL) {
+    uv_mutex_unlock(&mockLock);
+    return;
+  }
+
+  v8::Local<v8::Object> result = Nan::New<v8::Object>();
+  v8::Local<v8::Array> manualLeds = Nan::New<v8::Array>(5);
+  for(uint32_t i = 0; i < 5; i++) {
+    Nan::Set(manualLeds, i, Nan::New<v8::Integer>(device->manualLeds[i]));
+  }
+  Nan::Set(result, Nan::New<v8::String>("transfers").ToLocalChecked(), Nan::New<v8::Integer>(device->transfers));
+  Nan::Set(result, Nan::New<v8::String>("failures").ToLocalChecked(), Nan::New<v8::Integer>(device->failures));
+  Nan::Set(result, Nan::New<v8::String>("audioMode").ToLocalChecked(), Nan::New<v8::Integer>(device->info.audioMode));
+  Nan::Set(result, Nan::New<v8::String>("audioPlayDuration").ToLocalChecked(), Nan::New<v8::Integer>(device->info.audioPlayDuration));
+  Nan::Set(result, Nan::New<v8::String>("ledMode").ToLocalChecked(), Nan::New<v8::Integer>(device->info.ledMode));
+  Nan::Set(result, Nan::New<v8::String>("ledPlayDuration").ToLocalChecked(), Nan::New<v8::Integer>(device->info.ledPlayDuration));
+  Nan::Set(result, Nan::New<v8::String>("manualLeds").ToLocalChecked(), manualLeds);
+  if(!device->memory.empty()) {
+    Nan::Set(result, Nan::New<v8::String>("memory").ToLocalChecked(), Nan::CopyBuffer((const char*)&device->memory[0], (uint32_t)device->memory.size()).ToLocalChecked());
+  }
+  uv_mutex_unlock(&mockLock);
+
+  info.GetReturnValue().Set(result);
+}
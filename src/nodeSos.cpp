@@ -2,9 +2,19 @@
 #include "nodeSos.h"
 #include "usbPackets.h"
 
+#include <stdlib.h>
+
+#ifdef WIN32
+  #include <windows.h>
+#else
+  #include <errno.h>
+  #include <unistd.h>
+#endif
+
 #ifdef WIN32
   HidD_GetInputReportFn HidD_GetInputReport = NULL;
   HidD_SetOutputReportFn HidD_SetOutputReport = NULL;
+  HidD_GetSerialNumberStringFn HidD_GetSerialNumberString = NULL;
   HidD_GetHidGuidFn HidD_GetHidGuid = NULL;
   SetupDiGetClassDevsFn sosSetupDiGetClassDevs = NULL;
   SetupDiDestroyDeviceInfoListFn sosSetupDiDestroyDeviceInfoList = NULL;
@@ -16,6 +26,7 @@
       HMODULE hid = LoadLibrary("hid.dll");
       HidD_GetInputReport = (HidD_GetInputReportFn)GetProcAddress(hid, "HidD_GetInputReport");
       HidD_SetOutputReport = (HidD_SetOutputReportFn)GetProcAddress(hid, "HidD_SetOutputReport");
+      HidD_GetSerialNumberString = (HidD_GetSerialNumberStringFn)GetProcAddress(hid, "HidD_GetSerialNumberString");
       HidD_GetHidGuid = (HidD_GetHidGuidFn)GetProcAddress(hid, "HidD_GetHidGuid");
 
       HMODULE setupapi = LoadLibrary("setupapi.dll");
@@ -33,10 +44,15 @@ int sosPacketSize = 1 + 37; // report id + packet length
 
 #ifndef WIN32
 // Values for bmRequestType in the Setup transaction's Data packet.
-static const int CONTROL_REQUEST_TYPE_IN = USB_ENDPOINT_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE;
-static const int CONTROL_REQUEST_TYPE_OUT = USB_ENDPOINT_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+static const int CONTROL_REQUEST_TYPE_IN = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE;
+static const int CONTROL_REQUEST_TYPE_OUT = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE;
 #endif
 
+static const unsigned int USB_TIMEOUT_MS = 10000;
+static const uint32_t DEFAULT_RETRIES = 2;
+static const uint32_t DEFAULT_BACKOFF_MS = 10;
+static const uint32_t MAX_BACKOFF_MS = 1000;
+
 // From the HID spec:
 static const int HID_REPORT_GET = 0x01;
 static const int HID_REPORT_SET = 0x09;
@@ -46,18 +62,67 @@ static const int HID_REPORT_TYPE_FEATURE = 0x03;
 
 static const int INTERFACE_NUMBER = 0;
 
-class NodeSosException {
-  char errorMessage[1000];
+/*
+ * usbLock serializes bus enumeration and opening devices. It is held across
+ * I/O, so only worker threads take it, and nothing holding it may wait for a
+ * device's transfer lock: reconnect takes it the other way round, with the
+ * transfer lock held.
+ *
+ * listLock guards the list of open devices and the cached device list. It is
+ * only held to look up or copy, never across I/O, so any thread may take it,
+ * including the loop thread for hotplug events. Lock order: usbLock, listLock,
+ * then a device's stateLock.
+ */
+static uv_mutex_t usbLock;
+static uv_mutex_t listLock;
+static std::vector<SosDevice*> openDevices;
+
+static void addOpenDevice(SosDevice *sosDevice) {
+  uv_mutex_lock(&listLock);
+  bool found = false;
+  for(size_t i = 0; i < openDevices.size(); i++) {
+    found = found || openDevices[i] == sosDevice;
+  }
+  if(!found) {
+    openDevices.push_back(sosDevice);
+  }
+  uv_mutex_unlock(&listLock);
+}
+
+static void removeOpenDevice(SosDevice *sosDevice) {
+  uv_mutex_lock(&listLock);
+  for(size_t i = 0; i < openDevices.size(); i++) {
+    if(openDevices[i] == sosDevice) {
+      openDevices.erase(openDevices.begin() + i);
+      break;
+    }
+  }
+  uv_mutex_unlock(&listLock);
+}
 
-public:
-  NodeSosException(const char* errorMessage) {
-    strcpy(this->errorMessage, errorMessage);
+// Fills in the serial number of the open device at the descriptor's
+// location. Returns false if no device there is open.
+static bool getOpenDeviceSerial(SosDeviceDescriptor &descriptor) {
+  uv_mutex_lock(&listLock);
+  SosDevice *sosDevice = SosDevice::findOpenDevice(descriptor);
+  if(sosDevice != NULL) {
+    descriptor.serial = sosDevice->getSerial();
   }
+  uv_mutex_unlock(&listLock);
+  return sosDevice != NULL;
+}
 
-  v8::Handle<v8::Value> toV8() {
-    return Nan::Error(errorMessage);
+// Fills in the info the open device at the descriptor's location last read,
+// without waiting for the device. Returns false if no device there is open.
+static bool getOpenDeviceInfo(SosDeviceDescriptor &descriptor) {
+  uv_mutex_lock(&listLock);
+  SosDevice *sosDevice = SosDevice::findOpenDevice(descriptor);
+  if(sosDevice != NULL) {
+    descriptor.hasInfo = sosDevice->getLastInfo(&descriptor.info);
   }
-};
+  uv_mutex_unlock(&listLock);
+  return sosDevice != NULL;
+}
 
 void initControlPacket(UsbControlPacket *packet) {
   memset(packet, 0, sizeof(UsbControlPacket));
@@ -75,442 +140,3037 @@ void initControlPacket(UsbControlPacket *packet) {
   packet->manualLeds4 = 0xff;
 }
 
-void SosDevice::getInputReport(int reportId, char* buf, int bufSize) {
-  char errorBuffer[1000];
+// Copies every field of update that is not a "don't change" sentinel.
+static void mergeControlPacket(UsbControlPacket *pending, const UsbControlPacket *update) {
+  pending->controlByte1 |= update->controlByte1;
+  if(update->audioMode != 0xff) {
+    pending->audioMode = update->audioMode;
+  }
+  if(update->ledMode != 0xff) {
+    pending->ledMode = update->ledMode;
+  }
+  if(update->audioPlayDuration != 0xffff) {
+    pending->audioPlayDuration = update->audioPlayDuration;
+  }
+  if(update->ledPlayDuration != 0xffff) {
+    pending->ledPlayDuration = update->ledPlayDuration;
+  }
+  if(update->readAudioIndex != 0xff) {
+    pending->readAudioIndex = update->readAudioIndex;
+  }
+  if(update->readLedIndex != 0xff) {
+    pending->readLedIndex = update->readLedIndex;
+  }
+  if(update->manualLeds0 != 0xff) {
+    pending->manualLeds0 = update->manualLeds0;
+  }
+  if(update->manualLeds1 != 0xff) {
+    pending->manualLeds1 = update->manualLeds1;
+  }
+  if(update->manualLeds2 != 0xff) {
+    pending->manualLeds2 = update->manualLeds2;
+  }
+  if(update->manualLeds3 != 0xff) {
+    pending->manualLeds3 = update->manualLeds3;
+  }
+  if(update->manualLeds4 != 0xff) {
+    pending->manualLeds4 = update->manualLeds4;
+  }
+}
 
-  #ifdef WIN32
-    buf[0] = reportId;
-    if(!HidD_GetInputReport(devHandle, buf, sosPacketSize)) {
-      sprintf(errorBuffer, "Could not get input report: 0x%08X", GetLastError());
-      throw NodeSosException(errorBuffer);
-    }
-  #else
-    int claimResult = usb_claim_interface(devHandle, INTERFACE_NUMBER);
-    if(claimResult != 0) {
-      sprintf(errorBuffer, "usb_claim_interface: %d %s\n", claimResult, usb_strerror());
-      throw NodeSosException(errorBuffer);
-    }
-
-    int bytesSent = usb_control_msg(
-      devHandle,
-      CONTROL_REQUEST_TYPE_IN,
-      HID_REPORT_GET,
-      (HID_REPORT_TYPE_INPUT << 8) | reportId,
-      INTERFACE_NUMBER,
-      buf,
-      bufSize,
-      10000);
-    if(bytesSent < 0) {
-      sprintf(errorBuffer, "usb_control_msg: %d %s\n", bytesSent, usb_strerror());
-      throw NodeSosException(errorBuffer);
-    }
+// Timed playback restarts on every write, so only a channel that is off or
+// playing without a time limit can have its fields skipped.
+static bool isSteadyPlayback(uint8_t mode, uint16_t duration) {
+  return mode == 0 || duration == 0 || duration == PLAY_DURATION_FOREVER;
+}
 
-    int releaseResult = usb_release_interface(devHandle, INTERFACE_NUMBER);
-    if(releaseResult != 0) {
-      sprintf(errorBuffer, "usb_release_interface: %d %s\n", releaseResult, usb_strerror());
-      throw NodeSosException(errorBuffer);
-    }
-  #endif
+/*
+ * Takes a channel's mode from an info packet. The info carries the time left
+ * to play rather than the duration that was written, so it only tells the
+ * duration of steady playback; timed playback keeps the duration last
+ * written while the mode stays the same, which polling the info must not
+ * forget.
+ */
+static void seedPlayback(uint8_t mode, uint16_t timeLeft, uint8_t *shadowMode, uint16_t *shadowDuration) {
+  if(isSteadyPlayback(mode, timeLeft)) {
+    *shadowDuration = timeLeft;
+  } else if(mode != *shadowMode || isSteadyPlayback(*shadowMode, *shadowDuration)) {
+    *shadowDuration = 0xffff;
+  }
+  *shadowMode = mode;
 }
 
-void SosDevice::setOutputReport(int reportId, char* buf, int bufSize) {
-  char errorBuffer[1000];
+/*
+ * Clears a channel's mode and duration when the device already has both. A
+ * changed mode is always sent with its duration, even one the device already
+ * has, since the firmware takes the duration with the mode it starts.
+ */
+static void diffPlayback(uint8_t shadowMode, uint16_t shadowDuration, uint8_t *mode, uint16_t *duration) {
+  if(!isSteadyPlayback(shadowMode, shadowDuration)) {
+    return;
+  }
+  if((*mode == 0xff || *mode == shadowMode) && (*duration == 0xffff || *duration == shadowDuration)) {
+    *mode = 0xff;
+    *duration = 0xffff;
+  }
+}
 
-  #ifdef WIN32
-    buf[0] = reportId;
-    if(!HidD_SetOutputReport(devHandle, buf, sosPacketSize)) {
-      sprintf(errorBuffer, "Could not set output report: 0x%08X", GetLastError());
-      throw NodeSosException(errorBuffer);
+/*
+ * Clears the fields of packet the device already has according to shadow,
+ * where a "don't change" value means unknown. controlByte1 and the pattern
+ * read indexes are commands rather than state and are always sent. Returns
+ * false if nothing is left to send.
+ */
+static bool diffControlPacket(const UsbControlPacket *shadow, UsbControlPacket *packet) {
+  diffPlayback(shadow->audioMode, shadow->audioPlayDuration, &packet->audioMode, &packet->audioPlayDuration);
+  diffPlayback(shadow->ledMode, shadow->ledPlayDuration, &packet->ledMode, &packet->ledPlayDuration);
+  uint8_t *leds = &packet->manualLeds0;
+  const uint8_t *shadowLeds = &shadow->manualLeds0;
+  bool changed = false;
+  for(int i = 0; i < LED_COUNT; i++) {
+    if(leds[i] == shadowLeds[i]) {
+      leds[i] = 0xff;
     }
-  #else
-    int claimResult = usb_claim_interface(devHandle, INTERFACE_NUMBER);
-    if(claimResult != 0) {
-      sprintf(errorBuffer, "usb_claim_interface: %d %s\n", claimResult, usb_strerror());
-      throw NodeSosException(errorBuffer);
-    }
-
-    int bytesSent = usb_control_msg(
-      devHandle,
-      CONTROL_REQUEST_TYPE_OUT,
-      HID_REPORT_SET,
-      (HID_REPORT_TYPE_INPUT << 8) | reportId,
-      INTERFACE_NUMBER,
-      buf,
-      bufSize,
-      10000);
-    if(bytesSent < 0) {
-      sprintf(errorBuffer, "usb_control_msg: %d %s\n", bytesSent, usb_strerror());
-      throw NodeSosException(errorBuffer);
+    changed = changed || leds[i] != 0xff;
+  }
+  return changed || packet->controlByte1 != 0
+    || packet->audioMode != 0xff || packet->audioPlayDuration != 0xffff
+    || packet->ledMode != 0xff || packet->ledPlayDuration != 0xffff
+    || packet->readAudioIndex != 0xff || packet->readLedIndex != 0xff;
+}
+
+// The manual LED values only show, and are only kept by the firmware, while
+// the LEDs are in manual mode, so in any other or an unknown mode they are
+// unknown and will be sent again.
+static void forgetManualLedsUnlessManual(UsbControlPacket *shadow) {
+  if(shadow->ledMode != LED_MODE_MANUAL) {
+    uint8_t *shadowLeds = &shadow->manualLeds0;
+    for(int i = 0; i < LED_COUNT; i++) {
+      shadowLeds[i] = 0xff;
     }
+  }
+}
 
-    int releaseResult = usb_release_interface(devHandle, INTERFACE_NUMBER);
-    if(releaseResult != 0) {
-      sprintf(errorBuffer, "usb_release_interface: %d %s\n", releaseResult, usb_strerror());
-      throw NodeSosException(errorBuffer);
+// Records the state fields of a written packet, or marks them unknown when
+// the write failed and may or may not have reached the device.
+static void updateShadow(UsbControlPacket *shadow, const UsbControlPacket *written, bool succeeded) {
+  if(written->audioMode != 0xff) {
+    shadow->audioMode = succeeded ? written->audioMode : 0xff;
+  }
+  if(written->audioPlayDuration != 0xffff) {
+    shadow->audioPlayDuration = succeeded ? written->audioPlayDuration : 0xffff;
+  }
+  if(written->ledMode != 0xff) {
+    shadow->ledMode = succeeded ? written->ledMode : 0xff;
+  }
+  if(written->ledPlayDuration != 0xffff) {
+    shadow->ledPlayDuration = succeeded ? written->ledPlayDuration : 0xffff;
+  }
+  const uint8_t *leds = &written->manualLeds0;
+  uint8_t *shadowLeds = &shadow->manualLeds0;
+  for(int i = 0; i < LED_COUNT; i++) {
+    if(leds[i] != 0xff) {
+      shadowLeds[i] = succeeded ? leds[i] : 0xff;
     }
-  #endif
+  }
+  forgetManualLedsUnlessManual(shadow);
 }
 
-NAN_METHOD(SosDevice::readInfo) {
-  Nan::HandleScope scope;
-  v8::Local<v8::Value> callbackArgs[2];
-  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+#ifdef WIN32
+static SosErrorCode win32ErrorCode(DWORD error) {
+  switch(error) {
+    case ERROR_DEVICE_NOT_CONNECTED:
+    case ERROR_FILE_NOT_FOUND:
+      return SOS_ERROR_NO_DEVICE;
+    case ERROR_ACCESS_DENIED:
+      return SOS_ERROR_ACCESS;
+    case ERROR_SEM_TIMEOUT:
+      return SOS_ERROR_TIMEOUT;
+    case ERROR_BUSY:
+      return SOS_ERROR_BUSY;
+    default:
+      return SOS_ERROR_IO;
+  }
+}
 
-  Nan::Callback *callback = new Nan::Callback(info[0].As<v8::Function>());
+/*
+ * Reports go through HidD_GetInputReport/HidD_SetOutputReport, which always
+ * transfer a full sosPacketSize report.
+ */
+class HidTransport : public SosTransport {
+  HANDLE devHandle;
 
-  UsbInfoPacket usbInfoPacket;
-  try {
-    sosDevice->getInputReport(USB_REPORTID_IN_INFO, (char*)&usbInfoPacket, sizeof(usbInfoPacket));
-  } catch(NodeSosException &ex) {
-    callbackArgs[0] = ex.toV8();
-    callbackArgs[1] = Nan::Undefined();
-    callback->Call(2, callbackArgs);
-    return;
+public:
+  HidTransport(HANDLE devHandle) : devHandle(devHandle) {
   }
 
-  v8::Local<v8::Object> result = Nan::New<v8::Object>();
-  Nan::Set(result, Nan::New<v8::String>("version").ToLocalChecked(), Nan::New<v8::Integer>(usbInfoPacket.version));
-  Nan::Set(result, Nan::New<v8::String>("hardwareType").ToLocalChecked(), Nan::New<v8::Integer>(usbInfoPacket.hardwareType));
-  Nan::Set(result, Nan::New<v8::String>("hardwareVersion").ToLocalChecked(), Nan::New<v8::Integer>(usbInfoPacket.hardwareVersion));
-  Nan::Set(result, Nan::New<v8::String>("externalMemorySize").ToLocalChecked(), Nan::New<v8::Integer>(usbInfoPacket.externalMemorySize));
-  Nan::Set(result, Nan::New<v8::String>("audioMode").ToLocalChecked(), Nan::New<v8::Integer>(usbInfoPacket.audioMode));
-  Nan::Set(result, Nan::New<v8::String>("audioPlayDuration").ToLocalChecked(), Nan::New<v8::Integer>(usbInfoPacket.audioPlayDuration));
-  Nan::Set(result, Nan::New<v8::String>("ledMode").ToLocalChecked(), Nan::New<v8::Integer>(usbInfoPacket.ledMode));
-  Nan::Set(result, Nan::New<v8::String>("ledPlayDuration").ToLocalChecked(), Nan::New<v8::Integer>(usbInfoPacket.ledPlayDuration));
-
-  callbackArgs[0] = Nan::Undefined();
-  callbackArgs[1] = result;
-  callback->Call(2, callbackArgs);
-}
+  ~HidTransport() {
+    CloseHandle(devHandle);
+  }
 
-NAN_METHOD(SosDevice::readLedPatterns) {
-  Nan::HandleScope scope;
-  v8::Local<v8::Value> callbackArgs[2];
-  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+  // HidD_* has no timeout of its own, so timeoutMs is not applied.
+  void getInputReport(int reportId, char* buf, int bufSize, unsigned int timeoutMs) {
+    char report[64];
 
-  Nan::Callback *callback = new Nan::Callback(info[0].As<v8::Function>());
+    report[0] = reportId;
+    if(!HidD_GetInputReport(devHandle, report, sosPacketSize)) {
+      DWORD error = GetLastError();
+      throw NodeSosException(win32ErrorCode(error), SOS_PHASE_TRANSFER, reportId, (int)error, error != ERROR_DEVICE_NOT_CONNECTED,
+        "Could not get input report: 0x%08X", error);
+    }
+    memcpy(buf, report, bufSize < sosPacketSize ? bufSize : sosPacketSize);
+  }
 
-  v8::Local<v8::Array> ledPatterns = Nan::New<v8::Array>();
-  UsbReadLedPacket usbReadLedPacket;
-  try {
-    UsbControlPacket usbControlPacket;
-    initControlPacket(&usbControlPacket);
-    usbControlPacket.readLedIndex = 0;
-    sosDevice->setOutputReport(USB_REPORTID_OUT_CONTROL, (char*)&usbControlPacket, sizeof(usbControlPacket));
+  void setOutputReport(int reportId, char* buf, int bufSize, unsigned int timeoutMs) {
+    char report[64];
 
-    for(int i=0; ; i++) {
-      sosDevice->getInputReport(USB_REPORTID_IN_READ_LED, (char*)&usbReadLedPacket, sizeof(usbReadLedPacket));
-      if(usbReadLedPacket.id == 0xff) {
-        break;
-      }
-      v8::Local<v8::Object> ledPattern = Nan::New<v8::Object>();
-      Nan::Set(ledPattern, Nan::New<v8::String>("id").ToLocalChecked(), Nan::New<v8::Integer>(usbReadLedPacket.id));
-      Nan::Set(ledPattern, Nan::New<v8::String>("name").ToLocalChecked(), Nan::New<v8::String>(usbReadLedPacket.name).ToLocalChecked());
-      ledPatterns->Set(i, ledPattern);
+    memset(report, 0, sizeof(report));
+    memcpy(report, buf, bufSize < sosPacketSize ? bufSize : sosPacketSize);
+    report[0] = reportId;
+    if(!HidD_SetOutputReport(devHandle, report, sosPacketSize)) {
+      DWORD error = GetLastError();
+      throw NodeSosException(win32ErrorCode(error), SOS_PHASE_TRANSFER, reportId, (int)error, error != ERROR_DEVICE_NOT_CONNECTED,
+        "Could not set output report: 0x%08X", error);
     }
-  } catch(NodeSosException &ex) {
-    callbackArgs[0] = ex.toV8();
-    callbackArgs[1] = Nan::Undefined();
-    callback->Call(2, callbackArgs);
-    return;
   }
-
-  callbackArgs[0] = Nan::Undefined();
-  callbackArgs[1] = ledPatterns;
-  callback->Call(2, callbackArgs);
-  return;
+};
+#else
+static SosErrorCode libusbErrorCode(int error) {
+  switch(error) {
+    case LIBUSB_ERROR_TIMEOUT:
+      return SOS_ERROR_TIMEOUT;
+    case LIBUSB_ERROR_NO_DEVICE:
+    case LIBUSB_ERROR_NOT_FOUND:
+      return SOS_ERROR_NO_DEVICE;
+    case LIBUSB_ERROR_ACCESS:
+      return SOS_ERROR_ACCESS;
+    case LIBUSB_ERROR_BUSY:
+      return SOS_ERROR_BUSY;
+    default:
+      return SOS_ERROR_IO;
+  }
 }
 
-NAN_METHOD(SosDevice::readAudioPatterns) {
-  Nan::HandleScope scope;
-  v8::Local<v8::Value> callbackArgs[2];
-  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+SosErrorCode errnoErrorCode(int error) {
+  switch(error) {
+    case ETIMEDOUT:
+      return SOS_ERROR_TIMEOUT;
+    case ENODEV:
+    case ENOENT:
+    case ENXIO:
+    case ECONNREFUSED:
+      return SOS_ERROR_NO_DEVICE;
+    case EACCES:
+    case EPERM:
+      return SOS_ERROR_ACCESS;
+    case EBUSY:
+    case EADDRINUSE:
+      return SOS_ERROR_BUSY;
+    default:
+      return SOS_ERROR_IO;
+  }
+}
 
-  Nan::Callback *callback = new Nan::Callback(info[0].As<v8::Function>());
+// Synchronous transfer for short-lived handles, e.g. reading the info of a
+// device that is not open; libusb handles the events itself.
+static int hidControlTransfer(libusb_device_handle *devHandle, int requestType, int request, int reportId, char* buf, int bufSize) {
+  return libusb_control_transfer(
+    devHandle,
+    requestType,
+    request,
+    (HID_REPORT_TYPE_INPUT << 8) | reportId,
+    INTERFACE_NUMBER,
+    (unsigned char*)buf,
+    bufSize,
+    USB_TIMEOUT_MS);
+}
 
-  v8::Local<v8::Array> audioPatterns = Nan::New<v8::Array>();
-  UsbReadLedPacket UsbReadAudioPacket;
-  try {
-    UsbControlPacket usbControlPacket;
-    initControlPacket(&usbControlPacket);
-    usbControlPacket.readAudioIndex = 0;
-    sosDevice->setOutputReport(USB_REPORTID_OUT_CONTROL, (char*)&usbControlPacket, sizeof(usbControlPacket));
+/*
+ * Reports go through libusb-1.0 asynchronous control transfers that are
+ * completed on the libusb event thread (see usbEvents.cpp). The interface is claimed
+ * when the device is opened and held until the transport is destroyed; a
+ * failed transfer drops and reclaims it.
+ *
+ * Transfers on one device are serialized by its transfer lock, so the
+ * transfer and its buffer are allocated once and reused.
+ */
+class LibusbTransport : public SosTransport {
+  libusb_device_handle *devHandle;
+  bool interfaceClaimed;
+  struct libusb_transfer *transfer;
+  unsigned char transferBuffer[LIBUSB_CONTROL_SETUP_SIZE + 64];
+  UsbTransferWait wait;
 
-    for(int i=0; ; i++) {
-      sosDevice->getInputReport(USB_REPORTID_IN_READ_AUDIO, (char*)&UsbReadAudioPacket, sizeof(UsbReadAudioPacket));
-      if(UsbReadAudioPacket.id == 0xff) {
-        break;
-      }
-      v8::Local<v8::Object> audioPattern = Nan::New<v8::Object>();
-      Nan::Set(audioPattern, Nan::New<v8::String>("id").ToLocalChecked(), Nan::New<v8::Integer>(UsbReadAudioPacket.id));
-      Nan::Set(audioPattern, Nan::New<v8::String>("name").ToLocalChecked(), Nan::New<v8::String>(UsbReadAudioPacket.name).ToLocalChecked());
-      audioPatterns->Set(i, audioPattern);
-    }
-  } catch(NodeSosException &ex) {
-    callbackArgs[0] = ex.toV8();
-    callbackArgs[1] = Nan::Undefined();
-    callback->Call(2, callbackArgs);
-    return;
+public:
+  LibusbTransport(libusb_device_handle *devHandle) : devHandle(devHandle), interfaceClaimed(true) {
+    transfer = libusb_alloc_transfer(0);
   }
 
-  callbackArgs[0] = Nan::Undefined();
-  callbackArgs[1] = audioPatterns;
-  callback->Call(2, callbackArgs);
-  return;
-}
+  ~LibusbTransport() {
+    releaseInterface();
+    libusb_close(devHandle);
+    libusb_free_transfer(transfer);
+  }
 
-NAN_METHOD(SosDevice::sendControlPacket) {
-  Nan::HandleScope scope;
-  v8::Local<v8::Value> callbackArgs[2];
-  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+  void getInputReport(int reportId, char* buf, int bufSize, unsigned int timeoutMs) {
+    controlTransfer(CONTROL_REQUEST_TYPE_IN, HID_REPORT_GET, reportId, buf, bufSize, timeoutMs);
+  }
 
-  v8::Local<v8::Object> values = info[0].As<v8::Object>();
-  Nan::Callback *callback = new Nan::Callback(info[1].As<v8::Function>());
+  void setOutputReport(int reportId, char* buf, int bufSize, unsigned int timeoutMs) {
+    controlTransfer(CONTROL_REQUEST_TYPE_OUT, HID_REPORT_SET, reportId, buf, bufSize, timeoutMs);
+  }
 
-  UsbControlPacket usbControlPacket;
-  initControlPacket(&usbControlPacket);
+private:
+  void claimInterface() {
+    if(interfaceClaimed) {
+      return;
+    }
 
-  if(Nan::Has(values, Nan::New<v8::String>("ledMode").ToLocalChecked()).FromMaybe(false)) {
-    usbControlPacket.ledMode = Nan::Get(values, Nan::New<v8::String>("ledMode").ToLocalChecked()).ToLocalChecked().As<v8::Integer>()->Value();
-  }
-  if(Nan::Has(values, Nan::New<v8::String>("ledPlayDuration").ToLocalChecked()).FromMaybe(false)) {
-    usbControlPacket.ledPlayDuration = Nan::Get(values, Nan::New<v8::String>("ledPlayDuration").ToLocalChecked()).ToLocalChecked().As<v8::Integer>()->Value() / 10;
+    uint64_t start = uv_hrtime();
+    int claimResult = libusb_claim_interface(devHandle, INTERFACE_NUMBER);
+    if(stats != NULL) {
+      stats->recordClaim(uv_hrtime() - start);
+    }
+    if(claimResult != 0) {
+      throw NodeSosException(libusbErrorCode(claimResult), SOS_PHASE_CLAIM, -1, claimResult, isRetryableError(claimResult),
+        "libusb_claim_interface: %s", libusb_error_name(claimResult));
+    }
+    interfaceClaimed = true;
   }
 
-  if(Nan::Has(values, Nan::New<v8::String>("audioMode").ToLocalChecked()).FromMaybe(false)) {
-    usbControlPacket.audioMode = Nan::Get(values, Nan::New<v8::String>("audioMode").ToLocalChecked()).ToLocalChecked().As<v8::Integer>()->Value();
+  void releaseInterface() {
+    if(!interfaceClaimed) {
+      return;
+    }
+    uint64_t start = uv_hrtime();
+    libusb_release_interface(devHandle, INTERFACE_NUMBER);
+    if(stats != NULL) {
+      stats->recordRelease(uv_hrtime() - start);
+    }
+    interfaceClaimed = false;
   }
-  if(Nan::Has(values, Nan::New<v8::String>("audioPlayDuration").ToLocalChecked()).FromMaybe(false)) {
-    usbControlPacket.audioPlayDuration = Nan::Get(values, Nan::New<v8::String>("audioPlayDuration").ToLocalChecked()).ToLocalChecked().As<v8::Integer>()->Value() / 10;
+
+  // Returns the number of bytes transferred or a libusb error code.
+  int submitControlTransfer(int requestType, int request, int reportId, char* buf, int bufSize, unsigned int timeoutMs) {
+    if(bufSize > (int)sizeof(transferBuffer) - LIBUSB_CONTROL_SETUP_SIZE) {
+      return LIBUSB_ERROR_OVERFLOW;
+    }
+    libusb_fill_control_setup(transferBuffer, requestType, request, (HID_REPORT_TYPE_INPUT << 8) | reportId, INTERFACE_NUMBER, bufSize);
+    if(requestType == CONTROL_REQUEST_TYPE_OUT) {
+      memcpy(transferBuffer + LIBUSB_CONTROL_SETUP_SIZE, buf, bufSize);
+    }
+    libusb_fill_control_transfer(transfer, devHandle, transferBuffer, NULL, NULL, timeoutMs);
+
+    int result = submitTransferAndWait(transfer, &wait);
+    if(result < 0) {
+      return result;
+    }
+    switch(transfer->status) {
+      case LIBUSB_TRANSFER_COMPLETED:
+        break;
+      case LIBUSB_TRANSFER_TIMED_OUT:
+        return LIBUSB_ERROR_TIMEOUT;
+      case LIBUSB_TRANSFER_NO_DEVICE:
+        return LIBUSB_ERROR_NO_DEVICE;
+      case LIBUSB_TRANSFER_STALL:
+        return LIBUSB_ERROR_PIPE;
+      case LIBUSB_TRANSFER_OVERFLOW:
+        return LIBUSB_ERROR_OVERFLOW;
+      default:
+        return LIBUSB_ERROR_IO;
+    }
+    if(requestType == CONTROL_REQUEST_TYPE_IN) {
+      memcpy(buf, libusb_control_transfer_get_data(transfer), transfer->actual_length);
+    }
+    return transfer->actual_length;
   }
 
-  if(Nan::Has(values, Nan::New<v8::String>("manualLeds0").ToLocalChecked()).FromMaybe(false)) {
-    usbControlPacket.manualLeds0 = Nan::Get(values, Nan::New<v8::String>("manualLeds0").ToLocalChecked()).ToLocalChecked().As<v8::Integer>()->Value();
+  int controlTransfer(int requestType, int request, int reportId, char* buf, int bufSize, unsigned int timeoutMs) {
+    claimInterface();
+    int bytesSent = submitControlTransfer(requestType, request, reportId, buf, bufSize, timeoutMs);
+    recordTimeout(requestType, reportId, bytesSent);
+    if(bytesSent < 0 && bytesSent != LIBUSB_ERROR_NO_DEVICE && bytesSent != LIBUSB_ERROR_TIMEOUT) {
+      // The claim can be lost underneath us (e.g. the kernel driver rebinding
+      // after a reset), so drop it, reclaim and retry the transfer once. A
+      // timeout is left to SosDevice so the attempt stays within timeoutMs.
+      releaseInterface();
+      claimInterface();
+      bytesSent = submitControlTransfer(requestType, request, reportId, buf, bufSize, timeoutMs);
+      recordTimeout(requestType, reportId, bytesSent);
+    }
+    if(bytesSent < 0) {
+      releaseInterface();
+      throw NodeSosException(libusbErrorCode(bytesSent), SOS_PHASE_TRANSFER, reportId, bytesSent, isRetryableError(bytesSent),
+        "libusb control transfer: %s", libusb_error_name(bytesSent));
+    }
+    return bytesSent;
   }
-  if(Nan::Has(values, Nan::New<v8::String>("manualLeds1").ToLocalChecked()).FromMaybe(false)) {
-    usbControlPacket.manualLeds1 = Nan::Get(values, Nan::New<v8::String>("manualLeds1").ToLocalChecked()).ToLocalChecked().As<v8::Integer>()->Value();
+
+  static bool isRetryableError(int error) {
+    switch(error) {
+      case LIBUSB_ERROR_TIMEOUT:
+      case LIBUSB_ERROR_PIPE:
+      case LIBUSB_ERROR_IO:
+      case LIBUSB_ERROR_BUSY:
+      case LIBUSB_ERROR_INTERRUPTED:
+      case LIBUSB_ERROR_OVERFLOW:
+        return true;
+      default:
+        return false;
+    }
   }
-  if(Nan::Has(values, Nan::New<v8::String>("manualLeds2").ToLocalChecked()).FromMaybe(false)) {
-    usbControlPacket.manualLeds2 = Nan::Get(values, Nan::New<v8::String>("manualLeds2").ToLocalChecked()).ToLocalChecked().As<v8::Integer>()->Value();
+
+  void recordTimeout(int requestType, int reportId, int result) {
+    if(result == LIBUSB_ERROR_TIMEOUT && stats != NULL) {
+      stats->recordTimeout(requestType == CONTROL_REQUEST_TYPE_OUT, reportId);
+    }
   }
-  if(Nan::Has(values, Nan::New<v8::String>("manualLeds3").ToLocalChecked()).FromMaybe(false)) {
-    usbControlPacket.manualLeds3 = Nan::Get(values, Nan::New<v8::String>("manualLeds3").ToLocalChecked()).ToLocalChecked().As<v8::Integer>()->Value();
+};
+#endif
+
+const char *transportName(SosTransportType transport) {
+  switch(transport) {
+    case TRANSPORT_MOCK:
+      return "mock";
+    case TRANSPORT_HIDRAW:
+      return "hidraw";
+    case TRANSPORT_BROKER:
+      return "broker";
+    default:
+      return "usb";
   }
-  if(Nan::Has(values, Nan::New<v8::String>("manualLeds4").ToLocalChecked()).FromMaybe(false)) {
-    usbControlPacket.manualLeds4 = Nan::Get(values, Nan::New<v8::String>("manualLeds4").ToLocalChecked()).ToLocalChecked().As<v8::Integer>()->Value();
+}
+
+const char *errorCodeName(SosErrorCode code) {
+  switch(code) {
+    case SOS_ERROR_TIMEOUT:
+      return "SOS_TIMEOUT";
+    case SOS_ERROR_NO_DEVICE:
+      return "SOS_NO_DEVICE";
+    case SOS_ERROR_DETACHED:
+      return "SOS_DETACHED";
+    case SOS_ERROR_NOT_FOUND:
+      return "SOS_NOT_FOUND";
+    case SOS_ERROR_ACCESS:
+      return "SOS_ACCESS";
+    case SOS_ERROR_BUSY:
+      return "SOS_BUSY";
+    case SOS_ERROR_DEADLINE:
+      return "SOS_DEADLINE_EXCEEDED";
+    case SOS_ERROR_OUT_OF_RANGE:
+      return "SOS_OUT_OF_RANGE";
+    case SOS_ERROR_PROTOCOL:
+      return "SOS_PROTOCOL";
+    case SOS_ERROR_INIT:
+      return "SOS_INIT";
+    case SOS_ERROR_CLOSED:
+      return "SOS_CLOSED";
+    default:
+      return "SOS_IO";
   }
+}
 
-  try {
-    sosDevice->setOutputReport(USB_REPORTID_OUT_CONTROL, (char*)&usbControlPacket, sizeof(usbControlPacket));
-  } catch(NodeSosException &ex) {
-    callbackArgs[0] = ex.toV8();
-    callbackArgs[1] = Nan::Undefined();
-    callback->Call(2, callbackArgs);
-    return;
+const char *errorPhaseName(SosErrorPhase phase) {
+  switch(phase) {
+    case SOS_PHASE_OPEN:
+      return "open";
+    case SOS_PHASE_CLAIM:
+      return "claim";
+    case SOS_PHASE_TRANSFER:
+      return "transfer";
+    default:
+      return NULL;
   }
+}
 
-  callbackArgs[0] = Nan::Undefined();
-  callbackArgs[1] = Nan::Undefined();
-  callback->Call(2, callbackArgs);
-  return;
+bool parseTransportName(const std::string &name, SosTransportType *transport) {
+  if(name.empty() || name == "usb") {
+    *transport = TRANSPORT_USB;
+  } else if(name == "mock") {
+    *transport = TRANSPORT_MOCK;
+  #ifdef __linux__
+  } else if(name == "hidraw") {
+    *transport = TRANSPORT_HIDRAW;
+  #endif
+  #ifndef WIN32
+  } else if(name == "broker") {
+    *transport = TRANSPORT_BROKER;
+  #endif
+  } else {
+    return false;
+  }
+  return true;
 }
 
-Nan::Persistent<v8::FunctionTemplate> SosDevice::s_ct;
+void SosDevice::checkAttached() {
+  if(transport == NULL) {
+    throw NodeSosException(SOS_ERROR_CLOSED, "Siren of Shame was closed");
+  }
+  uv_mutex_lock(&stateLock);
+  bool isDetached = detached;
+  uv_mutex_unlock(&stateLock);
+  if(isDetached) {
+    throw NodeSosException(SOS_ERROR_DETACHED, "Siren of Shame was detached");
+  }
+}
 
-/*static*/ void SosDevice::Init(v8::Handle<v8::Object> target) {
-  Nan::HandleScope scope;
+// Does not wait for the transfer lock, which a transfer in progress holds
+// until the device times out; hotplug events arrive on the loop thread.
+void SosDevice::markDetached() {
+  uv_mutex_lock(&stateLock);
+  detached = true;
+  uv_mutex_unlock(&stateLock);
+}
 
-  v8::Local<v8::FunctionTemplate> t = Nan::New<v8::FunctionTemplate>();
-  t->InstanceTemplate()->SetInternalFieldCount(1);
-  t->SetClassName(Nan::New("SosDevice").ToLocalChecked());
-  s_ct.Reset(t);
+bool SosDevice::getLastInfo(UsbInfoPacket *usbInfoPacket) {
+  uv_mutex_lock(&stateLock);
+  bool found = hasLastInfo;
+  if(found) {
+    memcpy(usbInfoPacket, &lastInfo, sizeof(UsbInfoPacket));
+  }
+  uv_mutex_unlock(&stateLock);
+  return found;
+}
 
-  Nan::SetPrototypeMethod(t, "readInfo", SosDevice::readInfo);
-  Nan::SetPrototypeMethod(t, "sendControlPacket", SosDevice::sendControlPacket);
-  Nan::SetPrototypeMethod(t, "readLedPatterns", SosDevice::readLedPatterns);
-  Nan::SetPrototypeMethod(t, "readAudioPatterns", SosDevice::readAudioPatterns);
+SosCallOptions::SosCallOptions()
+  : timeoutMs(USB_TIMEOUT_MS), retries(DEFAULT_RETRIES), backoffMs(DEFAULT_BACKOFF_MS), deadlineMs(0) {
+}
 
-  Nan::Set(target, Nan::New("SosDevice").ToLocalChecked(), Nan::New(s_ct)->GetFunction());
+void sleepMs(uint32_t ms) {
+  #ifdef WIN32
+    Sleep(ms);
+  #else
+    usleep(ms * 1000);
+  #endif
 }
 
-#ifdef WIN32
-  /*static*/ v8::Local<v8::Object> SosDevice::New(HANDLE devHandle) {
-    Nan::EscapableHandleScope scope;
+void SosDevice::getInputReport(int reportId, char* buf, int bufSize) {
+  transfer(false, reportId, buf, bufSize);
+}
 
-    initFunctionPointers();
+void SosDevice::setOutputReport(int reportId, char* buf, int bufSize) {
+  transfer(true, reportId, buf, bufSize);
+}
 
-    v8::Local<v8::Function> ctor = Nan::New(s_ct)->GetFunction();
-    v8::Local<v8::Object> obj = ctor->NewInstance();
-    SosDevice *self = new SosDevice(devHandle);
-    self->Wrap(obj);
+/*
+ * Runs one report transfer for the call holding the transfer lock. Each
+ * attempt gets the call's timeout, cut short by its deadline; retryable
+ * failures are tried again after a delay that doubles every time, until the
+ * retries run out or the next attempt could not start before the deadline.
+ * The lock stays held while backing off so the retries are not interleaved
+ * with other calls.
+ */
+void SosDevice::transfer(bool output, int reportId, char* buf, int bufSize) {
+  for(uint32_t attempt = 0; ; attempt++) {
+    checkAttached();
+    unsigned int timeoutMs = attemptTimeout();
+    uint64_t start = uv_hrtime();
+    try {
+      if(output) {
+        transport->setOutputReport(reportId, buf, bufSize, timeoutMs);
+      } else {
+        transport->getInputReport(reportId, buf, bufSize, timeoutMs);
+      }
+    } catch(NodeSosException &ex) {
+      ex.addContext(SOS_PHASE_TRANSFER, reportId);
+      stats.recordTransfer(output, reportId, 0, uv_hrtime() - start, true);
+      if(!ex.isRetryable() || attempt >= activeCall.retries || !backoff(attempt)) {
+        throw;
+      }
+      stats.recordRetry(output, reportId);
+      continue;
+    }
+    stats.recordTransfer(output, reportId, bufSize, uv_hrtime() - start, false);
+    return;
+  }
+}
 
-    return scope.Escape(obj);
+// Throws once the call's deadline has passed.
+unsigned int SosDevice::attemptTimeout() {
+  if(callDeadline == 0) {
+    return activeCall.timeoutMs;
+  }
+  uint64_t now = uv_hrtime();
+  if(now >= callDeadline) {
+    throw NodeSosException(SOS_ERROR_DEADLINE, SOS_PHASE_NONE, -1, 0, false, "Deadline of %u ms exceeded", activeCall.deadlineMs);
+  }
+  uint64_t remainingMs = (callDeadline - now + 999999) / 1000000;
+  if(activeCall.timeoutMs != 0 && activeCall.timeoutMs < remainingMs) {
+    return activeCall.timeoutMs;
   }
+  return (unsigned int)remainingMs;
+}
 
-  SosDevice::SosDevice(HANDLE devHandle) {
-    initFunctionPointers();
-    this->devHandle = devHandle;
+/*
+ * Waits before retrying; returns false if the wait would reach the deadline.
+ * The transfer lock is let go meanwhile, so the animation and status threads
+ * and the broker are not held up by a device that is failing; the call's
+ * options and deadline are put back once it has the lock again. Only the
+ * report being retried is affected: other threads never move the pattern
+ * read cursors a multi-report call depends on.
+ */
+bool SosDevice::backoff(uint32_t attempt) {
+  uint64_t delayMs = (uint64_t)activeCall.backoffMs << (attempt < 16 ? attempt : 16);
+  if(delayMs > MAX_BACKOFF_MS) {
+    delayMs = MAX_BACKOFF_MS;
   }
-#else
-  /*static*/ v8::Local<v8::Object> SosDevice::New(struct usb_device *dev, struct usb_dev_handle *devHandle) {
-    Nan::EscapableHandleScope scope;
+  if(callDeadline != 0 && uv_hrtime() + delayMs * 1000000 >= callDeadline) {
+    return false;
+  }
+  SosCallOptions options = activeCall;
+  uint64_t deadline = callDeadline;
+  releaseTransferLock();
+  sleepMs((uint32_t)delayMs);
+  acquireTransferLock();
+  activeCall = options;
+  callDeadline = deadline;
+  return true;
+}
 
-    v8::Local<v8::Function> ctor = Nan::New(s_ct)->GetFunction();
-    v8::Local<v8::Object> obj = ctor->NewInstance();
-    SosDevice *self = new SosDevice(dev, devHandle);
-    self->Wrap(obj);
+SosCallOptions SosDevice::getCallOptions() {
+  uv_mutex_lock(&stateLock);
+  SosCallOptions options = callOptions;
+  uv_mutex_unlock(&stateLock);
+  return options;
+}
 
-    return scope.Escape(obj);
-  }
+void SosDevice::lock() {
+  lock(getCallOptions(), uv_hrtime());
+}
 
-  SosDevice::SosDevice(struct usb_device *dev, struct usb_dev_handle *devHandle) {
-    this->dev = dev;
-    this->devHandle = devHandle;
+void SosDevice::lock(const SosCallOptions &options, uint64_t startedAt) {
+  acquireTransferLock();
+  beginCall(options, startedAt);
+}
+
+void SosDevice::acquireTransferLock() {
+  uv_mutex_lock(&transferLock);
+  while(transferBusy) {
+    uv_cond_wait(&transferFree, &transferLock);
   }
-#endif
+  transferBusy = true;
+  uv_mutex_unlock(&transferLock);
+}
 
-#ifdef WIN32
-  HANDLE findSos() {
-    GUID hidGuid;
-    HANDLE devHandle = NULL;
-    char sosVendorIdStr[10];
-    char sosProductIdStr[10];
+void SosDevice::releaseTransferLock() {
+  uv_mutex_lock(&transferLock);
+  transferBusy = false;
+  uv_cond_signal(&transferFree);
+  uv_mutex_unlock(&transferLock);
+}
 
-    sprintf(sosVendorIdStr, "%x", sosVendorId);
-    sprintf(sosProductIdStr, "%x", sosProductId);
+void SosDevice::beginCall(const SosCallOptions &options, uint64_t startedAt) {
+  activeCall = options;
+  callDeadline = options.deadlineMs > 0 ? startedAt + options.deadlineMs * 1000000ULL : 0;
+}
 
-    HidD_GetHidGuid(&hidGuid);
+void SosDevice::unlock() {
+  if(transport != NULL) {
+    transport->endOperation();
+  }
+  releaseTransferLock();
+}
 
-    HANDLE deviceInfoSet = sosSetupDiGetClassDevs(&hidGuid, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
-    if(deviceInfoSet == INVALID_HANDLE_VALUE) {
-      return INVALID_HANDLE_VALUE;
-    }
+void SosDevice::readInfoPacket(UsbInfoPacket *usbInfoPacket) {
+  getInputReport(USB_REPORTID_IN_INFO, (char*)usbInfoPacket, sizeof(UsbInfoPacket));
 
-    SP_DEVICE_INTERFACE_DATA deviceInterfaceData;
-    SP_DEVICE_INTERFACE_DETAIL_DATA *deviceInterfaceDetailData = (SP_DEVICE_INTERFACE_DETAIL_DATA*)malloc(sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA) + 1000);
-    for(int i=0; ; i++) {
-      deviceInterfaceData.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
-      if(!sosSetupDiEnumDeviceInterfaces(deviceInfoSet, NULL, &hidGuid, i, &deviceInterfaceData)) {
-        goto deviceNotFound;
-      }
-      DWORD requiredSize;
+  // new firmware may ship different patterns
+  if(hasFirmwareVersion && firmwareVersion != usbInfoPacket->version) {
+    invalidatePatternCache();
+  }
+  firmwareVersion = usbInfoPacket->version;
+  hasFirmwareVersion = true;
+
+  uv_mutex_lock(&stateLock);
+  memcpy(&lastInfo, usbInfoPacket, sizeof(UsbInfoPacket));
+  hasLastInfo = true;
+  uv_mutex_unlock(&stateLock);
+
+  // The info carries the modes but not the manual LEDs.
+  seedPlayback(usbInfoPacket->audioMode, usbInfoPacket->audioPlayDuration, &shadowState.audioMode, &shadowState.audioPlayDuration);
+  seedPlayback(usbInfoPacket->ledMode, usbInfoPacket->ledPlayDuration, &shadowState.ledMode, &shadowState.ledPlayDuration);
+  forgetManualLedsUnlessManual(&shadowState);
+}
 
-      deviceInterfaceDetailData->cbSize = 8;
+void SosDevice::forgetState() {
+  initControlPacket(&shadowState);
+}
 
-      SP_DEVINFO_DATA deviceInfoData;
-      deviceInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
+void SosDevice::invalidatePatternCache() {
+  ledPatternsCached = false;
+  audioPatternsCached = false;
+  ledPatternCache.clear();
+  audioPatternCache.clear();
+}
 
-      sosSetupDiGetDeviceInterfaceDetail(
-        deviceInfoSet,
-        &deviceInterfaceData,
-        deviceInterfaceDetailData,
-        1000,
-        &requiredSize,
-        &deviceInfoData);
+// A detached device may come back with other firmware, so its cache is not
+// served; reconnecting drops it.
+void SosDevice::readLedPatternPackets(std::vector<UsbReadLedPacket> &ledPatterns) {
+  checkAttached();
+  if(ledPatternsCached) {
+    ledPatterns = ledPatternCache;
+    return;
+  }
 
-      if(strstr(deviceInterfaceDetailData->DevicePath, sosVendorIdStr)
-        && strstr(deviceInterfaceDetailData->DevicePath, sosProductIdStr)) {
-        break;
-      }
+  UsbControlPacket usbControlPacket;
+  initControlPacket(&usbControlPacket);
+  usbControlPacket.readLedIndex = 0;
+  setOutputReport(USB_REPORTID_OUT_CONTROL, (char*)&usbControlPacket, sizeof(usbControlPacket));
+
+  UsbReadLedPacket usbReadLedPacket;
+  ledPatternCache.clear();
+  for(;;) {
+    getInputReport(USB_REPORTID_IN_READ_LED, (char*)&usbReadLedPacket, sizeof(usbReadLedPacket));
+    if(usbReadLedPacket.id == 0xff) {
+      break;
     }
+    ledPatternCache.push_back(usbReadLedPacket);
+  }
+  ledPatternsCached = true;
+  ledPatterns = ledPatternCache;
+}
 
-    devHandle = CreateFile(
-      deviceInterfaceDetailData->DevicePath,
-      GENERIC_READ | GENERIC_WRITE,
+void SosDevice::readAudioPatternPackets(std::vector<UsbReadAudioPacket> &audioPatterns) {
+  checkAttached();
+  if(audioPatternsCached) {
+    audioPatterns = audioPatternCache;
+    return;
+  }
+
+  UsbControlPacket usbControlPacket;
+  initControlPacket(&usbControlPacket);
+  usbControlPacket.readAudioIndex = 0;
+  setOutputReport(USB_REPORTID_OUT_CONTROL, (char*)&usbControlPacket, sizeof(usbControlPacket));
+
+  UsbReadAudioPacket usbReadAudioPacket;
+  audioPatternCache.clear();
+  for(;;) {
+    getInputReport(USB_REPORTID_IN_READ_AUDIO, (char*)&usbReadAudioPacket, sizeof(usbReadAudioPacket));
+    if(usbReadAudioPacket.id == 0xff) {
+      break;
+    }
+    audioPatternCache.push_back(usbReadAudioPacket);
+  }
+  audioPatternsCached = true;
+  audioPatterns = audioPatternCache;
+}
+
+/*
+ * Only the fields that differ from the shadow state are sent, and nothing at
+ * all when the device already has every field. Broker clients keep no
+ * shadow, since other clients change the device behind their back; the
+ * broker diffs their packets against its own.
+ */
+void SosDevice::writeControlPacket(UsbControlPacket *usbControlPacket) {
+  if(transportType != TRANSPORT_BROKER && !diffControlPacket(&shadowState, usbControlPacket)) {
+    stats.recordControlPacketSuppressed();
+    return;
+  }
+  try {
+    setOutputReport(USB_REPORTID_OUT_CONTROL, (char*)usbControlPacket, sizeof(UsbControlPacket));
+  } catch(NodeSosException &ex) {
+    updateShadow(&shadowState, usbControlPacket, false);
+    throw;
+  }
+  updateShadow(&shadowState, usbControlPacket, true);
+  stats.recordControlPacketWritten();
+}
+
+void SosDevice::writeDataPacket(uint32_t address, const char *data, size_t length) {
+  char report[64];
+  UsbDataPacket usbDataPacket;
+
+  // unused bytes keep the erased flash value
+  usbDataPacket.address = address;
+  memset(usbDataPacket.data, 0xff, USB_DATA_SIZE);
+  memcpy(usbDataPacket.data, data, length < USB_DATA_SIZE ? length : USB_DATA_SIZE);
+
+  memset(report, 0, sizeof(report));
+  report[0] = USB_REPORTID_OUT_DATA_UPLOAD;
+  memcpy(report + 1, &usbDataPacket, sizeof(usbDataPacket));
+  setOutputReport(USB_REPORTID_OUT_DATA_UPLOAD, report, 1 + sizeof(usbDataPacket));
+}
+
+/*
+ * Field tables generated from the packet layouts. Results are built by
+ * walking these in a fixed order, so every result object gets the same shape,
+ * and the property keys are created once as internalized strings in
+ * initPropertyKeys rather than on every call.
+ */
+struct PacketField {
+  const char *name;
+  size_t offset;
+  size_t size;
+  int scale; // JS value = packet value * scale
+};
+
+#define PACKET_FIELD(type, field, scale) { #field, offsetof(type, field), sizeof(((type*)0)->field), scale }
+
+static const PacketField infoFields[] = {
+  PACKET_FIELD(UsbInfoPacket, version, 1),
+  PACKET_FIELD(UsbInfoPacket, hardwareType, 1),
+  PACKET_FIELD(UsbInfoPacket, hardwareVersion, 1),
+  PACKET_FIELD(UsbInfoPacket, externalMemorySize, 1),
+  PACKET_FIELD(UsbInfoPacket, audioMode, 1),
+  PACKET_FIELD(UsbInfoPacket, audioPlayDuration, 1),
+  PACKET_FIELD(UsbInfoPacket, ledMode, 1),
+  PACKET_FIELD(UsbInfoPacket, ledPlayDuration, 1)
+};
+static const int INFO_FIELD_COUNT = sizeof(infoFields) / sizeof(infoFields[0]);
+
+// durations are given in ms but sent in 1/10 s
+static const PacketField controlFields[] = {
+  PACKET_FIELD(UsbControlPacket, ledMode, 1),
+  PACKET_FIELD(UsbControlPacket, ledPlayDuration, 10),
+  PACKET_FIELD(UsbControlPacket, audioMode, 1),
+  PACKET_FIELD(UsbControlPacket, audioPlayDuration, 10),
+  PACKET_FIELD(UsbControlPacket, manualLeds0, 1),
+  PACKET_FIELD(UsbControlPacket, manualLeds1, 1),
+  PACKET_FIELD(UsbControlPacket, manualLeds2, 1),
+  PACKET_FIELD(UsbControlPacket, manualLeds3, 1),
+  PACKET_FIELD(UsbControlPacket, manualLeds4, 1)
+};
+static const int CONTROL_FIELD_COUNT = sizeof(controlFields) / sizeof(controlFields[0]);
+
+#undef PACKET_FIELD
+
+enum PropertyKey {
+  KEY_ID,
+  KEY_NAME,
+  KEY_LED_PATTERNS,
+  KEY_AUDIO_PATTERNS,
+  KEY_CODE,
+  KEY_ERRNO,
+  KEY_PHASE,
+  KEY_REPORT_ID,
+  KEY_RETRYABLE,
+  KEY_COUNT
+};
+static const char *propertyKeyNames[KEY_COUNT] = {
+  "id", "name", "ledPatterns", "audioPatterns",
+  "code", "errno", "phase", "reportId", "retryable"
+};
+
+static Nan::Persistent<v8::String> infoFieldKeys[INFO_FIELD_COUNT];
+static Nan::Persistent<v8::String> controlFieldKeys[CONTROL_FIELD_COUNT];
+static Nan::Persistent<v8::String> propertyKeys[KEY_COUNT];
+
+static v8::Local<v8::String> internalizedString(const char *value) {
+  #if NODE_MODULE_VERSION >= NODE_4_0_MODULE_VERSION
+    return v8::String::NewFromUtf8(v8::Isolate::GetCurrent(), value, v8::NewStringType::kInternalized).ToLocalChecked();
+  #else
+    return v8::String::NewFromUtf8(v8::Isolate::GetCurrent(), value, v8::String::kInternalizedString);
+  #endif
+}
+
+static void initPropertyKeys() {
+  for(int i = 0; i < INFO_FIELD_COUNT; i++) {
+    infoFieldKeys[i].Reset(internalizedString(infoFields[i].name));
+  }
+  for(int i = 0; i < CONTROL_FIELD_COUNT; i++) {
+    controlFieldKeys[i].Reset(internalizedString(controlFields[i].name));
+  }
+  for(int i = 0; i < KEY_COUNT; i++) {
+    propertyKeys[i].Reset(internalizedString(propertyKeyNames[i]));
+  }
+}
+
+static inline v8::Local<v8::String> propertyKey(PropertyKey key) {
+  return Nan::New(propertyKeys[key]);
+}
+
+v8::Local<v8::Value> NodeSosException::toV8() const {
+  Nan::EscapableHandleScope scope;
+  v8::Local<v8::Object> error = Nan::Error(errorMessage).As<v8::Object>();
+  Nan::Set(error, propertyKey(KEY_CODE), Nan::New<v8::String>(errorCodeName(errorCode)).ToLocalChecked());
+  if(nativeErrorNumber != 0) {
+    Nan::Set(error, propertyKey(KEY_ERRNO), Nan::New<v8::Integer>(nativeErrorNumber));
+  }
+  if(errorPhase != SOS_PHASE_NONE) {
+    Nan::Set(error, propertyKey(KEY_PHASE), Nan::New<v8::String>(errorPhaseName(errorPhase)).ToLocalChecked());
+  }
+  if(errorReportId >= 0) {
+    Nan::Set(error, propertyKey(KEY_REPORT_ID), Nan::New<v8::Integer>(errorReportId));
+  }
+  Nan::Set(error, propertyKey(KEY_RETRYABLE), Nan::New<v8::Boolean>(retryable));
+  return scope.Escape(error);
+}
+
+static uint32_t readPacketField(const void *packet, const PacketField &field) {
+  const uint8_t *p = (const uint8_t*)packet + field.offset;
+  uint8_t value8;
+  uint16_t value16;
+  uint32_t value32;
+
+  switch(field.size) {
+    case 1:
+      memcpy(&value8, p, 1);
+      return value8;
+    case 2:
+      memcpy(&value16, p, 2);
+      return value16;
+    default:
+      memcpy(&value32, p, 4);
+      return value32;
+  }
+}
+
+static void writePacketField(void *packet, const PacketField &field, uint32_t value) {
+  uint8_t *p = (uint8_t*)packet + field.offset;
+  uint8_t value8 = (uint8_t)value;
+  uint16_t value16 = (uint16_t)value;
+
+  switch(field.size) {
+    case 1:
+      memcpy(p, &value8, 1);
+      break;
+    case 2:
+      memcpy(p, &value16, 2);
+      break;
+    default:
+      memcpy(p, &value, 4);
+      break;
+  }
+}
+
+static v8::Local<v8::String> patternName(const char *name) {
+  // names are fixed width and not guaranteed to be null terminated
+  size_t length = 0;
+  while(length < USB_NAME_SIZE && name[length] != '\0') {
+    length++;
+  }
+  return Nan::New<v8::String>(name, (int)length).ToLocalChecked();
+}
+
+/*
+ * Recycles worker objects through per-size free lists so the steady state of
+ * a polling client does not touch the heap for them. Workers are created and
+ * destroyed on the main thread only, so no locking is needed.
+ */
+class WorkerPool {
+  struct FreeList {
+    size_t size;
+    std::vector<void*> blocks;
+  };
+  static std::vector<FreeList> freeLists;
+  static const size_t MAX_FREE_BLOCKS = 32;
+
+  static FreeList &freeListFor(size_t size) {
+    for(size_t i = 0; i < freeLists.size(); i++) {
+      if(freeLists[i].size == size) {
+        return freeLists[i];
+      }
+    }
+    FreeList freeList;
+    freeList.size = size;
+    freeLists.push_back(freeList);
+    return freeLists.back();
+  }
+
+public:
+  static void *allocate(size_t size) {
+    FreeList &freeList = freeListFor(size);
+    if(freeList.blocks.empty()) {
+      return ::operator new(size);
+    }
+    void *block = freeList.blocks.back();
+    freeList.blocks.pop_back();
+    return block;
+  }
+
+  static void release(void *block, size_t size) {
+    FreeList &freeList = freeListFor(size);
+    if(freeList.blocks.size() >= MAX_FREE_BLOCKS) {
+      ::operator delete(block);
+      return;
+    }
+    freeList.blocks.push_back(block);
+  }
+};
+
+std::vector<WorkerPool::FreeList> WorkerPool::freeLists;
+
+/*
+ * Base class for all device I/O. Workers wait in their device's call queue
+ * rather than on the libuv thread pool, so a slow device ties up at most one
+ * pool thread however many calls are queued for it. Execute runs on the pool
+ * with the device's transfer lock held; only the Handle*Callback methods
+ * touch V8.
+ */
+class SosDeviceWorker : public Nan::AsyncWorker, public SosDeviceCall {
+public:
+  SosDeviceWorker(Nan::Callback *callback, SosDevice *sosDevice, v8::Local<v8::Object> self, const SosCallOptions &options)
+    : Nan::AsyncWorker(callback), sosDevice(sosDevice), options(options), queuedAt(uv_hrtime()), callStartedAt(queuedAt) {
+    // keep the device object alive until the worker completes
+    SaveToPersistent("device", self);
+  }
+
+  void start() {
+    Nan::AsyncQueueWorker(this);
+  }
+
+  // Starts the next queued call before running this one's callback.
+  void WorkComplete() {
+    sosDevice->callFinished();
+    Nan::AsyncWorker::WorkComplete();
+  }
+
+  // nan deletes workers through a virtual destructor, so size is always the
+  // size of the most derived class
+  static void *operator new(size_t size) {
+    return WorkerPool::allocate(size);
+  }
+
+  static void operator delete(void *block, size_t size) {
+    WorkerPool::release(block, size);
+  }
+
+  void Execute() {
+    // the deadline covers the wait for the device as well
+    sosDevice->lock(options, callStartedAt);
+    sosDevice->getStatsRecorder().recordQueueWait(uv_hrtime() - queuedAt);
+    #ifdef SOS_BENCH
+      uint64_t start = uv_hrtime();
+    #endif
+    try {
+      ExecuteLocked();
+    } catch(NodeSosException &ex) {
+      error = ex;
+      SetErrorMessage(ex.message());
+    }
+    #ifdef SOS_BENCH
+      ioTime = uv_hrtime() - start;
+    #endif
+    sosDevice->unlock();
+  }
+
+protected:
+  SosDevice *sosDevice;
+  SosCallOptions options;
+  uint64_t queuedAt;
+  // when the JS call was made, which any deadline is counted from
+  uint64_t callStartedAt;
+  NodeSosException error;
+  #ifdef SOS_BENCH
+    uint64_t ioTime;
+  #endif
+
+  virtual void ExecuteLocked() = 0;
+
+  void HandleErrorCallback() {
+    Nan::HandleScope scope;
+    callbackWith(callback, error.toV8(), Nan::Undefined());
+  }
+
+  void callbackWithResult(v8::Local<v8::Value> result) {
+    callbackWith(callback, Nan::Undefined(), result);
+  }
+
+  // The bench build passes the nanoseconds spent on device I/O as a third
+  // argument, so the benchmark can tell it apart from queueing and marshalling.
+  void callbackWith(Nan::Callback *target, v8::Local<v8::Value> err, v8::Local<v8::Value> result) {
+    v8::Local<v8::Value> callbackArgs[3];
+    callbackArgs[0] = err;
+    callbackArgs[1] = result;
+    #ifdef SOS_BENCH
+      callbackArgs[2] = Nan::New<v8::Number>((double)ioTime);
+      target->Call(3, callbackArgs);
+    #else
+      target->Call(2, callbackArgs);
+    #endif
+  }
+};
+
+v8::Local<v8::Object> infoToV8(const UsbInfoPacket &usbInfoPacket) {
+  Nan::EscapableHandleScope scope;
+  v8::Local<v8::Object> result = Nan::New<v8::Object>();
+  for(int i = 0; i < INFO_FIELD_COUNT; i++) {
+    Nan::Set(result, Nan::New(infoFieldKeys[i]), Nan::New<v8::Number>(readPacketField(&usbInfoPacket, infoFields[i]) * infoFields[i].scale));
+  }
+  return scope.Escape(result);
+}
+
+// UsbReadLedPacket and UsbReadAudioPacket share the same id/name layout.
+template<class PatternPacket>
+static v8::Local<v8::Array> patternsToV8(const std::vector<PatternPacket> &patterns) {
+  Nan::EscapableHandleScope scope;
+  v8::Local<v8::String> idKey = propertyKey(KEY_ID);
+  v8::Local<v8::String> nameKey = propertyKey(KEY_NAME);
+  v8::Local<v8::Array> result = Nan::New<v8::Array>((int)patterns.size());
+  for(size_t i = 0; i < patterns.size(); i++) {
+    v8::Local<v8::Object> pattern = Nan::New<v8::Object>();
+    Nan::Set(pattern, idKey, Nan::New<v8::Integer>(patterns[i].id));
+    Nan::Set(pattern, nameKey, patternName(patterns[i].name));
+    Nan::Set(result, (uint32_t)i, pattern);
+  }
+  return scope.Escape(result);
+}
+
+class ReadInfoWorker : public SosDeviceWorker {
+  UsbInfoPacket usbInfoPacket;
+
+public:
+  ReadInfoWorker(Nan::Callback *callback, SosDevice *sosDevice, v8::Local<v8::Object> self, const SosCallOptions &options)
+    : SosDeviceWorker(callback, sosDevice, self, options) {
+  }
+
+protected:
+  void ExecuteLocked() {
+    sosDevice->readInfoPacket(&usbInfoPacket);
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+    callbackWithResult(infoToV8(usbInfoPacket));
+  }
+};
+
+// Forgets the shadow state before reading the info, which seeds it again.
+class ResyncStateWorker : public ReadInfoWorker {
+public:
+  ResyncStateWorker(Nan::Callback *callback, SosDevice *sosDevice, v8::Local<v8::Object> self, const SosCallOptions &options)
+    : ReadInfoWorker(callback, sosDevice, self, options) {
+  }
+
+protected:
+  void ExecuteLocked() {
+    sosDevice->forgetState();
+    ReadInfoWorker::ExecuteLocked();
+  }
+};
+
+/*
+ * Reads the info packet straight into the memory of a caller supplied
+ * Buffer, which is kept alive by the worker until it completes.
+ */
+class ReadInfoIntoWorker : public SosDeviceWorker {
+  UsbInfoPacket *usbInfoPacket;
+
+public:
+  ReadInfoIntoWorker(Nan::Callback *callback, SosDevice *sosDevice, v8::Local<v8::Object> self, v8::Local<v8::Object> buffer, const SosCallOptions &options)
+    : SosDeviceWorker(callback, sosDevice, self, options) {
+    SaveToPersistent("buffer", buffer);
+    usbInfoPacket = (UsbInfoPacket*)node::Buffer::Data(buffer);
+  }
+
+protected:
+  void ExecuteLocked() {
+    sosDevice->readInfoPacket(usbInfoPacket);
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+    callbackWithResult(GetFromPersistent("buffer"));
+  }
+};
+
+class ReadLedPatternsWorker : public SosDeviceWorker {
+  std::vector<UsbReadLedPacket> ledPatterns;
+
+public:
+  ReadLedPatternsWorker(Nan::Callback *callback, SosDevice *sosDevice, v8::Local<v8::Object> self, const SosCallOptions &options)
+    : SosDeviceWorker(callback, sosDevice, self, options) {
+  }
+
+protected:
+  void ExecuteLocked() {
+    sosDevice->readLedPatternPackets(ledPatterns);
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+    callbackWithResult(patternsToV8(ledPatterns));
+  }
+};
+
+class ReadAudioPatternsWorker : public SosDeviceWorker {
+  std::vector<UsbReadAudioPacket> audioPatterns;
+
+public:
+  ReadAudioPatternsWorker(Nan::Callback *callback, SosDevice *sosDevice, v8::Local<v8::Object> self, const SosCallOptions &options)
+    : SosDeviceWorker(callback, sosDevice, self, options) {
+  }
+
+protected:
+  void ExecuteLocked() {
+    sosDevice->readAudioPatternPackets(audioPatterns);
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+    callbackWithResult(patternsToV8(audioPatterns));
+  }
+};
+
+/*
+ * Reads the info packet and both pattern tables in one pass on the pool
+ * thread and builds the combined result once.
+ */
+class ReadAllInfoWorker : public SosDeviceWorker {
+  UsbInfoPacket usbInfoPacket;
+  std::vector<UsbReadLedPacket> ledPatterns;
+  std::vector<UsbReadAudioPacket> audioPatterns;
+
+public:
+  ReadAllInfoWorker(Nan::Callback *callback, SosDevice *sosDevice, v8::Local<v8::Object> self, const SosCallOptions &options)
+    : SosDeviceWorker(callback, sosDevice, self, options) {
+  }
+
+protected:
+  void ExecuteLocked() {
+    // info first so a firmware change invalidates the cached patterns
+    sosDevice->readInfoPacket(&usbInfoPacket);
+    sosDevice->readLedPatternPackets(ledPatterns);
+    sosDevice->readAudioPatternPackets(audioPatterns);
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+    v8::Local<v8::Object> result = infoToV8(usbInfoPacket);
+    Nan::Set(result, propertyKey(KEY_LED_PATTERNS), patternsToV8(ledPatterns));
+    Nan::Set(result, propertyKey(KEY_AUDIO_PATTERNS), patternsToV8(audioPatterns));
+    callbackWithResult(result);
+  }
+};
+
+/*
+ * Writes one merged control packet on behalf of every sendControlPacket call
+ * that was coalesced into it, then starts the next queued write.
+ */
+class SendControlPacketWorker : public SosDeviceWorker {
+  UsbControlPacket usbControlPacket;
+  std::vector<Nan::Callback*> callbacks;
+
+public:
+  SendControlPacketWorker(SosDevice *sosDevice, v8::Local<v8::Object> self, UsbControlPacket *usbControlPacket, std::vector<Nan::Callback*> &callbacks)
+    : SosDeviceWorker(NULL, sosDevice, self, sosDevice->getCallOptions()) {
+    memcpy(&this->usbControlPacket, usbControlPacket, sizeof(UsbControlPacket));
+    this->callbacks.swap(callbacks);
+  }
+
+protected:
+  void ExecuteLocked() {
+    sosDevice->writeControlPacket(&usbControlPacket);
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+    completeAll(Nan::Undefined());
+  }
+
+  void HandleErrorCallback() {
+    Nan::HandleScope scope;
+    completeAll(error.toV8());
+  }
+
+  void completeAll(v8::Local<v8::Value> err) {
+    v8::Local<v8::Object> self = GetFromPersistent("device").As<v8::Object>();
+    sosDevice->controlPacketFinished(self);
+
+    for(size_t i = 0; i < callbacks.size(); i++) {
+      callbackWith(callbacks[i], err, Nan::Undefined());
+      delete callbacks[i];
+    }
+    callbacks.clear();
+  }
+};
+
+/*
+ * Group writes block a pool thread each for the whole write, so across all
+ * groups at most one less than the pool has threads are queued on their
+ * devices at once and a thread stays free for other calls; the others wait
+ * in waitingGroupWrites in call order. libuv reads UV_THREADPOOL_SIZE when
+ * the pool starts.
+ */
+static size_t groupWriteLimit() {
+  static size_t limit = 0;
+  if(limit == 0) {
+    const char *poolSize = getenv("UV_THREADPOOL_SIZE");
+    long threads = poolSize != NULL ? atol(poolSize) : 4;
+    if(threads < 1) {
+      threads = 1;
+    } else if(threads > 1024) {
+      threads = 1024;
+    }
+    limit = threads > 1 ? (size_t)threads - 1 : 1;
+  }
+  return limit;
+}
+
+struct GroupWriteCall {
+  SosDevice *sosDevice;
+  SosDeviceCall *call;
+};
+
+// Main thread only.
+static std::deque<GroupWriteCall> waitingGroupWrites;
+static size_t runningGroupWrites = 0;
+
+static void startGroupWrites() {
+  while(runningGroupWrites < groupWriteLimit() && !waitingGroupWrites.empty()) {
+    GroupWriteCall write = waitingGroupWrites.front();
+    waitingGroupWrites.pop_front();
+    runningGroupWrites++;
+    write.sosDevice->queueCall(write.call);
+  }
+}
+
+static void queueGroupWrite(SosDevice *sosDevice, SosDeviceCall *call) {
+  GroupWriteCall write = { sosDevice, call };
+  waitingGroupWrites.push_back(write);
+  startGroupWrites();
+}
+
+static void groupWriteFinished() {
+  runningGroupWrites--;
+  startGroupWrites();
+}
+
+/*
+ * One sendControlPackets call. Each device's write runs in its own worker
+ * queued on that device, so the writes proceed in parallel, up to
+ * groupWriteLimit() at a time, and the call completes once the slowest
+ * device has. Main thread only.
+ */
+struct ControlGroupWrite {
+  Nan::Callback *callback;
+  size_t remaining;
+  uint64_t startedAt;
+  std::vector<bool> failed;
+  std::vector<NodeSosException> errors;
+  std::vector<uint64_t> elapsedNs;
+
+  ControlGroupWrite(Nan::Callback *callback, size_t deviceCount)
+    : callback(callback), remaining(deviceCount), startedAt(uv_hrtime()),
+      failed(deviceCount, false), errors(deviceCount), elapsedNs(deviceCount, 0) {
+  }
+
+  ~ControlGroupWrite() {
+    delete callback;
+  }
+
+  void complete(size_t index, const NodeSosException *error) {
+    elapsedNs[index] = uv_hrtime() - startedAt;
+    if(error != NULL) {
+      failed[index] = true;
+      errors[index] = *error;
+    }
+    if(--remaining == 0) {
+      finish();
+    }
+  }
+
+  // callback(null, [{ error, elapsedMs }, ...]) in device order
+  void finish() {
+    Nan::HandleScope scope;
+    v8::Local<v8::Array> results = Nan::New<v8::Array>((int)failed.size());
+    for(size_t i = 0; i < failed.size(); i++) {
+      v8::Local<v8::Object> result = Nan::New<v8::Object>();
+      Nan::Set(result, Nan::New<v8::String>("error").ToLocalChecked(), failed[i] ? errors[i].toV8() : v8::Local<v8::Value>(Nan::Null()));
+      Nan::Set(result, Nan::New<v8::String>("elapsedMs").ToLocalChecked(), Nan::New<v8::Number>(elapsedNs[i] / 1e6));
+      Nan::Set(results, (uint32_t)i, result);
+    }
+    v8::Local<v8::Value> callbackArgs[2];
+    callbackArgs[0] = Nan::Null();
+    callbackArgs[1] = results;
+    Nan::Callback *done = callback;
+    callback = NULL;
+    delete this;
+    done->Call(2, callbackArgs);
+    delete done;
+  }
+};
+
+/*
+ * Writes one device's packet for a ControlGroupWrite. Any deadline is counted
+ * from when the group call was made, so it is shared by every device.
+ */
+class ControlGroupWorker : public SosDeviceWorker {
+  ControlGroupWrite *group;
+  size_t index;
+  UsbControlPacket usbControlPacket;
+
+public:
+  ControlGroupWorker(ControlGroupWrite *group, size_t index, SosDevice *sosDevice, v8::Local<v8::Object> self, const UsbControlPacket *usbControlPacket, const SosCallOptions &options)
+    : SosDeviceWorker(NULL, sosDevice, self, options), group(group), index(index) {
+    callStartedAt = group->startedAt;
+    memcpy(&this->usbControlPacket, usbControlPacket, sizeof(UsbControlPacket));
+  }
+
+protected:
+  void ExecuteLocked() {
+    sosDevice->writeControlPacket(&usbControlPacket);
+  }
+
+  void HandleOKCallback() {
+    groupWriteFinished();
+    group->complete(index, NULL);
+  }
+
+  void HandleErrorCallback() {
+    groupWriteFinished();
+    group->complete(index, &error);
+  }
+};
+
+// Packets an upload writes before the calls queued meanwhile get the device.
+static const uint32_t UPLOAD_PACKETS_PER_TURN = 16;
+
+/*
+ * One uploadData call, handed from one UploadDataWorker to the next. Main
+ * thread only; the workers copy what they need.
+ */
+struct UploadData {
+  Nan::Callback *callback;
+  Nan::Callback *progressCallback;
+  SosCallOptions options;
+  uint64_t startedAt;
+  uint32_t address;
+  uint32_t length;
+  uint32_t bytesSent;
+  uint64_t elapsedNs;
+
+  UploadData(Nan::Callback *callback, Nan::Callback *progressCallback, const SosCallOptions &options, uint32_t address, uint32_t length)
+    : callback(callback), progressCallback(progressCallback), options(options), startedAt(uv_hrtime()),
+      address(address), length(length), bytesSent(0), elapsedNs(0) {
+  }
+
+  ~UploadData() {
+    delete callback;
+    delete progressCallback;
+  }
+};
+
+/*
+ * Streams a buffer into the device's external memory as UsbDataPacket
+ * reports, UPLOAD_PACKETS_PER_TURN at a time. Each turn queues the next one
+ * behind the calls queued meanwhile, so control packets are not held up
+ * behind a long upload. The first turn checks the upload fits; one deadline
+ * covers the whole upload.
+ */
+class UploadDataWorker : public SosDeviceWorker {
+  UploadData *upload;
+  const char *data;
+  uint32_t address;
+  uint32_t length;
+  uint32_t bytesSent;
+  uint64_t elapsedNs;
+
+public:
+  UploadDataWorker(UploadData *upload, SosDevice *sosDevice, v8::Local<v8::Object> self, v8::Local<v8::Object> buffer)
+    : SosDeviceWorker(NULL, sosDevice, self, upload->options), upload(upload),
+      address(upload->address), length(upload->length), bytesSent(upload->bytesSent), elapsedNs(0) {
+    callStartedAt = upload->startedAt;
+    SaveToPersistent("data", buffer);
+    data = node::Buffer::Data(buffer);
+  }
+
+protected:
+  void ExecuteLocked() {
+    if(bytesSent == 0) {
+      UsbInfoPacket usbInfoPacket;
+      sosDevice->readInfoPacket(&usbInfoPacket);
+
+      // the last packet is padded, and the device writes every packet whole
+      uint64_t paddedLength = ((uint64_t)length + USB_DATA_SIZE - 1) / USB_DATA_SIZE * USB_DATA_SIZE;
+      if((uint64_t)address + paddedLength > usbInfoPacket.externalMemorySize) {
+        throw NodeSosException(SOS_ERROR_OUT_OF_RANGE, SOS_PHASE_NONE, -1, 0, false,
+          "Upload of %u bytes (%u padded to whole packets) at 0x%08X exceeds external memory size of %u bytes",
+          length, (uint32_t)paddedLength, address, usbInfoPacket.externalMemorySize);
+      }
+    }
+
+    uint64_t start = uv_hrtime();
+    for(uint32_t packet = 0; packet < UPLOAD_PACKETS_PER_TURN && bytesSent < length; packet++) {
+      uint32_t chunkLength = length - bytesSent < USB_DATA_SIZE ? length - bytesSent : USB_DATA_SIZE;
+      sosDevice->writeDataPacket(address + bytesSent, data + bytesSent, chunkLength);
+      bytesSent += chunkLength;
+    }
+    elapsedNs = uv_hrtime() - start;
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+    upload->bytesSent = bytesSent;
+    upload->elapsedNs += elapsedNs;
+    if(upload->progressCallback != NULL && bytesSent > 0) {
+      v8::Local<v8::Value> progressArgs[2];
+      progressArgs[0] = Nan::New<v8::Number>(bytesSent);
+      progressArgs[1] = Nan::New<v8::Number>(length);
+      upload->progressCallback->Call(2, progressArgs);
+    }
+
+    if(bytesSent < length) {
+      v8::Local<v8::Object> self = GetFromPersistent("device").As<v8::Object>();
+      v8::Local<v8::Object> buffer = GetFromPersistent("data").As<v8::Object>();
+      sosDevice->queueCall(new UploadDataWorker(upload, sosDevice, self, buffer));
+      return;
+    }
+
+    double elapsedMs = upload->elapsedNs / 1e6;
+    v8::Local<v8::Object> result = Nan::New<v8::Object>();
+    Nan::Set(result, Nan::New<v8::String>("bytes").ToLocalChecked(), Nan::New<v8::Number>(length));
+    Nan::Set(result, Nan::New<v8::String>("elapsedMs").ToLocalChecked(), Nan::New<v8::Number>(elapsedMs));
+    Nan::Set(result, Nan::New<v8::String>("bytesPerSecond").ToLocalChecked(),
+      Nan::New<v8::Number>(upload->elapsedNs > 0 ? length * 1e9 / upload->elapsedNs : 0));
+    callbackWith(upload->callback, Nan::Undefined(), result);
+    delete upload;
+  }
+
+  void HandleErrorCallback() {
+    Nan::HandleScope scope;
+    callbackWith(upload->callback, error.toV8(), Nan::Undefined());
+    delete upload;
+  }
+};
+
+void SosDevice::queueCall(SosDeviceCall *call) {
+  queuedCalls.push_back(call);
+  if(!callRunning) {
+    startNextCall();
+  }
+}
+
+void SosDevice::callFinished() {
+  callRunning = false;
+  startNextCall();
+}
+
+void SosDevice::startNextCall() {
+  if(queuedCalls.empty()) {
+    return;
+  }
+  SosDeviceCall *call = queuedCalls.front();
+  queuedCalls.pop_front();
+  callRunning = true;
+  call->start();
+}
+
+/*
+ * Control packets are written one at a time. While a write is in flight new
+ * packets are merged field by field into a single pending packet, so a burst
+ * of updates costs at most one more transfer and only the latest value of
+ * each field reaches the device. Main thread only.
+ */
+void SosDevice::queueControlPacket(v8::Local<v8::Object> self, const UsbControlPacket *usbControlPacket, Nan::Callback *callback) {
+  stats.recordControlPacket(!pendingControlCallbacks.empty());
+  mergeControlPacket(&pendingControlPacket, usbControlPacket);
+  pendingControlCallbacks.push_back(callback);
+  if(!controlPacketInFlight) {
+    flushControlPackets(self);
+  }
+}
+
+void SosDevice::controlPacketFinished(v8::Local<v8::Object> self) {
+  controlPacketInFlight = false;
+  if(!pendingControlCallbacks.empty()) {
+    flushControlPackets(self);
+  }
+}
+
+void SosDevice::flushControlPackets(v8::Local<v8::Object> self) {
+  controlPacketInFlight = true;
+  queueCall(new SendControlPacketWorker(this, self, &pendingControlPacket, pendingControlCallbacks));
+  initControlPacket(&pendingControlPacket);
+}
+
+uint32_t getUint32Option(v8::Local<v8::Value> options, const char *name, uint32_t defaultValue) {
+  if(!options->IsObject()) {
+    return defaultValue;
+  }
+  v8::Local<v8::Object> obj = options.As<v8::Object>();
+  v8::Local<v8::String> key = Nan::New<v8::String>(name).ToLocalChecked();
+  if(!Nan::Has(obj, key).FromMaybe(false)) {
+    return defaultValue;
+  }
+  return Nan::To<uint32_t>(Nan::Get(obj, key).ToLocalChecked()).FromMaybe(defaultValue);
+}
+
+// Overlays the timeout, retries, backoff and deadline properties of value.
+static void readCallOptions(v8::Local<v8::Value> value, SosCallOptions *options) {
+  options->timeoutMs = getUint32Option(value, "timeout", options->timeoutMs);
+  options->retries = getUint32Option(value, "retries", options->retries);
+  options->backoffMs = getUint32Option(value, "backoff", options->backoffMs);
+  options->deadlineMs = getUint32Option(value, "deadline", options->deadlineMs);
+}
+
+// Device reads take an optional options object before their callback, which
+// overrides the device's call options for that call only.
+static Nan::Callback *optionsAndCallback(const Nan::FunctionCallbackInfo<v8::Value> &info, int index, SosCallOptions *options) {
+  if(info[index]->IsFunction()) {
+    return new Nan::Callback(info[index].As<v8::Function>());
+  }
+  readCallOptions(info[index], options);
+  return new Nan::Callback(info[index + 1].As<v8::Function>());
+}
+
+void SosDevice::animationFinished(LedAnimation *finished) {
+  if(animation == finished) {
+    animation = NULL;
+  }
+}
+
+void SosDevice::statusPollerFinished(StatusPoller *finished) {
+  if(statusPoller == finished) {
+    statusPoller = NULL;
+  }
+}
+
+NAN_METHOD(SosDevice::readInfo) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  SosCallOptions options = sosDevice->getCallOptions();
+  Nan::Callback *callback = optionsAndCallback(info, 0, &options);
+  sosDevice->queueCall(new ReadInfoWorker(callback, sosDevice, info.This(), options));
+}
+
+/*
+ * resyncState([options], callback). Drops the shadow state so that the next
+ * control packet is sent in full, and reads the info to seed it again.
+ */
+NAN_METHOD(SosDevice::resyncState) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  SosCallOptions options = sosDevice->getCallOptions();
+  Nan::Callback *callback = optionsAndCallback(info, 0, &options);
+  sosDevice->queueCall(new ResyncStateWorker(callback, sosDevice, info.This(), options));
+}
+
+NAN_METHOD(SosDevice::readAllInfo) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  SosCallOptions options = sosDevice->getCallOptions();
+  Nan::Callback *callback = optionsAndCallback(info, 0, &options);
+  sosDevice->queueCall(new ReadAllInfoWorker(callback, sosDevice, info.This(), options));
+}
+
+NAN_METHOD(SosDevice::readLedPatterns) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  SosCallOptions options = sosDevice->getCallOptions();
+  Nan::Callback *callback = optionsAndCallback(info, 0, &options);
+  sosDevice->queueCall(new ReadLedPatternsWorker(callback, sosDevice, info.This(), options));
+}
+
+NAN_METHOD(SosDevice::readAudioPatterns) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  SosCallOptions options = sosDevice->getCallOptions();
+  Nan::Callback *callback = optionsAndCallback(info, 0, &options);
+  sosDevice->queueCall(new ReadAudioPatternsWorker(callback, sosDevice, info.This(), options));
+}
+
+/*
+ * setCallOptions(options). Sets the timeout, retries, backoff and deadline
+ * for calls that do not pass their own; properties left out are unchanged.
+ */
+NAN_METHOD(SosDevice::setCallOptions) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  SosCallOptions options = sosDevice->getCallOptions();
+  readCallOptions(info[0], &options);
+  uv_mutex_lock(&sosDevice->stateLock);
+  sosDevice->callOptions = options;
+  uv_mutex_unlock(&sosDevice->stateLock);
+}
+
+// Fills a control packet from an object of control fields, leaving the
+// fields it does not name unchanged.
+static void readControlFields(v8::Local<v8::Object> values, UsbControlPacket *usbControlPacket) {
+  initControlPacket(usbControlPacket);
+
+  for(int i = 0; i < CONTROL_FIELD_COUNT; i++) {
+    v8::Local<v8::String> key = Nan::New(controlFieldKeys[i]);
+    if(Nan::Has(values, key).FromMaybe(false)) {
+      uint32_t value = Nan::To<uint32_t>(Nan::Get(values, key).ToLocalChecked()).FromMaybe(0);
+      writePacketField(usbControlPacket, controlFields[i], value / controlFields[i].scale);
+    }
+  }
+}
+
+NAN_METHOD(SosDevice::sendControlPacket) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  v8::Local<v8::Object> values = info[0].As<v8::Object>();
+  Nan::Callback *callback = new Nan::Callback(info[1].As<v8::Function>());
+
+  UsbControlPacket usbControlPacket;
+  readControlFields(values, &usbControlPacket);
+
+  sosDevice->queueControlPacket(info.This(), &usbControlPacket, callback);
+}
+
+// A packet for sendControlPackets: an object of control fields or a raw
+// control packet Buffer.
+static bool readGroupPacket(v8::Local<v8::Value> value, UsbControlPacket *usbControlPacket) {
+  if(node::Buffer::HasInstance(value)) {
+    if(node::Buffer::Length(value) < sizeof(UsbControlPacket)) {
+      return false;
+    }
+    memcpy(usbControlPacket, node::Buffer::Data(value), sizeof(UsbControlPacket));
+    return true;
+  }
+  if(!value->IsObject() || value->IsArray()) {
+    return false;
+  }
+  readControlFields(value.As<v8::Object>(), usbControlPacket);
+  return true;
+}
+
+/*
+ * sendControlPackets(devices, packets, [options], callback). Writes a
+ * control packet to every device in parallel, up to groupWriteLimit() at a
+ * time. packets is one packet for all
+ * devices or an array with one per device; options are call options applied
+ * on top of each device's own, with any deadline shared by all devices.
+ * Calls back with a result per device once every write has finished. Unlike
+ * sendControlPacket, the writes are not merged with other pending packets.
+ */
+NAN_METHOD(sendControlPackets) {
+  Nan::HandleScope scope;
+
+  if(!info[0]->IsArray()) {
+    return Nan::ThrowTypeError("devices must be an array of devices");
+  }
+  v8::Local<v8::Array> devices = info[0].As<v8::Array>();
+  uint32_t deviceCount = devices->Length();
+  std::vector<SosDevice*> sosDevices(deviceCount);
+  for(uint32_t i = 0; i < deviceCount; i++) {
+    v8::Local<v8::Value> device = Nan::Get(devices, i).ToLocalChecked();
+    if(!SosDevice::HasInstance(device)) {
+      return Nan::ThrowTypeError("devices must be an array of devices");
+    }
+    sosDevices[i] = Nan::ObjectWrap::Unwrap<SosDevice>(device.As<v8::Object>());
+  }
+
+  std::vector<UsbControlPacket> packets(deviceCount);
+  bool perDevice = info[1]->IsArray();
+  if(perDevice && info[1].As<v8::Array>()->Length() != deviceCount) {
+    return Nan::ThrowTypeError("packets must be one packet or an array of one packet per device");
+  }
+  for(uint32_t i = 0; i < deviceCount; i++) {
+    v8::Local<v8::Value> packet = perDevice ? Nan::Get(info[1].As<v8::Object>(), i).ToLocalChecked() : info[1];
+    if(!readGroupPacket(packet, &packets[i])) {
+      return Nan::ThrowTypeError("packets must be one packet or an array of one packet per device");
+    }
+  }
+
+  v8::Local<v8::Value> options = info[2]->IsFunction() ? v8::Local<v8::Value>(Nan::Undefined()) : info[2];
+  Nan::Callback *callback = new Nan::Callback((info[2]->IsFunction() ? info[2] : info[3]).As<v8::Function>());
+  if(deviceCount == 0) {
+    v8::Local<v8::Value> callbackArgs[2];
+    callbackArgs[0] = Nan::Null();
+    callbackArgs[1] = Nan::New<v8::Array>(0);
+    callback->Call(2, callbackArgs);
+    delete callback;
+    return;
+  }
+
+  ControlGroupWrite *group = new ControlGroupWrite(callback, deviceCount);
+  for(uint32_t i = 0; i < deviceCount; i++) {
+    SosCallOptions callOptions = sosDevices[i]->getCallOptions();
+    readCallOptions(options, &callOptions);
+    v8::Local<v8::Object> device = Nan::Get(devices, i).ToLocalChecked().As<v8::Object>();
+    queueGroupWrite(sosDevices[i], new ControlGroupWorker(group, i, sosDevices[i], device, &packets[i], callOptions));
+  }
+}
+
+/*
+ * parseInfo(buffer). Converts a raw UsbInfoPacket, e.g. from readInfoInto,
+ * into the object readInfo returns.
+ */
+NAN_METHOD(parseInfo) {
+  if(!node::Buffer::HasInstance(info[0]) || node::Buffer::Length(info[0]) < sizeof(UsbInfoPacket)) {
+    return Nan::ThrowTypeError("buffer must be a Buffer of at least INFO_PACKET_SIZE bytes");
+  }
+  UsbInfoPacket usbInfoPacket;
+  memcpy(&usbInfoPacket, node::Buffer::Data(info[0]), sizeof(UsbInfoPacket));
+  info.GetReturnValue().Set(infoToV8(usbInfoPacket));
+}
+
+/*
+ * readInfoInto(buffer, [options], callback). Fills buffer with the raw
+ * UsbInfoPacket.
+ */
+NAN_METHOD(SosDevice::readInfoInto) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  if(!node::Buffer::HasInstance(info[0]) || node::Buffer::Length(info[0]) < sizeof(UsbInfoPacket)) {
+    return Nan::ThrowTypeError("buffer must be a Buffer of at least INFO_PACKET_SIZE bytes");
+  }
+  SosCallOptions options = sosDevice->getCallOptions();
+  Nan::Callback *callback = optionsAndCallback(info, 1, &options);
+  sosDevice->queueCall(new ReadInfoIntoWorker(callback, sosDevice, info.This(), info[0].As<v8::Object>(), options));
+}
+
+/*
+ * sendControlBuffer(buffer, callback). buffer holds a raw UsbControlPacket;
+ * it goes through the same coalescing queue as sendControlPacket.
+ */
+NAN_METHOD(SosDevice::sendControlBuffer) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  if(!node::Buffer::HasInstance(info[0]) || node::Buffer::Length(info[0]) < sizeof(UsbControlPacket)) {
+    return Nan::ThrowTypeError("buffer must be a Buffer of at least CONTROL_PACKET_SIZE bytes");
+  }
+  Nan::Callback *callback = new Nan::Callback(info[1].As<v8::Function>());
+
+  sosDevice->queueControlPacket(info.This(), (UsbControlPacket*)node::Buffer::Data(info[0]), callback);
+}
+
+/*
+ * uploadData(address, buffer, progressCallback, callback). progressCallback
+ * may be null; otherwise it is called with (bytesSent, totalBytes).
+ */
+NAN_METHOD(SosDevice::uploadData) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  if(!node::Buffer::HasInstance(info[1])) {
+    return Nan::ThrowTypeError("data must be a Buffer");
+  }
+  uint32_t address = Nan::To<uint32_t>(info[0]).FromMaybe(0);
+  v8::Local<v8::Object> buffer = info[1].As<v8::Object>();
+  Nan::Callback *progressCallback = info[2]->IsFunction() ? new Nan::Callback(info[2].As<v8::Function>()) : NULL;
+  Nan::Callback *callback = new Nan::Callback(info[3].As<v8::Function>());
+
+  UploadData *upload = new UploadData(callback, progressCallback, sosDevice->getCallOptions(), address, (uint32_t)node::Buffer::Length(buffer));
+  sosDevice->queueCall(new UploadDataWorker(upload, sosDevice, info.This(), buffer));
+}
+
+static void setNumber(v8::Local<v8::Object> obj, const char *name, double value) {
+  Nan::Set(obj, Nan::New<v8::String>(name).ToLocalChecked(), Nan::New<v8::Number>(value));
+}
+
+// Upper bound in microseconds of the bucket holding the given fraction of samples.
+static double histogramPercentile(const LatencyHistogram &histogram, double fraction) {
+  uint64_t wanted = (uint64_t)(histogram.count * fraction);
+  uint64_t seen = 0;
+  for(int i = 0; i < SOS_LATENCY_BUCKETS; i++) {
+    seen += histogram.buckets[i];
+    if(seen > wanted) {
+      return (double)(1 << i);
+    }
+  }
+  return histogram.maxNs / 1000.0;
+}
+
+static v8::Local<v8::Object> histogramToV8(const LatencyHistogram &histogram) {
+  Nan::EscapableHandleScope scope;
+  v8::Local<v8::Object> result = Nan::New<v8::Object>();
+  v8::Local<v8::Array> buckets = Nan::New<v8::Array>(SOS_LATENCY_BUCKETS);
+  for(int i = 0; i < SOS_LATENCY_BUCKETS; i++) {
+    Nan::Set(buckets, i, Nan::New<v8::Number>((double)histogram.buckets[i]));
+  }
+  setNumber(result, "count", (double)histogram.count);
+  setNumber(result, "totalUs", histogram.totalNs / 1000.0);
+  setNumber(result, "maxUs", histogram.maxNs / 1000.0);
+  setNumber(result, "p50Us", histogramPercentile(histogram, 0.5));
+  setNumber(result, "p99Us", histogramPercentile(histogram, 0.99));
+  Nan::Set(result, Nan::New<v8::String>("buckets").ToLocalChecked(), buckets);
+  return scope.Escape(result);
+}
+
+static void setReportStats(v8::Local<v8::Object> obj, const char *name, const ReportStats &report) {
+  Nan::HandleScope scope;
+  v8::Local<v8::Object> result = Nan::New<v8::Object>();
+  setNumber(result, "count", (double)report.count);
+  setNumber(result, "bytes", (double)report.bytes);
+  setNumber(result, "errors", (double)report.errors);
+  setNumber(result, "timeouts", (double)report.timeouts);
+  setNumber(result, "retries", (double)report.retries);
+  Nan::Set(result, Nan::New<v8::String>("transferTime").ToLocalChecked(), histogramToV8(report.transferTime));
+  Nan::Set(obj, Nan::New<v8::String>(name).ToLocalChecked(), result);
+}
+
+/*
+ * getStats(). Returns a snapshot of the device's transfer counters and
+ * latency histograms; counters only ever increase.
+ */
+NAN_METHOD(SosDevice::getStats) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  SosStatsData data;
+  sosDevice->stats.snapshot(&data);
+
+  v8::Local<v8::Object> input = Nan::New<v8::Object>();
+  setReportStats(input, "info", data.input[USB_REPORTID_IN_INFO]);
+  setReportStats(input, "readAudio", data.input[USB_REPORTID_IN_READ_AUDIO]);
+  setReportStats(input, "readLed", data.input[USB_REPORTID_IN_READ_LED]);
+
+  v8::Local<v8::Object> output = Nan::New<v8::Object>();
+  setReportStats(output, "control", data.output[USB_REPORTID_OUT_CONTROL]);
+  setReportStats(output, "dataUpload", data.output[USB_REPORTID_OUT_DATA_UPLOAD]);
+  setReportStats(output, "ledControl", data.output[USB_REPORTID_OUT_LED_CONTROL]);
+
+  v8::Local<v8::Object> result = Nan::New<v8::Object>();
+  Nan::Set(result, Nan::New<v8::String>("input").ToLocalChecked(), input);
+  Nan::Set(result, Nan::New<v8::String>("output").ToLocalChecked(), output);
+  Nan::Set(result, Nan::New<v8::String>("claimTime").ToLocalChecked(), histogramToV8(data.claimTime));
+  Nan::Set(result, Nan::New<v8::String>("releaseTime").ToLocalChecked(), histogramToV8(data.releaseTime));
+  Nan::Set(result, Nan::New<v8::String>("queueWait").ToLocalChecked(), histogramToV8(data.queueWait));
+  setNumber(result, "controlPacketsQueued", (double)data.controlPacketsQueued);
+  setNumber(result, "controlPacketsCoalesced", (double)data.controlPacketsCoalesced);
+  setNumber(result, "controlPacketsWritten", (double)data.controlPacketsWritten);
+  setNumber(result, "controlPacketsSuppressed", (double)data.controlPacketsSuppressed);
+  info.GetReturnValue().Set(result);
+}
+
+// Flattens an array of LED_COUNT-element arrays into frame bytes.
+static bool readAnimationFrames(v8::Local<v8::Value> value, std::vector<uint8_t> &frames) {
+  if(node::Buffer::HasInstance(value)) {
+    const uint8_t *data = (const uint8_t*)node::Buffer::Data(value);
+    frames.assign(data, data + node::Buffer::Length(value));
+    return frames.size() % LED_COUNT == 0;
+  }
+  if(!value->IsArray()) {
+    return false;
+  }
+  v8::Local<v8::Array> array = value.As<v8::Array>();
+  for(uint32_t i = 0; i < array->Length(); i++) {
+    v8::Local<v8::Value> frame = Nan::Get(array, i).ToLocalChecked();
+    if(!frame->IsArray() || frame.As<v8::Array>()->Length() != LED_COUNT) {
+      return false;
+    }
+    for(uint32_t led = 0; led < LED_COUNT; led++) {
+      uint32_t brightness = Nan::To<uint32_t>(Nan::Get(frame.As<v8::Array>(), led).ToLocalChecked()).FromMaybe(0);
+      frames.push_back(brightness > 0xff ? 0xff : (uint8_t)brightness);
+    }
+  }
+  return true;
+}
+
+/*
+ * playAnimation(frames, [options], callback). frames is an array of
+ * [led0, ..., led4] brightness arrays or a Buffer of 5 bytes per frame;
+ * options are frameRate (frames per second, default 30) and repeat (times to
+ * play the sequence, default 1, 0 for forever). A running animation is
+ * stopped first.
+ */
+NAN_METHOD(SosDevice::playAnimation) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  std::vector<uint8_t> frames;
+  if(!readAnimationFrames(info[0], frames) || frames.empty()) {
+    return Nan::ThrowTypeError("frames must be a non-empty array of 5 LED values per frame or a Buffer of 5 bytes per frame");
+  }
+  v8::Local<v8::Value> options = info[1]->IsFunction() ? v8::Local<v8::Value>(Nan::Undefined()) : info[1];
+  uint32_t frameRate = getUint32Option(options, "frameRate", 30);
+  if(frameRate < 1 || frameRate > 1000) {
+    return Nan::ThrowRangeError("frameRate must be between 1 and 1000");
+  }
+  uint32_t repeat = getUint32Option(options, "repeat", 1);
+  Nan::Callback *callback = new Nan::Callback((info[1]->IsFunction() ? info[1] : info[2]).As<v8::Function>());
+
+  if(sosDevice->animation != NULL) {
+    sosDevice->animation->stop();
+  }
+  sosDevice->animation = new LedAnimation(sosDevice, info.This(), frames, frameRate, repeat, callback);
+  sosDevice->animation->start();
+}
+
+/*
+ * stopAnimation(). Stops the running animation, whose callback then reports
+ * stopped: true. Does nothing when no animation is running.
+ */
+NAN_METHOD(SosDevice::stopAnimation) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  if(sosDevice->animation != NULL) {
+    sosDevice->animation->stop();
+    sosDevice->animation = NULL;
+  }
+}
+
+/*
+ * startStatusPoller([options], callback). Polls the device info every
+ * options.interval ms (default 250) on a native thread and calls
+ * callback(event, data) when the playback state changes; see StatusPoller.
+ * A running poller is replaced.
+ */
+NAN_METHOD(SosDevice::startStatusPoller) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  v8::Local<v8::Value> options = info[0]->IsFunction() ? v8::Local<v8::Value>(Nan::Undefined()) : info[0];
+  uint32_t intervalMs = getUint32Option(options, "interval", 250);
+  if(intervalMs < 10) {
+    return Nan::ThrowRangeError("interval must be at least 10 ms");
+  }
+  Nan::Callback *callback = new Nan::Callback((info[0]->IsFunction() ? info[0] : info[1]).As<v8::Function>());
+
+  if(sosDevice->statusPoller != NULL) {
+    sosDevice->statusPoller->stop();
+  }
+  sosDevice->statusPoller = new StatusPoller(sosDevice, info.This(), intervalMs, callback);
+  sosDevice->statusPoller->start();
+}
+
+/*
+ * stopStatusPoller(). No events are delivered after this returns. Does
+ * nothing when no poller is running.
+ */
+NAN_METHOD(SosDevice::stopStatusPoller) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  if(sosDevice->statusPoller != NULL) {
+    sosDevice->statusPoller->stop();
+    sosDevice->statusPoller = NULL;
+  }
+}
+
+// Animations, status polling and the broker all need the transport.
+void SosDevice::stopBackgroundWork() {
+  if(animation != NULL) {
+    animation->stop();
+    animation = NULL;
+  }
+  if(statusPoller != NULL) {
+    statusPoller->stop();
+    statusPoller = NULL;
+  }
+  #ifndef WIN32
+    if(broker != NULL) {
+      closeBroker(broker);
+      broker = NULL;
+    }
+  #endif
+}
+
+SosTransport *SosDevice::releaseTransport() {
+  SosTransport *released = transport;
+  transport = NULL;
+  return released;
+}
+
+void SosDevice::attachTransport(SosTransport *reopened) {
+  transport = reopened;
+  transport->stats = &stats;
+  uv_mutex_lock(&stateLock);
+  detached = false;
+  uv_mutex_unlock(&stateLock);
+  // it may have been replugged with other firmware or playing something else
+  hasFirmwareVersion = false;
+  invalidatePatternCache();
+  forgetState();
+}
+
+/*
+ * Takes the transport from the device once calls queued before have
+ * finished, and deletes it. The callback is optional.
+ */
+class ReleaseTransportWorker : public SosDeviceWorker {
+public:
+  ReleaseTransportWorker(Nan::Callback *callback, SosDevice *sosDevice, v8::Local<v8::Object> self, const SosCallOptions &options)
+    : SosDeviceWorker(callback, sosDevice, self, options) {
+  }
+
+protected:
+  void ExecuteLocked() {
+    delete sosDevice->releaseTransport();
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+    if(callback != NULL) {
+      callbackWith(callback, Nan::Undefined(), Nan::Undefined());
+    }
+  }
+
+  void HandleErrorCallback() {
+    Nan::HandleScope scope;
+    if(callback != NULL) {
+      callbackWith(callback, error.toV8(), Nan::Undefined());
+    }
+  }
+};
+
+/*
+ * Releases and reopens the device as one queued call, so calls made
+ * meanwhile wait behind it instead of failing. The callback is optional.
+ */
+class ReconnectWorker : public ReleaseTransportWorker {
+public:
+  ReconnectWorker(Nan::Callback *callback, SosDevice *sosDevice, v8::Local<v8::Object> self, const SosCallOptions &options)
+    : ReleaseTransportWorker(callback, sosDevice, self, options) {
+  }
+
+protected:
+  void ExecuteLocked() {
+    sosDevice->reopen();
+  }
+};
+
+/*
+ * close([callback]). Stops animations, status polling and the broker and
+ * releases the device once the calls already queued have finished; later
+ * calls fail with SOS_CLOSED. Closing twice does nothing more.
+ */
+NAN_METHOD(SosDevice::close) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  sosDevice->stopBackgroundWork();
+  // a closed device is listed and opened like any other
+  removeOpenDevice(sosDevice);
+
+  Nan::Callback *callback = info[0]->IsFunction() ? new Nan::Callback(info[0].As<v8::Function>()) : NULL;
+  sosDevice->queueCall(new ReleaseTransportWorker(callback, sosDevice, info.This(), sosDevice->getCallOptions()));
+}
+
+/*
+ * reconnect([callback]). Releases the device like close and opens it again
+ * at the same location without rescanning the busses, or by serial number
+ * if it has moved. Calls made meanwhile run once it is done.
+ */
+NAN_METHOD(SosDevice::reconnect) {
+  Nan::HandleScope scope;
+  SosDevice* sosDevice = Nan::ObjectWrap::Unwrap<SosDevice>(info.This());
+
+  sosDevice->stopBackgroundWork();
+
+  Nan::Callback *callback = info[0]->IsFunction() ? new Nan::Callback(info[0].As<v8::Function>()) : NULL;
+  sosDevice->queueCall(new ReconnectWorker(callback, sosDevice, info.This(), sosDevice->getCallOptions()));
+}
+
+Nan::Persistent<v8::FunctionTemplate> SosDevice::s_ct;
+
+/*static*/ bool SosDevice::HasInstance(v8::Local<v8::Value> value) {
+  return value->IsObject() && Nan::New(s_ct)->HasInstance(value);
+}
+
+/*static*/ void SosDevice::Init(v8::Handle<v8::Object> target) {
+  Nan::HandleScope scope;
+
+  uv_mutex_init(&usbLock);
+  uv_mutex_init(&listLock);
+  #ifndef WIN32
+    initUsbEvents();
+  #endif
+  initHotplug();
+  initMockTransport();
+  initPropertyKeys();
+
+  v8::Local<v8::FunctionTemplate> t = Nan::New<v8::FunctionTemplate>();
+  t->InstanceTemplate()->SetInternalFieldCount(1);
+  t->SetClassName(Nan::New("SosDevice").ToLocalChecked());
+  s_ct.Reset(t);
+
+  Nan::SetPrototypeMethod(t, "readInfo", SosDevice::readInfo);
+  Nan::SetPrototypeMethod(t, "readAllInfo", SosDevice::readAllInfo);
+  Nan::SetPrototypeMethod(t, "sendControlPacket", SosDevice::sendControlPacket);
+  Nan::SetPrototypeMethod(t, "readLedPatterns", SosDevice::readLedPatterns);
+  Nan::SetPrototypeMethod(t, "readAudioPatterns", SosDevice::readAudioPatterns);
+  Nan::SetPrototypeMethod(t, "uploadData", SosDevice::uploadData);
+  Nan::SetPrototypeMethod(t, "readInfoInto", SosDevice::readInfoInto);
+  Nan::SetPrototypeMethod(t, "sendControlBuffer", SosDevice::sendControlBuffer);
+  Nan::SetPrototypeMethod(t, "getStats", SosDevice::getStats);
+  Nan::SetPrototypeMethod(t, "playAnimation", SosDevice::playAnimation);
+  Nan::SetPrototypeMethod(t, "stopAnimation", SosDevice::stopAnimation);
+  Nan::SetPrototypeMethod(t, "setCallOptions", SosDevice::setCallOptions);
+  Nan::SetPrototypeMethod(t, "resyncState", SosDevice::resyncState);
+  Nan::SetPrototypeMethod(t, "startStatusPoller", SosDevice::startStatusPoller);
+  Nan::SetPrototypeMethod(t, "stopStatusPoller", SosDevice::stopStatusPoller);
+  Nan::SetPrototypeMethod(t, "close", SosDevice::close);
+  Nan::SetPrototypeMethod(t, "reconnect", SosDevice::reconnect);
+  #ifndef WIN32
+    Nan::SetPrototypeMethod(t, "startBroker", SosDevice::startBroker);
+    Nan::SetPrototypeMethod(t, "stopBroker", SosDevice::stopBroker);
+  #endif
+
+  v8::Local<v8::Function> ctor = Nan::New(s_ct)->GetFunction();
+  Nan::Set(ctor, Nan::New("CONTROL_PACKET_SIZE").ToLocalChecked(), Nan::New<v8::Integer>((int)sizeof(UsbControlPacket)));
+  Nan::Set(ctor, Nan::New("INFO_PACKET_SIZE").ToLocalChecked(), Nan::New<v8::Integer>((int)sizeof(UsbInfoPacket)));
+  Nan::Set(target, Nan::New("SosDevice").ToLocalChecked(), ctor);
+}
+
+/*static*/ v8::Local<v8::Object> SosDevice::NewInstance(SosDevice *sosDevice) {
+  Nan::EscapableHandleScope scope;
+
+  v8::Local<v8::Function> ctor = Nan::New(s_ct)->GetFunction();
+  v8::Local<v8::Object> obj = ctor->NewInstance();
+  sosDevice->Wrap(obj);
+
+  return scope.Escape(obj);
+}
+
+#ifdef WIN32
+  bool SosDevice::isAt(const SosDeviceDescriptor &descriptor) const {
+    return transportType == descriptor.transport && path == descriptor.path;
+  }
+
+  static HANDLE openSosHandle(const char *path) {
+    return CreateFile(
+      path,
+      GENERIC_READ | GENERIC_WRITE,
       FILE_SHARE_READ | FILE_SHARE_WRITE,
       NULL,
       OPEN_EXISTING,
       FILE_FLAG_OVERLAPPED,
       NULL);
+  }
+
+  static void readSerial(HANDLE devHandle, std::string &serial) {
+    wchar_t wideSerial[128];
+    char utf8Serial[512];
+
+    if(HidD_GetSerialNumberString == NULL || !HidD_GetSerialNumberString(devHandle, wideSerial, sizeof(wideSerial))) {
+      return;
+    }
+    wideSerial[127] = L'\0';
+    if(WideCharToMultiByte(CP_UTF8, 0, wideSerial, -1, utf8Serial, sizeof(utf8Serial), NULL, NULL) > 0) {
+      serial = utf8Serial;
+    }
+  }
+
+  // SetupDi has no cheap change notification, so a rescan always rebuilds.
+  static bool rescanBusses() {
+    return true;
+  }
+
+  static void scanSosDevices(std::vector<SosDeviceDescriptor> &descriptors) {
+    GUID hidGuid;
+    char sosVendorIdStr[10];
+    char sosProductIdStr[10];
+
+    sprintf(sosVendorIdStr, "%x", sosVendorId);
+    sprintf(sosProductIdStr, "%x", sosProductId);
+
+    HidD_GetHidGuid(&hidGuid);
+
+    HANDLE deviceInfoSet = sosSetupDiGetClassDevs(&hidGuid, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+    if(deviceInfoSet == INVALID_HANDLE_VALUE) {
+      return;
+    }
+
+    SP_DEVICE_INTERFACE_DATA deviceInterfaceData;
+    SP_DEVICE_INTERFACE_DETAIL_DATA *deviceInterfaceDetailData = (SP_DEVICE_INTERFACE_DETAIL_DATA*)malloc(sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA) + 1000);
+    for(int i=0; ; i++) {
+      deviceInterfaceData.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
+      if(!sosSetupDiEnumDeviceInterfaces(deviceInfoSet, NULL, &hidGuid, i, &deviceInterfaceData)) {
+        break;
+      }
+      DWORD requiredSize;
+
+      deviceInterfaceDetailData->cbSize = 8;
+
+      SP_DEVINFO_DATA deviceInfoData;
+      deviceInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
+
+      sosSetupDiGetDeviceInterfaceDetail(
+        deviceInfoSet,
+        &deviceInterfaceData,
+        deviceInterfaceDetailData,
+        1000,
+        &requiredSize,
+        &deviceInfoData);
+
+      if(strstr(deviceInterfaceDetailData->DevicePath, sosVendorIdStr)
+        && strstr(deviceInterfaceDetailData->DevicePath, sosProductIdStr)) {
+        SosDeviceDescriptor descriptor;
+        descriptor.path = deviceInterfaceDetailData->DevicePath;
+        descriptor.hasInfo = false;
+
+        if(!getOpenDeviceSerial(descriptor)) {
+          HANDLE devHandle = openSosHandle(descriptor.path.c_str());
+          if(devHandle != INVALID_HANDLE_VALUE) {
+            readSerial(devHandle, descriptor.serial);
+            CloseHandle(devHandle);
+          }
+        }
+        descriptors.push_back(descriptor);
+      }
+    }
 
-deviceNotFound:
     free(deviceInterfaceDetailData);
     sosSetupDiDestroyDeviceInfoList(deviceInfoSet);
+  }
+
+  static void readInfoUnopened(SosDeviceDescriptor &descriptor) {
+    char report[64];
+
+    HANDLE devHandle = openSosHandle(descriptor.path.c_str());
+    if(devHandle == INVALID_HANDLE_VALUE) {
+      return;
+    }
+    report[0] = USB_REPORTID_IN_INFO;
+    if(HidD_GetInputReport(devHandle, report, sosPacketSize)) {
+      memcpy(&descriptor.info, report, sizeof(UsbInfoPacket));
+      descriptor.hasInfo = true;
+    }
+    CloseHandle(devHandle);
+  }
+
+  static SosTransport *openUsbTransport(const SosDeviceDescriptor &descriptor) {
+    HANDLE devHandle = openSosHandle(descriptor.path.c_str());
+    if(devHandle == INVALID_HANDLE_VALUE) {
+      DWORD error = GetLastError();
+      throw NodeSosException(win32ErrorCode(error), SOS_PHASE_OPEN, -1, (int)error, false, "Could not open Siren of Shame: 0x%08X", error);
+    }
+    return new HidTransport(devHandle);
+  }
+#else
+  bool SosDevice::isAt(const SosDeviceDescriptor &descriptor) const {
+    return transportType == descriptor.transport && bus == descriptor.bus && address == descriptor.address;
+  }
+
+  static void readSerial(libusb_device_handle *devHandle, const struct libusb_device_descriptor &deviceDescriptor, std::string &serial) {
+    unsigned char buffer[256];
+
+    if(deviceDescriptor.iSerialNumber == 0) {
+      return;
+    }
+    if(libusb_get_string_descriptor_ascii(devHandle, deviceDescriptor.iSerialNumber, buffer, sizeof(buffer)) > 0) {
+      serial = (char*)buffer;
+    }
+  }
+
+  // Zero padded like the names libusb-0.1 and the kernel's uevents use.
+  static void deviceLocation(libusb_device *dev, std::string &bus, std::string &address) {
+    char number[8];
+
+    sprintf(number, "%03d", libusb_get_bus_number(dev));
+    bus = number;
+    sprintf(number, "%03d", libusb_get_device_address(dev));
+    address = number;
+  }
+
+  static bool isSosDevice(libusb_device *dev, struct libusb_device_descriptor *deviceDescriptor) {
+    return libusb_get_device_descriptor(dev, deviceDescriptor) == 0
+      && deviceDescriptor->idVendor == sosVendorId
+      && deviceDescriptor->idProduct == sosProductId;
+  }
+
+  // Returns true when devices were added or removed since the last call.
+  // libusb-1.0 keeps its own device list, so this compares locations.
+  static bool rescanBusses() {
+    static std::vector<std::string> lastLocations;
+    std::vector<std::string> locations;
+    libusb_device **list;
+
+    ssize_t count = libusb_get_device_list(usbContext(), &list);
+    for(ssize_t i = 0; i < count; i++) {
+      std::string bus, address;
+      deviceLocation(list[i], bus, address);
+      locations.push_back(bus + "/" + address);
+    }
+    if(count >= 0) {
+      libusb_free_device_list(list, 1);
+    }
+
+    bool changed = locations != lastLocations;
+    lastLocations.swap(locations);
+    return changed;
+  }
+
+  static libusb_device_handle *openSosHandle(libusb_device *dev) {
+    libusb_device_handle *devHandle;
+
+    int openResult = libusb_open(dev, &devHandle);
+    if(openResult != 0) {
+      throw NodeSosException(libusbErrorCode(openResult), SOS_PHASE_OPEN, -1, openResult, false,
+        "Could not open Siren of Shame: %s", libusb_error_name(openResult));
+    }
+
+    // not supported everywhere; claiming fails below if a driver is in the way
+    libusb_set_auto_detach_kernel_driver(devHandle, 1);
+
+    int claimResult = libusb_claim_interface(devHandle, INTERFACE_NUMBER);
+    if(claimResult != 0) {
+      libusb_close(devHandle);
+      throw NodeSosException(libusbErrorCode(claimResult), SOS_PHASE_CLAIM, -1, claimResult, false,
+        "libusb_claim_interface: %s", libusb_error_name(claimResult));
+    }
 
     return devHandle;
   }
 
-  NAN_METHOD(findDevice) {
-    char errorBuffer[1000];
-    Nan::HandleScope scope;
-    v8::Local<v8::Value> callbackArgs[2];
+  // Opens the device at the descriptor's location; throws if it is gone.
+  static libusb_device_handle *openSosHandle(const SosDeviceDescriptor &descriptor) {
+    libusb_device **list;
+    libusb_device *match = NULL;
+
+    ssize_t count = libusb_get_device_list(usbContext(), &list);
+    for(ssize_t i = 0; i < count && match == NULL; i++) {
+      std::string bus, address;
+      deviceLocation(list[i], bus, address);
+      if(bus == descriptor.bus && address == descriptor.address) {
+        match = list[i];
+      }
+    }
+    if(match == NULL) {
+      if(count >= 0) {
+        libusb_free_device_list(list, 1);
+      }
+      throw NodeSosException(SOS_ERROR_NO_DEVICE, "Could not open Siren of Shame");
+    }
 
-    initFunctionPointers();
+    libusb_device_handle *devHandle;
+    try {
+      devHandle = openSosHandle(match);
+    } catch(NodeSosException &ex) {
+      libusb_free_device_list(list, 1);
+      throw;
+    }
+    libusb_free_device_list(list, 1);
+    return devHandle;
+  }
+
+  static void scanSosDevices(std::vector<SosDeviceDescriptor> &descriptors) {
+    libusb_device **list;
+    struct libusb_device_descriptor deviceDescriptor;
 
-    Nan::Callback *callback = new Nan::Callback(info[0].As<v8::Function>());
+    ssize_t count = libusb_get_device_list(usbContext(), &list);
+    for(ssize_t i = 0; i < count; i++) {
+      if(!isSosDevice(list[i], &deviceDescriptor)) {
+        continue;
+      }
+      SosDeviceDescriptor descriptor;
+      deviceLocation(list[i], descriptor.bus, descriptor.address);
+      descriptor.hasInfo = false;
+
+      if(!getOpenDeviceSerial(descriptor)) {
+        libusb_device_handle *devHandle;
+        if(libusb_open(list[i], &devHandle) == 0) {
+          readSerial(devHandle, deviceDescriptor, descriptor.serial);
+          libusb_close(devHandle);
+        }
+      }
+      descriptors.push_back(descriptor);
+    }
+    if(count >= 0) {
+      libusb_free_device_list(list, 1);
+    }
+  }
 
-    HANDLE devHandle = findSos();
-    if(devHandle == NULL || devHandle == INVALID_HANDLE_VALUE) {
-      callbackArgs[0] = Nan::New<v8::String>("No Siren of Shame devices found").ToLocalChecked();
-      callbackArgs[1] = Nan::Undefined();
-      callback->Call(2, callbackArgs);
+  static void readInfoUnopened(SosDeviceDescriptor &descriptor) {
+    libusb_device_handle *devHandle;
+    try {
+      devHandle = openSosHandle(descriptor);
+    } catch(NodeSosException &ex) {
       return;
     }
+    int bytesRead = hidControlTransfer(devHandle, CONTROL_REQUEST_TYPE_IN, HID_REPORT_GET, USB_REPORTID_IN_INFO, (char*)&descriptor.info, sizeof(UsbInfoPacket));
+    descriptor.hasInfo = bytesRead >= 0;
+    libusb_release_interface(devHandle, INTERFACE_NUMBER);
+    libusb_close(devHandle);
+  }
 
-    v8::Local<v8::Object> sosDevice = SosDevice::New(devHandle);
-    callbackArgs[0] = Nan::Undefined();
-    callbackArgs[1] = sosDevice;
-    callback->Call(2, callbackArgs);
-    return;
+  static SosTransport *openUsbTransport(const SosDeviceDescriptor &descriptor) {
+    return new LibusbTransport(openSosHandle(descriptor));
   }
-#else
-  static struct usb_device *findSos() {
-    struct usb_bus *bus;
-    struct usb_device *dev;
-    struct usb_bus *busses;
+#endif
+
+SosDevice::SosDevice(const SosDeviceDescriptor &descriptor, SosTransport *transport) {
+  uv_mutex_init(&transferLock);
+  uv_cond_init(&transferFree);
+  this->transferBusy = false;
+  uv_mutex_init(&stateLock);
+  this->callRunning = false;
+  this->callDeadline = 0;
+  this->transport = transport;
+  this->transportType = descriptor.transport;
+  this->detached = false;
+  this->hasLastInfo = false;
+  this->hasFirmwareVersion = false;
+  this->controlPacketInFlight = false;
+  initControlPacket(&this->pendingControlPacket);
+  initControlPacket(&this->shadowState);
+  this->animation = NULL;
+  this->statusPoller = NULL;
+  #ifndef WIN32
+    this->broker = NULL;
+  #endif
+  this->ledPatternsCached = false;
+  this->audioPatternsCached = false;
+  #ifdef WIN32
+    this->path = descriptor.path;
+  #else
+    this->bus = descriptor.bus;
+    this->address = descriptor.address;
+  #endif
+  this->serial = descriptor.serial;
+  transport->stats = &stats;
+  addOpenDevice(this);
+}
+
+SosDevice::~SosDevice() {
+  removeOpenDevice(this);
+  delete transport;
+  uv_mutex_destroy(&stateLock);
+  uv_cond_destroy(&transferFree);
+  uv_mutex_destroy(&transferLock);
+}
+
+/*static*/ SosTransport *SosDevice::OpenTransport(const SosDeviceDescriptor &descriptor) {
+  SosTransport *transport;
+  if(descriptor.transport == TRANSPORT_MOCK) {
+    transport = openMockTransport(descriptor);
+  #ifdef __linux__
+  } else if(descriptor.transport == TRANSPORT_HIDRAW) {
+    transport = openHidrawTransport(descriptor);
+  #endif
+  #ifndef WIN32
+  } else if(descriptor.transport == TRANSPORT_BROKER) {
+    transport = openBrokerTransport(descriptor);
+  #endif
+  } else {
+    #ifdef WIN32
+      initFunctionPointers();
+    #endif
+    transport = openUsbTransport(descriptor);
+  }
+  return transport;
+}
+
+// Caller holds listLock.
+/*static*/ SosDevice *SosDevice::findOpenDevice(const SosDeviceDescriptor &descriptor) {
+  for(size_t i = 0; i < openDevices.size(); i++) {
+    if(openDevices[i]->isAt(descriptor)) {
+      return openDevices[i];
+    }
+  }
+  return NULL;
+}
+
+// Changed with both usbLock and listLock held, so either is enough to read.
+static std::vector<SosDeviceDescriptor> cachedDescriptors;
+static bool cacheValid = false;
+
+static bool isCacheValid() {
+  uv_mutex_lock(&listLock);
+  bool valid = cacheValid;
+  uv_mutex_unlock(&listLock);
+  return valid;
+}
+
+/*
+ * Rebuilds the cached device list. The cache counts as valid from before the
+ * scan, so a hotplug event during the scan invalidates it again. Caller holds
+ * usbLock.
+ */
+static void scanCachedDevices() {
+  std::vector<SosDeviceDescriptor> scanned;
+
+  uv_mutex_lock(&listLock);
+  cacheValid = true;
+  uv_mutex_unlock(&listLock);
+  try {
+    scanSosDevices(scanned);
+  } catch(NodeSosException &ex) {
+    uv_mutex_lock(&listLock);
+    cacheValid = false;
+    uv_mutex_unlock(&listLock);
+    throw;
+  }
+  uv_mutex_lock(&listLock);
+  cachedDescriptors.swap(scanned);
+  uv_mutex_unlock(&listLock);
+}
+
+/*
+ * Serves the attached device list from the last scan. The busses are only
+ * rescanned when asked to or when nothing was found last time, and the list
+ * is only rebuilt when the rescan reports a change. Caller holds usbLock.
+ */
+static void listSosDevices(std::vector<SosDeviceDescriptor> &descriptors, bool refresh) {
+  bool valid = isCacheValid();
+  if(refresh || !valid || cachedDescriptors.empty()) {
+    if(rescanBusses() || !valid) {
+      scanCachedDevices();
+    }
+  }
+  descriptors = cachedDescriptors;
+}
 
-    usb_init();
-    usb_find_busses();
-    usb_find_devices();
+/*
+ * Lists the devices reachable through a transport. Only the USB list is
+ * cached; mock devices live in this process and hidraw nodes are listed from
+ * sysfs without opening anything.
+ */
+static void listTransportDevices(std::vector<SosDeviceDescriptor> &descriptors, SosTransportType transport, bool refresh) {
+  switch(transport) {
+    case TRANSPORT_MOCK:
+      listMockDevices(descriptors);
+      break;
+    #ifdef __linux__
+      case TRANSPORT_HIDRAW:
+        listHidrawDevices(descriptors);
+        break;
+    #endif
+    case TRANSPORT_BROKER:
+      // brokers are not discovered, connect names the socket
+      descriptors.clear();
+      break;
+    default:
+      listSosDevices(descriptors, refresh);
+      break;
+  }
+}
 
-    busses = usb_get_busses();
+static void findSosDescriptors(std::vector<SosDeviceDescriptor> &descriptors, SosTransportType transport, bool refresh) {
+  listTransportDevices(descriptors, transport, refresh);
+  for(size_t i = 0; i < descriptors.size(); i++) {
+    if(descriptors[i].hasInfo) {
+      continue;
+    }
 
-    for (bus = busses; bus; bus = bus->next){
-      for (dev = bus->devices; dev; dev = dev->next) {
-        if ((dev->descriptor.idVendor == sosVendorId) && (dev->descriptor.idProduct == sosProductId)) {
-          return dev;
+    if(!getOpenDeviceInfo(descriptors[i])) {
+      #ifdef __linux__
+        if(transport == TRANSPORT_HIDRAW) {
+          readHidrawInfo(descriptors[i]);
+        } else {
+          readInfoUnopened(descriptors[i]);
         }
+      #else
+        readInfoUnopened(descriptors[i]);
+      #endif
+    }
+
+    // version and hardware type do not change while the device is attached
+    if(descriptors[i].hasInfo && transport == TRANSPORT_USB && i < cachedDescriptors.size()) {
+      uv_mutex_lock(&listLock);
+      cachedDescriptors[i].info = descriptors[i].info;
+      cachedDescriptors[i].hasInfo = true;
+      uv_mutex_unlock(&listLock);
+    }
+  }
+}
+
+bool isSameLocation(const SosDeviceDescriptor &a, const SosDeviceDescriptor &b) {
+  if(a.transport != b.transport) {
+    return false;
+  }
+  #ifdef WIN32
+    return a.path == b.path;
+  #else
+    return a.bus == b.bus && a.address == b.address;
+  #endif
+}
+
+bool rescanSosDevices(std::vector<SosDeviceDescriptor> &descriptors) {
+  bool changed = false;
+  uv_mutex_lock(&usbLock);
+  try {
+    changed = rescanBusses();
+    if(changed || !isCacheValid()) {
+      scanCachedDevices();
+    }
+  } catch(NodeSosException &ex) {
+    // USB is unavailable; report the last known list
+  }
+  descriptors = cachedDescriptors;
+  uv_mutex_unlock(&usbLock);
+  return changed;
+}
+
+// The hotplug hooks run on the loop thread, so they only take listLock and
+// never wait for a scan or a transfer.
+void sosDeviceAttached(const SosDeviceDescriptor &descriptor) {
+  uv_mutex_lock(&listLock);
+  cacheValid = false;
+  uv_mutex_unlock(&listLock);
+}
+
+void sosDeviceDetached(SosDeviceDescriptor &descriptor) {
+  uv_mutex_lock(&listLock);
+  for(size_t i = 0; i < cachedDescriptors.size(); i++) {
+    if(isSameLocation(cachedDescriptors[i], descriptor)) {
+      descriptor.serial = cachedDescriptors[i].serial;
+    }
+  }
+  cacheValid = false;
+
+  SosDevice *sosDevice = SosDevice::findOpenDevice(descriptor);
+  if(sosDevice != NULL) {
+    descriptor.serial = sosDevice->getSerial();
+    sosDevice->markDetached();
+  }
+  uv_mutex_unlock(&listLock);
+}
+
+/*
+ * Selects devices by location and/or serial number; empty fields match any
+ * device.
+ */
+struct SosDeviceQuery {
+  SosTransportType transport;
+  #ifdef WIN32
+    std::string path;
+  #else
+    std::string bus;
+    std::string address;
+  #endif
+  std::string serial;
+
+  SosDeviceQuery() : transport(TRANSPORT_USB) {
+  }
+
+  bool isEmpty() const {
+    #ifdef WIN32
+      return path.empty() && serial.empty();
+    #else
+      return bus.empty() && address.empty() && serial.empty();
+    #endif
+  }
+
+  bool matches(const SosDeviceDescriptor &descriptor) const {
+    #ifdef WIN32
+      if(!path.empty()) {
+        return descriptor.path == path;
+      }
+    #else
+      if(!bus.empty() && !address.empty()) {
+        return descriptor.bus == bus && descriptor.address == address;
+      }
+    #endif
+    return serial.empty() || descriptor.serial == serial;
+  }
+};
+
+/*
+ * Opens the first device matching the query and tells where it was found. A
+ * cached entry that is missing or can no longer be opened triggers one retry
+ * against a fresh bus scan. Caller holds usbLock.
+ */
+static SosTransport *openMatchingTransport(const SosDeviceQuery &query, bool refresh, SosDeviceDescriptor *opened) {
+  #ifndef WIN32
+    if(query.transport == TRANSPORT_BROKER) {
+      opened->transport = TRANSPORT_BROKER;
+      opened->bus = query.bus;
+      opened->address = query.address;
+      opened->serial = query.serial;
+      return SosDevice::OpenTransport(*opened);
+    }
+  #endif
+  for(int attempt = 0; ; attempt++) {
+    bool lastAttempt = refresh || attempt > 0;
+    std::vector<SosDeviceDescriptor> descriptors;
+    listTransportDevices(descriptors, query.transport, lastAttempt);
+
+    SosDeviceDescriptor *match = NULL;
+    for(size_t i = 0; i < descriptors.size() && match == NULL; i++) {
+      if(query.matches(descriptors[i])) {
+        match = &descriptors[i];
+      }
+    }
+
+    if(match == NULL) {
+      if(!lastAttempt) {
+        continue;
+      }
+      throw NodeSosException(SOS_ERROR_NOT_FOUND, query.isEmpty() ? "No Siren of Shame devices found" : "No matching Siren of Shame device found");
+    }
+
+    try {
+      SosTransport *transport = SosDevice::OpenTransport(*match);
+      *opened = *match;
+      return transport;
+    } catch(NodeSosException &ex) {
+      if(lastAttempt) {
+        throw;
       }
     }
-    return NULL;
+  }
+}
+
+/*
+ * Opens a device again for reconnect: at its last location first, which
+ * needs no bus scan, then by serial number in case it came back at another
+ * one. Updates the descriptor to where it was opened. Caller holds usbLock.
+ */
+static SosTransport *reopenTransport(SosDeviceDescriptor &descriptor) {
+  try {
+    return SosDevice::OpenTransport(descriptor);
+  } catch(NodeSosException &ex) {
+    if(descriptor.serial.empty() || descriptor.transport == TRANSPORT_BROKER) {
+      throw;
+    }
+  }
+
+  SosDeviceQuery query;
+  query.transport = descriptor.transport;
+  query.serial = descriptor.serial;
+  return openMatchingTransport(query, false, &descriptor);
+}
+
+/*
+ * Runs on a worker thread with the transfer lock held. The device is taken
+ * off the open list while its location may change, and the old transport is
+ * deleted first since a device can only be opened once. If it cannot be
+ * opened again it is left closed.
+ */
+void SosDevice::reopen() {
+  SosDeviceDescriptor descriptor;
+  descriptor.transport = transportType;
+  NodeSosException error;
+  bool failed = false;
+
+  uv_mutex_lock(&usbLock);
+  removeOpenDevice(this);
+  delete releaseTransport();
+  #ifdef WIN32
+    descriptor.path = path;
+  #else
+    descriptor.bus = bus;
+    descriptor.address = address;
+  #endif
+  descriptor.serial = serial;
+  try {
+    SosTransport *reopened = reopenTransport(descriptor);
+    #ifdef WIN32
+      path = descriptor.path;
+    #else
+      bus = descriptor.bus;
+      address = descriptor.address;
+    #endif
+    serial = descriptor.serial;
+    attachTransport(reopened);
+    addOpenDevice(this);
+  } catch(NodeSosException &ex) {
+    error = ex;
+    failed = true;
+  }
+  uv_mutex_unlock(&usbLock);
+
+  if(failed) {
+    throw error;
+  }
+}
+
+v8::Local<v8::Object> descriptorToV8(const SosDeviceDescriptor &descriptor) {
+  Nan::EscapableHandleScope scope;
+  v8::Local<v8::Object> result = Nan::New<v8::Object>();
+  #ifdef WIN32
+    Nan::Set(result, Nan::New<v8::String>("path").ToLocalChecked(), Nan::New<v8::String>(descriptor.path).ToLocalChecked());
+  #else
+    Nan::Set(result, Nan::New<v8::String>("bus").ToLocalChecked(), Nan::New<v8::String>(descriptor.bus).ToLocalChecked());
+    Nan::Set(result, Nan::New<v8::String>("address").ToLocalChecked(), Nan::New<v8::String>(descriptor.address).ToLocalChecked());
+  #endif
+  Nan::Set(result, Nan::New<v8::String>("serial").ToLocalChecked(), Nan::New<v8::String>(descriptor.serial).ToLocalChecked());
+  Nan::Set(result, Nan::New<v8::String>("transport").ToLocalChecked(), Nan::New<v8::String>(transportName(descriptor.transport)).ToLocalChecked());
+  if(descriptor.hasInfo) {
+    Nan::Set(result, Nan::New<v8::String>("version").ToLocalChecked(), Nan::New<v8::Integer>(descriptor.info.version));
+    Nan::Set(result, Nan::New<v8::String>("hardwareType").ToLocalChecked(), Nan::New<v8::Integer>(descriptor.info.hardwareType));
+    Nan::Set(result, Nan::New<v8::String>("hardwareVersion").ToLocalChecked(), Nan::New<v8::Integer>(descriptor.info.hardwareVersion));
+  }
+  return scope.Escape(result);
+}
+
+static std::string getStringProperty(v8::Local<v8::Object> obj, const char *name) {
+  v8::Local<v8::String> key = Nan::New<v8::String>(name).ToLocalChecked();
+  if(!Nan::Has(obj, key).FromMaybe(false)) {
+    return std::string();
+  }
+  Nan::Utf8String value(Nan::Get(obj, key).ToLocalChecked());
+  return *value ? std::string(*value) : std::string();
+}
+
+static bool getBoolProperty(v8::Local<v8::Object> obj, const char *name) {
+  v8::Local<v8::String> key = Nan::New<v8::String>(name).ToLocalChecked();
+  if(!Nan::Has(obj, key).FromMaybe(false)) {
+    return false;
+  }
+  return Nan::To<bool>(Nan::Get(obj, key).ToLocalChecked()).FromMaybe(false);
+}
+
+// Reads the transport option; a missing option selects real hardware.
+static bool getTransportProperty(v8::Local<v8::Object> obj, SosTransportType *transport) {
+  return parseTransportName(getStringProperty(obj, "transport"), transport);
+}
+
+/*
+ * Lists every attached Siren of Shame. Devices already opened by this process
+ * report the info they last read, so listing never waits for their calls;
+ * all others are opened briefly.
+ */
+class FindDevicesWorker : public Nan::AsyncWorker {
+  SosTransportType transport;
+  bool refresh;
+  std::vector<SosDeviceDescriptor> descriptors;
+  NodeSosException error;
+
+public:
+  FindDevicesWorker(Nan::Callback *callback, SosTransportType transport, bool refresh) : Nan::AsyncWorker(callback), transport(transport), refresh(refresh) {
+  }
+
+  void Execute() {
+    uv_mutex_lock(&usbLock);
+    try {
+      findSosDescriptors(descriptors, transport, refresh);
+    } catch(NodeSosException &ex) {
+      error = ex;
+      SetErrorMessage(ex.message());
+    }
+    uv_mutex_unlock(&usbLock);
   }
 
-  NAN_METHOD(findDevice) {
-    char errorBuffer[1000];
+protected:
+  void HandleOKCallback() {
     Nan::HandleScope scope;
     v8::Local<v8::Value> callbackArgs[2];
+    v8::Local<v8::Array> result = Nan::New<v8::Array>((int)descriptors.size());
+    for(size_t i = 0; i < descriptors.size(); i++) {
+      Nan::Set(result, (uint32_t)i, descriptorToV8(descriptors[i]));
+    }
+    callbackArgs[0] = Nan::Undefined();
+    callbackArgs[1] = result;
+    callback->Call(2, callbackArgs);
+  }
 
-    Nan::Callback *callback = new Nan::Callback(info[0].As<v8::Function>());
+  void HandleErrorCallback() {
+    Nan::HandleScope scope;
+    v8::Local<v8::Value> callbackArgs[2];
+    callbackArgs[0] = error.toV8();
+    callbackArgs[1] = Nan::Undefined();
+    callback->Call(2, callbackArgs);
+  }
+};
 
-    struct usb_device *dev = findSos();
-    if(dev == NULL) {
-      callbackArgs[0] = Nan::Error("No Siren of Shame devices found");
-      callbackArgs[1] = Nan::Undefined();
-      callback->Call(2, callbackArgs);
-      return;
-    }
+/*
+ * findDevices([options], callback). Pass { refresh: true } to force a bus
+ * rescan instead of using the cached device list, or { transport: 'mock' } to
+ * list emulated devices.
+ */
+NAN_METHOD(findDevices) {
+  Nan::HandleScope scope;
+  bool refresh = false;
+  SosTransportType transport = TRANSPORT_USB;
 
-    usb_dev_handle *devHandle = usb_open(dev);
-    if(devHandle == NULL) {
-      callbackArgs[0] = Nan::Error("Could not open Siren of Shame");
-      callbackArgs[1] = Nan::Undefined();
-      callback->Call(2, callbackArgs);
-      return;
+  #ifdef WIN32
+    initFunctionPointers();
+  #endif
+
+  int callbackIndex = 0;
+  if(info.Length() > 1 && info[0]->IsObject()) {
+    refresh = getBoolProperty(info[0].As<v8::Object>(), "refresh");
+    if(!getTransportProperty(info[0].As<v8::Object>(), &transport)) {
+      return Nan::ThrowTypeError("Unknown transport");
     }
+    callbackIndex = 1;
+  }
+  Nan::Callback *callback = new Nan::Callback(info[callbackIndex].As<v8::Function>());
+  Nan::AsyncQueueWorker(new FindDevicesWorker(callback, transport, refresh));
+}
 
-    int detachResult = usb_detach_kernel_driver_np(devHandle, INTERFACE_NUMBER);
-    if(detachResult != 0 && detachResult != -61) {
-      sprintf(errorBuffer, "usb_detach_kernel_driver_np: %d %s\n", detachResult, usb_strerror());
-      callbackArgs[0] = Nan::Error(errorBuffer);
-      callbackArgs[1] = Nan::Undefined();
-      callback->Call(2, callbackArgs);
-      return;
+/*
+ * Finds and opens a device on the thread pool, so a bus scan or a slow open
+ * never blocks the event loop. The device is registered as open before
+ * usbLock is released and only wrapped for JS once back on the main thread.
+ */
+class OpenDeviceWorker : public Nan::AsyncWorker {
+  SosDeviceQuery query;
+  bool refresh;
+  SosDevice *sosDevice;
+  NodeSosException error;
+
+public:
+  OpenDeviceWorker(Nan::Callback *callback, const SosDeviceQuery &query, bool refresh) : Nan::AsyncWorker(callback), query(query), refresh(refresh), sosDevice(NULL) {
+  }
+
+  void Execute() {
+    uv_mutex_lock(&usbLock);
+    try {
+      SosDeviceDescriptor descriptor;
+      SosTransport *transport = openMatchingTransport(query, refresh, &descriptor);
+      sosDevice = new SosDevice(descriptor, transport);
+    } catch(NodeSosException &ex) {
+      error = ex;
+      SetErrorMessage(ex.message());
     }
+    uv_mutex_unlock(&usbLock);
+  }
 
-    v8::Local<v8::Object> sosDevice = SosDevice::New(dev, devHandle);
+protected:
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+    v8::Local<v8::Value> callbackArgs[2];
     callbackArgs[0] = Nan::Undefined();
-    callbackArgs[1] = sosDevice;
+    callbackArgs[1] = SosDevice::NewInstance(sosDevice);
     callback->Call(2, callbackArgs);
-    return;
   }
-#endif
+
+  void HandleErrorCallback() {
+    Nan::HandleScope scope;
+    v8::Local<v8::Value> callbackArgs[2];
+    callbackArgs[0] = error.toV8();
+    callbackArgs[1] = Nan::Undefined();
+    callback->Call(2, callbackArgs);
+  }
+};
+
+/*
+ * findDevice([options], callback). Opens the first Siren of Shame found.
+ */
+NAN_METHOD(findDevice) {
+  Nan::HandleScope scope;
+  bool refresh = false;
+  SosDeviceQuery query;
+
+  #ifdef WIN32
+    initFunctionPointers();
+  #endif
+
+  int callbackIndex = 0;
+  if(info.Length() > 1 && info[0]->IsObject()) {
+    refresh = getBoolProperty(info[0].As<v8::Object>(), "refresh");
+    if(!getTransportProperty(info[0].As<v8::Object>(), &query.transport)) {
+      return Nan::ThrowTypeError("Unknown transport");
+    }
+    callbackIndex = 1;
+  }
+  Nan::Callback *callback = new Nan::Callback(info[callbackIndex].As<v8::Function>());
+  Nan::AsyncQueueWorker(new OpenDeviceWorker(callback, query, refresh));
+}
+
+/*
+ * Opens the device matching a descriptor returned by findDevices. The
+ * physical location (bus/address, or path on Windows) is preferred; the serial
+ * number is used when no location is given.
+ */
+NAN_METHOD(openDevice) {
+  Nan::HandleScope scope;
+
+  #ifdef WIN32
+    initFunctionPointers();
+  #endif
+
+  v8::Local<v8::Object> wanted = info[0].As<v8::Object>();
+
+  SosDeviceQuery query;
+  if(!getTransportProperty(wanted, &query.transport)) {
+    return Nan::ThrowTypeError("Unknown transport");
+  }
+  query.serial = getStringProperty(wanted, "serial");
+  #ifdef WIN32
+    query.path = getStringProperty(wanted, "path");
+  #else
+    query.bus = getStringProperty(wanted, "bus");
+    query.address = getStringProperty(wanted, "address");
+    if(query.transport == TRANSPORT_BROKER) {
+      // { transport: 'broker', path } or a descriptor of an open broker device
+      query.bus = "broker";
+      if(query.address.empty()) {
+        query.address = getStringProperty(wanted, "path");
+      }
+      if(query.address.empty()) {
+        return Nan::ThrowTypeError("The broker transport needs the socket path");
+      }
+    }
+  #endif
+  Nan::Callback *callback = new Nan::Callback(info[1].As<v8::Function>());
+  Nan::AsyncQueueWorker(new OpenDeviceWorker(callback, query, getBoolProperty(wanted, "refresh")));
+}
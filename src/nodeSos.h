@@ -1,4 +1,7 @@
 
+#ifndef _node_sos_h_
+#define _node_sos_h_
+
 #include <nan.h>
 #include <node.h>
 #include <v8.h>
@@ -6,41 +9,300 @@
 #ifdef WIN32
   #include <Setupapi.h>
 #else
-  #include <usb.h>
+  #include <libusb.h>
 #endif
 #include <stdio.h>
 #include <node.h>
 #include <string.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include "usbPackets.h"
+#include "sosTransport.h"
+#include "ledAnimation.h"
+#include "statusPoller.h"
 
 NAN_METHOD(findDevice);
+NAN_METHOD(findDevices);
+NAN_METHOD(openDevice);
+NAN_METHOD(startHotplug);
+NAN_METHOD(stopHotplug);
+NAN_METHOD(parseInfo);
+NAN_METHOD(addMockDevice);
+NAN_METHOD(removeMockDevice);
+NAN_METHOD(inspectMockDevice);
+NAN_METHOD(sendControlPackets);
+
+extern int sosVendorId;
+extern int sosProductId;
+
+/*
+ * Identifies one attached Siren of Shame. Filled in on a worker thread by
+ * findDevices or the hotplug monitor and converted to a JS object on the
+ * main thread.
+ */
+struct SosDeviceDescriptor {
+  SosTransportType transport;
+  #ifdef WIN32
+    std::string path;
+  #else
+    std::string bus;
+    std::string address;
+  #endif
+  std::string serial;
+  bool hasInfo;
+  UsbInfoPacket info;
+
+  SosDeviceDescriptor() {
+    transport = TRANSPORT_USB;
+    hasInfo = false;
+    memset(&info, 0, sizeof(info));
+  }
+};
+
+bool isSameLocation(const SosDeviceDescriptor &a, const SosDeviceDescriptor &b);
+// Sets every field of the packet to its "don't change" value.
+void initControlPacket(UsbControlPacket *packet);
+v8::Local<v8::Object> descriptorToV8(const SosDeviceDescriptor &descriptor);
+v8::Local<v8::Object> infoToV8(const UsbInfoPacket &usbInfoPacket);
+// An unsigned integer property of an options object, or defaultValue.
+uint32_t getUint32Option(v8::Local<v8::Value> options, const char *name, uint32_t defaultValue);
+
+// Hotplug support, see hotplug.cpp. The hooks below invalidate the cached
+// device list; a detach also fails all further I/O on the matching open
+// device. rescanSosDevices returns true when libusb reported a change.
+void initHotplug();
+bool rescanSosDevices(std::vector<SosDeviceDescriptor> &descriptors);
+void sosDeviceAttached(const SosDeviceDescriptor &descriptor);
+void sosDeviceDetached(SosDeviceDescriptor &descriptor);
+
+#ifndef WIN32
+  // libusb-1.0 events are handled on a thread of their own, see usbEvents.cpp.
+  struct UsbTransferWait {
+    uv_mutex_t lock;
+    uv_cond_t cond;
+    bool done;
+
+    UsbTransferWait();
+    ~UsbTransferWait();
+  };
+
+  void initUsbEvents();
+  // Throws NodeSosException if libusb could not be initialized.
+  libusb_context *usbContext();
+  // Submits a transfer and blocks the calling thread until the event thread
+  // has completed it. Returns a libusb error code if the submission failed.
+  int submitTransferAndWait(struct libusb_transfer *transfer, UsbTransferWait *wait);
+#endif
+
+#ifndef WIN32
+  // Errors from system calls, mapped to the closest SosErrorCode.
+  SosErrorCode errnoErrorCode(int error);
+
+  // Sharing a device between processes, see broker.cpp. Broker devices are
+  // at bus "broker" with the socket path as the address.
+  class SosBroker;
+  SosTransport *openBrokerTransport(const SosDeviceDescriptor &descriptor);
+  void closeBroker(SosBroker *broker);
+#endif
+
+#ifdef __linux__
+  // Devices behind the kernel HID driver, see hidrawTransport.cpp.
+  void listHidrawDevices(std::vector<SosDeviceDescriptor> &descriptors);
+  void readHidrawInfo(SosDeviceDescriptor &descriptor);
+  SosTransport *openHidrawTransport(const SosDeviceDescriptor &descriptor);
+#endif
+
+// Emulated devices, see mockTransport.cpp. openMockTransport throws
+// NodeSosException when the device has been removed.
+void initMockTransport();
+void listMockDevices(std::vector<SosDeviceDescriptor> &descriptors);
+SosTransport *openMockTransport(const SosDeviceDescriptor &descriptor);
+
+// Timeouts and retries for device I/O, see SosDevice::transfer.
+struct SosCallOptions {
+  uint32_t timeoutMs;  // per transfer attempt, 0 for no limit
+  uint32_t retries;    // further attempts after a retryable failure
+  uint32_t backoffMs;  // delay before the first retry, doubled for each one after
+  uint32_t deadlineMs; // for the whole call including retries, 0 for none
+
+  SosCallOptions();
+};
+
+void sleepMs(uint32_t ms);
+
+/*
+ * Work that needs a device to itself, see SosDevice::queueCall. start() is
+ * called on the main thread once the calls queued before have finished; the
+ * call then tells the device with callFinished(), again on the main thread.
+ */
+class SosDeviceCall {
+public:
+  virtual ~SosDeviceCall() {}
+  virtual void start() = 0;
+};
 
 class SosDevice : public Nan::ObjectWrap {
+  // NULL once closed; changed with the transfer lock held.
+  SosTransport *transport;
+  SosTransportType transportType;
   #ifdef WIN32
-    HANDLE devHandle;
+    std::string path;
   #else
-    struct usb_device *dev;
-    struct usb_dev_handle *devHandle;
+    std::string bus;
+    std::string address;
   #endif
+  std::string serial;
+
+  // Pattern tables read from the device, kept until the firmware version
+  // reported by readInfo changes or the device is detached.
+  bool hasFirmwareVersion;
+  uint16_t firmwareVersion;
+  bool ledPatternsCached;
+  bool audioPatternsCached;
+  std::vector<UsbReadLedPacket> ledPatternCache;
+  std::vector<UsbReadAudioPacket> audioPatternCache;
+
+  // Calls waiting for the running one to finish. Main thread only.
+  std::deque<SosDeviceCall*> queuedCalls;
+  bool callRunning;
+
+  // sendControlPacket queue, see queueControlPacket.
+  bool controlPacketInFlight;
+  UsbControlPacket pendingControlPacket;
+  std::vector<Nan::Callback*> pendingControlCallbacks;
+
+  // What the device is known to be doing, with "don't change" values for
+  // unknown fields; see writeControlPacket. Guarded by the transfer lock.
+  UsbControlPacket shadowState;
+
+  // The running playAnimation, if any. Main thread only.
+  LedAnimation *animation;
+  // Started by startStatusPoller. Main thread only.
+  StatusPoller *statusPoller;
+
+  // Guarded by stateLock rather than the transfer lock, so they can be set
+  // and read without waiting for a call: whether the device was unplugged
+  // (set by hotplug events on the loop thread), the options for calls that
+  // do not pass their own (set on the main thread) and the info last read
+  // (for findDevices).
+  bool detached;
+  SosCallOptions callOptions;
+  bool hasLastInfo;
+  UsbInfoPacket lastInfo;
+  uv_mutex_t stateLock;
+
+  // The call holding the transfer lock.
+  SosCallOptions activeCall;
+  uint64_t callDeadline; // uv_hrtime, 0 for none
+
+  SosDeviceStats stats;
   static Nan::Persistent<v8::FunctionTemplate> s_ct;
   static NAN_METHOD(readInfo);
+  static NAN_METHOD(readAllInfo);
   static NAN_METHOD(readLedPatterns);
   static NAN_METHOD(readAudioPatterns);
   static NAN_METHOD(sendControlPacket);
+  static NAN_METHOD(uploadData);
+  static NAN_METHOD(readInfoInto);
+  static NAN_METHOD(sendControlBuffer);
+  static NAN_METHOD(getStats);
+  static NAN_METHOD(playAnimation);
+  static NAN_METHOD(stopAnimation);
+  static NAN_METHOD(setCallOptions);
+  static NAN_METHOD(resyncState);
+  static NAN_METHOD(startStatusPoller);
+  static NAN_METHOD(stopStatusPoller);
+  static NAN_METHOD(close);
+  static NAN_METHOD(reconnect);
+
+  // The transfer lock is a flag guarded by a mutex rather than a mutex, so
+  // the broker can take it on one thread and give it back on another.
+  uv_mutex_t transferLock;
+  uv_cond_t transferFree;
+  bool transferBusy;
+
+  #ifndef WIN32
+    // Serving this device to other processes, see startBroker.
+    SosBroker *broker;
+    static NAN_METHOD(startBroker);
+    static NAN_METHOD(stopBroker);
+  #endif
 
 public:
   static void Init(v8::Handle<v8::Object> target);
+  static bool HasInstance(v8::Local<v8::Value> value);
 
-  #ifdef WIN32
-    static v8::Local<v8::Object> New(HANDLE devHandle);
-    SosDevice(HANDLE devHandle);
-  #else
-    static v8::Local<v8::Object> New(struct usb_device *dev, struct usb_dev_handle *devHandle);
-    SosDevice(struct usb_device *dev, struct usb_dev_handle *devHandle);
-  #endif
+  // Throws NodeSosException on failure; the caller must hold the USB
+  // enumeration lock.
+  static SosTransport *OpenTransport(const SosDeviceDescriptor &descriptor);
+  // Returns the already open device at the descriptor's location, if any;
+  // the caller must hold the open device list lock.
+  static SosDevice *findOpenDevice(const SosDeviceDescriptor &descriptor);
+
+  // Wraps a device opened on a worker thread in a new JS object.
+  static v8::Local<v8::Object> NewInstance(SosDevice *sosDevice);
+  // Takes ownership of the transport. Safe on any thread.
+  SosDevice(const SosDeviceDescriptor &descriptor, SosTransport *transport);
+  ~SosDevice();
+
+  bool isAt(const SosDeviceDescriptor &descriptor) const;
+  const std::string &getSerial() const { return serial; }
+  // Fails all further I/O until reconnected, without waiting for the device.
+  void markDetached();
+  bool getLastInfo(UsbInfoPacket *usbInfoPacket);
+  SosDeviceStats &getStatsRecorder() { return stats; }
+  SosCallOptions getCallOptions();
+
+  // Runs calls one at a time in the order they were queued, so calls for a
+  // busy device wait here instead of on the thread pool. Main thread only.
+  void queueCall(SosDeviceCall *call);
+  void callFinished();
+
+  void queueControlPacket(v8::Local<v8::Object> self, const UsbControlPacket *usbControlPacket, Nan::Callback *callback);
+  void controlPacketFinished(v8::Local<v8::Object> self);
+  void animationFinished(LedAnimation *finished);
+  void statusPollerFinished(StatusPoller *finished);
+
+  // close() and reconnect(), see there. Called from worker threads with the
+  // transfer lock held; reopen takes usbLock after it.
+  SosTransport *releaseTransport();
+  void reopen();
+  void attachTransport(SosTransport *reopened);
+
+  // Called from worker threads; callers must hold the transfer lock so that
+  // multi-report operations (e.g. pattern enumeration) are not interleaved.
+  // Transfers until unlock use the given options, with any deadline counted
+  // from startedAt; lock() without options uses the device's. unlock() never
+  // blocks and may be called from any thread.
+  void lock();
+  void lock(const SosCallOptions &options, uint64_t startedAt);
+  // Starts another call with the transfer lock still held.
+  void beginCall(const SosCallOptions &options, uint64_t startedAt);
+  void unlock();
+  void readInfoPacket(UsbInfoPacket *usbInfoPacket);
+  void readLedPatternPackets(std::vector<UsbReadLedPacket> &ledPatterns);
+  void readAudioPatternPackets(std::vector<UsbReadAudioPacket> &audioPatterns);
+  // Clears the fields the device already has from the packet before writing.
+  void writeControlPacket(UsbControlPacket *usbControlPacket);
+  void forgetState();
+  void writeDataPacket(uint32_t address, const char *data, size_t length);
+  // A single report with the active call's timeouts and retries.
+  void transfer(bool output, int reportId, char* buf, int bufSize);
 
 private:
+  void startNextCall();
+  void flushControlPackets(v8::Local<v8::Object> self);
+  void stopBackgroundWork();
+  void checkAttached();
+  void invalidatePatternCache();
   void getInputReport(int reportId, char* buf, int bufSize);
   void setOutputReport(int reportId, char* buf, int bufSize);
+  unsigned int attemptTimeout();
+  bool backoff(uint32_t attempt);
+  void acquireTransferLock();
+  void releaseTransferLock();
 };
 
 #ifdef WIN32
@@ -56,6 +318,12 @@ private:
     _In_  ULONG ReportBufferLength
   );
 
+  typedef BOOLEAN (__stdcall *HidD_GetSerialNumberStringFn)(
+    _In_   HANDLE HidDeviceObject,
+    _Out_  PVOID Buffer,
+    _In_   ULONG BufferLength
+  );
+
   typedef void (__stdcall *HidD_GetHidGuidFn)(
     _Out_  LPGUID HidGuid
   );
@@ -88,3 +356,5 @@ private:
     _Out_opt_  PSP_DEVINFO_DATA DeviceInfoData
   );
 #endif
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef _sos_stats_h_
+#define _sos_stats_h_
+
+#include <uv.h>
+#include <stdint.h>
+#include <string.h>
+
+// Bucket 0 counts samples under 1 us, bucket i samples under 2^i us; the last
+// bucket also takes everything slower.
+#define SOS_LATENCY_BUCKETS 24
+
+// Report ids are small, so per-report counters are indexed by id directly.
+#define SOS_REPORT_ID_SLOTS 8
+
+struct LatencyHistogram {
+  uint64_t count;
+  uint64_t totalNs;
+  uint64_t maxNs;
+  uint64_t buckets[SOS_LATENCY_BUCKETS];
+
+  void record(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+    while(us > 0 && bucket < SOS_LATENCY_BUCKETS - 1) {
+      us >>= 1;
+      bucket++;
+    }
+    count++;
+    totalNs += ns;
+    if(ns > maxNs) {
+      maxNs = ns;
+    }
+    buckets[bucket]++;
+  }
+};
+
+struct ReportStats {
+  uint64_t count;
+  uint64_t bytes;
+  uint64_t errors;
+  uint64_t timeouts;
+  uint64_t retries;
+  LatencyHistogram transferTime;
+};
+
+struct SosStatsData {
+  ReportStats input[SOS_REPORT_ID_SLOTS];
+  ReportStats output[SOS_REPORT_ID_SLOTS];
+  LatencyHistogram claimTime;
+  LatencyHistogram releaseTime;
+  // from queueing a device call until it holds the transfer lock
+  LatencyHistogram queueWait;
+  uint64_t controlPacketsQueued;
+  uint64_t controlPacketsCoalesced;
+  uint64_t controlPacketsWritten;
+  uint64_t controlPacketsSuppressed;
+};
+
+/*
+ * Always-on counters for one device. Transfers are recorded from worker
+ * threads and snapshots are taken from the main thread, so both go through
+ * a lock that is held only for the copy or update and never across I/O.
+ */
+class SosDeviceStats {
+  uv_mutex_t statsLock;
+  SosStatsData data;
+
+  static ReportStats &slot(ReportStats *reports, int reportId) {
+    return reports[(unsigned)reportId % SOS_REPORT_ID_SLOTS];
+  }
+
+public:
+  SosDeviceStats() {
+    uv_mutex_init(&statsLock);
+    memset(&data, 0, sizeof(data));
+  }
+
+  ~SosDeviceStats() {
+    uv_mutex_destroy(&statsLock);
+  }
+
+  void recordTransfer(bool output, int reportId, int bytes, uint64_t ns, bool failed) {
+    uv_mutex_lock(&statsLock);
+    ReportStats &report = slot(output ? data.output : data.input, reportId);
+    report.count++;
+    if(failed) {
+      report.errors++;
+    } else {
+      report.bytes += bytes;
+    }
+    report.transferTime.record(ns);
+    uv_mutex_unlock(&statsLock);
+  }
+
+  void recordTimeout(bool output, int reportId) {
+    uv_mutex_lock(&statsLock);
+    slot(output ? data.output : data.input, reportId).timeouts++;
+    uv_mutex_unlock(&statsLock);
+  }
+
+  void recordRetry(bool output, int reportId) {
+    uv_mutex_lock(&statsLock);
+    slot(output ? data.output : data.input, reportId).retries++;
+    uv_mutex_unlock(&statsLock);
+  }
+
+  void recordClaim(uint64_t ns) {
+    uv_mutex_lock(&statsLock);
+    data.claimTime.record(ns);
+    uv_mutex_unlock(&statsLock);
+  }
+
+  void recordRelease(uint64_t ns) {
+    uv_mutex_lock(&statsLock);
+    data.releaseTime.record(ns);
+    uv_mutex_unlock(&statsLock);
+  }
+
+  void recordQueueWait(uint64_t ns) {
+    uv_mutex_lock(&statsLock);
+    data.queueWait.record(ns);
+    uv_mutex_unlock(&statsLock);
+  }
+
+  void recordControlPacket(bool coalesced) {
+    uv_mutex_lock(&statsLock);
+    data.controlPacketsQueued++;
+    if(coalesced) {
+      data.controlPacketsCoalesced++;
+    }
+    uv_mutex_unlock(&statsLock);
+  }
+
+  void recordControlPacketWritten() {
+    uv_mutex_lock(&statsLock);
+    data.controlPacketsWritten++;
+    uv_mutex_unlock(&statsLock);
+  }
+
+  void recordControlPacketSuppressed() {
+    uv_mutex_lock(&statsLock);
+    data.controlPacketsSuppressed++;
+    uv_mutex_unlock(&statsLock);
+  }
+
+  void snapshot(SosStatsData *result) {
+    uv_mutex_lock(&statsLock);
+    memcpy(result, &data, sizeof(data));
+    uv_mutex_unlock(&statsLock);
+  }
+};
+
+#endif
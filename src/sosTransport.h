@@ -0,0 +1,150 @@
+#ifndef _sos_transport_h_
+#define _sos_transport_h_
+
+#include <nan.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "sosStats.h"
+
+enum SosTransportType {
+  TRANSPORT_USB,
+  TRANSPORT_MOCK,
+  TRANSPORT_HIDRAW,
+  TRANSPORT_BROKER
+};
+
+const char *transportName(SosTransportType transport);
+bool parseTransportName(const std::string &name, SosTransportType *transport);
+
+// Stable error codes, exposed to JS as err.code (see errorCodeName).
+enum SosErrorCode {
+  SOS_ERROR_IO,
+  SOS_ERROR_TIMEOUT,
+  SOS_ERROR_NO_DEVICE,    // the device is gone or could not be opened
+  SOS_ERROR_DETACHED,     // the opened device was unplugged or removed
+  SOS_ERROR_NOT_FOUND,    // no device matched the query
+  SOS_ERROR_ACCESS,
+  SOS_ERROR_BUSY,
+  SOS_ERROR_DEADLINE,
+  SOS_ERROR_OUT_OF_RANGE,
+  SOS_ERROR_PROTOCOL,     // the device sent or was sent something malformed
+  SOS_ERROR_INIT,
+  SOS_ERROR_CLOSED        // the device was closed
+};
+
+// What the failing call was doing, exposed as err.phase.
+enum SosErrorPhase {
+  SOS_PHASE_NONE,
+  SOS_PHASE_OPEN,
+  SOS_PHASE_CLAIM,
+  SOS_PHASE_TRANSFER
+};
+
+const char *errorCodeName(SosErrorCode code);
+const char *errorPhaseName(SosErrorPhase phase);
+
+/*
+ * Carries a stable code, the native error number behind it (a libusb error,
+ * errno or Win32 error code, 0 if none), the report and phase it occurred in
+ * and whether retrying may help. Messages are formatted straight into the
+ * exception, so no intermediate buffer or string is needed.
+ */
+class NodeSosException {
+  SosErrorCode errorCode;
+  SosErrorPhase errorPhase;
+  int nativeErrorNumber;
+  int errorReportId; // -1 if not tied to a report
+  bool retryable;
+  char errorMessage[256];
+
+public:
+  NodeSosException() : errorCode(SOS_ERROR_IO), errorPhase(SOS_PHASE_NONE), nativeErrorNumber(0), errorReportId(-1), retryable(false) {
+    errorMessage[0] = '\0';
+  }
+
+  NodeSosException(SosErrorCode code, const char *message)
+    : errorCode(code), errorPhase(SOS_PHASE_NONE), nativeErrorNumber(0), errorReportId(-1), retryable(false) {
+    strncpy(errorMessage, message, sizeof(errorMessage) - 1);
+    errorMessage[sizeof(errorMessage) - 1] = '\0';
+  }
+
+  NodeSosException(SosErrorCode code, SosErrorPhase phase, int reportId, int nativeError, bool retryable, const char *format, ...)
+    : errorCode(code), errorPhase(phase), nativeErrorNumber(nativeError), errorReportId(reportId), retryable(retryable) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(errorMessage, sizeof(errorMessage), format, args);
+    va_end(args);
+  }
+
+  SosErrorCode code() const {
+    return errorCode;
+  }
+
+  SosErrorPhase phase() const {
+    return errorPhase;
+  }
+
+  int nativeError() const {
+    return nativeErrorNumber;
+  }
+
+  int reportId() const {
+    return errorReportId;
+  }
+
+  const char* message() const {
+    return errorMessage;
+  }
+
+  // True for transient failures, such as a timeout, where repeating the same
+  // transfer may succeed.
+  bool isRetryable() const {
+    return retryable;
+  }
+
+  // Fills in the phase and report if the thrower did not know them.
+  void addContext(SosErrorPhase phase, int reportId) {
+    if(errorPhase == SOS_PHASE_NONE) {
+      errorPhase = phase;
+    }
+    if(errorReportId < 0) {
+      errorReportId = reportId;
+    }
+  }
+
+  // An Error with code, errno, phase, reportId and retryable properties.
+  v8::Local<v8::Value> toV8() const;
+};
+
+/*
+ * Moves HID reports to and from one opened device. SosDevice owns its
+ * transport and only calls it from worker threads with its transfer lock
+ * held, so implementations must not touch V8. Failures are thrown as
+ * NodeSosException.
+ *
+ * Buffers hold the packets as laid out in usbPackets.h; output packets
+ * already start with their report id.
+ *
+ * timeoutMs bounds a single attempt, 0 for no limit; transports whose driver
+ * cannot bound a transfer ignore it. SosDevice retries failures thrown as
+ * retryable with backoff, so implementations throw rather than loop on them.
+ *
+ * SosDevice records every transfer in stats; implementations add what only
+ * they can see, such as interface claims and timeouts.
+ */
+class SosTransport {
+public:
+  SosDeviceStats *stats;
+
+  SosTransport() : stats(NULL) {}
+  virtual ~SosTransport() {}
+  virtual void getInputReport(int reportId, char *buf, int bufSize, unsigned int timeoutMs) = 0;
+  virtual void setOutputReport(int reportId, char *buf, int bufSize, unsigned int timeoutMs) = 0;
+  // Called when SosDevice releases its transfer lock, i.e. after the last
+  // report of an operation. Must not throw.
+  virtual void endOperation() {}
+};
+
+#endif
@@ -0,0 +1,215 @@
+#include "nodeSos.h"
+#include "statusPoller.h"
+
+#define PLAY_DURATION_TIMED 1
+
+// Reduces a remaining play time to none, timed or forever.
+static uint16_t playDurationClass(uint16_t duration) {
+  if(duration == 0 || duration == PLAY_DURATION_FOREVER) {
+    return duration;
+  }
+  return PLAY_DURATION_TIMED;
+}
+
+// The packet as compared between polls; see StatusPoller.
+static void statusSignature(const UsbInfoPacket &info, UsbInfoPacket *signature) {
+  memcpy(signature, &info, sizeof(UsbInfoPacket));
+  signature->audioPlayDuration = playDurationClass(info.audioPlayDuration);
+  signature->ledPlayDuration = playDurationClass(info.ledPlayDuration);
+}
+
+StatusPoller::StatusPoller(SosDevice *sosDevice, v8::Local<v8::Object> self, uint32_t intervalMs, Nan::Callback *callback)
+  : sosDevice(sosDevice), callback(callback) {
+  // keep the device object alive while polling it
+  this->self.Reset(self);
+  intervalNs = intervalMs * 1000000ULL;
+  stopped = false;
+  eventAsync = NULL;
+  stopRequested = false;
+  finished = false;
+  uv_mutex_init(&lock);
+  uv_cond_init(&stopCond);
+}
+
+StatusPoller::~StatusPoller() {
+  uv_cond_destroy(&stopCond);
+  uv_mutex_destroy(&lock);
+  self.Reset();
+  delete callback;
+}
+
+void StatusPoller::start() {
+  eventAsync = new uv_async_t;
+  eventAsync->data = this;
+  uv_async_init(uv_default_loop(), eventAsync, onEvents);
+  uv_thread_create(&thread, threadMain, this);
+}
+
+void StatusPoller::stop() {
+  stopped = true;
+  uv_mutex_lock(&lock);
+  stopRequested = true;
+  uv_cond_signal(&stopCond);
+  uv_mutex_unlock(&lock);
+}
+
+void StatusPoller::threadMain(void *arg) {
+  StatusPoller *poller = (StatusPoller*)arg;
+  poller->run();
+
+  uv_mutex_lock(&poller->lock);
+  poller->finished = true;
+  uv_mutex_unlock(&poller->lock);
+  uv_async_send(poller->eventAsync);
+}
+
+// Sleeps until the deadline; returns false if the poller was stopped.
+bool StatusPoller::waitUntil(uint64_t deadline) {
+  uv_mutex_lock(&lock);
+  while(!stopRequested) {
+    uint64_t now = uv_hrtime();
+    if(now >= deadline) {
+      break;
+    }
+    uv_cond_timedwait(&stopCond, &lock, deadline - now);
+  }
+  bool stopping = stopRequested;
+  uv_mutex_unlock(&lock);
+  return !stopping;
+}
+
+void StatusPoller::run() {
+  UsbInfoPacket previous;
+  bool hasPrevious = false;
+  bool failing = false;
+  uint64_t next = uv_hrtime();
+
+  while(waitUntil(next)) {
+    // a slow read delays the next poll instead of causing a burst
+    next += intervalNs;
+    uint64_t now = uv_hrtime();
+    if(next < now) {
+      next = now + intervalNs;
+    }
+
+    UsbInfoPacket current;
+    sosDevice->lock();
+    try {
+      sosDevice->readInfoPacket(&current);
+    } catch(NodeSosException &ex) {
+      sosDevice->unlock();
+      if(!failing) {
+        StatusEvent event;
+        event.type = STATUS_ERROR;
+        event.error = ex;
+        queueEvent(event);
+      }
+      failing = true;
+      if(ex.code() == SOS_ERROR_DETACHED) {
+        break;
+      }
+      continue;
+    }
+    sosDevice->unlock();
+    failing = false;
+
+    if(hasPrevious) {
+      compare(previous, current);
+    } else {
+      // listeners learn the starting state
+      StatusEvent event;
+      event.type = STATUS_CHANGE;
+      event.info = current;
+      queueEvent(event);
+    }
+    previous = current;
+    hasPrevious = true;
+  }
+}
+
+void StatusPoller::compare(const UsbInfoPacket &previous, const UsbInfoPacket &current) {
+  UsbInfoPacket before, after;
+  statusSignature(previous, &before);
+  statusSignature(current, &after);
+  if(memcmp(&before, &after, sizeof(UsbInfoPacket)) == 0) {
+    return;
+  }
+
+  StatusEvent event;
+  event.type = STATUS_CHANGE;
+  event.info = current;
+  queueEvent(event);
+
+  event.type = STATUS_PLAYBACK_ENDED;
+  if(previous.audioMode != AUDIO_MODE_OFF && current.audioMode == AUDIO_MODE_OFF) {
+    event.audio = true;
+    event.mode = previous.audioMode;
+    queueEvent(event);
+  }
+  if(previous.ledMode != LED_MODE_OFF && current.ledMode == LED_MODE_OFF) {
+    event.audio = false;
+    event.mode = previous.ledMode;
+    queueEvent(event);
+  }
+}
+
+void StatusPoller::queueEvent(const StatusEvent &event) {
+  uv_mutex_lock(&lock);
+  pendingEvents.push_back(event);
+  uv_mutex_unlock(&lock);
+  uv_async_send(eventAsync);
+}
+
+#if NODE_MODULE_VERSION >= NODE_0_12_MODULE_VERSION
+void StatusPoller::onEvents(uv_async_t *handle) {
+#else
+void StatusPoller::onEvents(uv_async_t *handle, int status) {
+#endif
+  StatusPoller *poller = (StatusPoller*)handle->data;
+  poller->deliver();
+}
+
+void StatusPoller::onAsyncClosed(uv_handle_t *handle) {
+  delete (uv_async_t*)handle;
+}
+
+void StatusPoller::deliver() {
+  Nan::HandleScope scope;
+  std::vector<StatusEvent> events;
+
+  uv_mutex_lock(&lock);
+  events.swap(pendingEvents);
+  bool done = finished;
+  uv_mutex_unlock(&lock);
+
+  // the callback may stop the poller, so check before every event
+  for(size_t i = 0; i < events.size() && !stopped; i++) {
+    v8::Local<v8::Value> callbackArgs[2];
+    switch(events[i].type) {
+      case STATUS_CHANGE:
+        callbackArgs[0] = Nan::New<v8::String>("change").ToLocalChecked();
+        callbackArgs[1] = infoToV8(events[i].info);
+        break;
+      case STATUS_PLAYBACK_ENDED: {
+        v8::Local<v8::Object> ended = Nan::New<v8::Object>();
+        Nan::Set(ended, Nan::New<v8::String>("channel").ToLocalChecked(), Nan::New<v8::String>(events[i].audio ? "audio" : "led").ToLocalChecked());
+        Nan::Set(ended, Nan::New<v8::String>("mode").ToLocalChecked(), Nan::New<v8::Integer>(events[i].mode));
+        callbackArgs[0] = Nan::New<v8::String>("playbackEnded").ToLocalChecked();
+        callbackArgs[1] = ended;
+        break;
+      }
+      default:
+        callbackArgs[0] = Nan::New<v8::String>("error").ToLocalChecked();
+        callbackArgs[1] = events[i].error.toV8();
+        break;
+    }
+    callback->Call(2, callbackArgs);
+  }
+
+  if(done) {
+    uv_thread_join(&thread);
+    uv_close((uv_handle_t*)eventAsync, onAsyncClosed);
+    sosDevice->statusPollerFinished(this);
+    delete this;
+  }
+}
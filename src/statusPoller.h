@@ -0,0 +1,77 @@
+#ifndef _status_poller_h_
+#define _status_poller_h_
+
+#include <nan.h>
+#include <vector>
+#include "usbPackets.h"
+#include "sosTransport.h"
+
+class SosDevice;
+
+enum StatusEventType {
+  STATUS_CHANGE,
+  STATUS_PLAYBACK_ENDED,
+  STATUS_ERROR
+};
+
+struct StatusEvent {
+  StatusEventType type;
+  UsbInfoPacket info;     // STATUS_CHANGE
+  bool audio;             // STATUS_PLAYBACK_ENDED: the audio or the LED channel
+  uint8_t mode;           // STATUS_PLAYBACK_ENDED: the pattern that was playing
+  NodeSosException error; // STATUS_ERROR
+};
+
+/*
+ * Reads the device info on a dedicated thread at a fixed interval and only
+ * wakes the loop when the playback state changed, so an idle siren costs no
+ * JS work at all. Remaining play times count down while a pattern plays and
+ * are compared only as none, timed or forever.
+ *
+ * Created and stopped on the main thread. The callback gets (event, data)
+ * for 'change' (the info), 'playbackEnded' ({ channel, mode }) and 'error'
+ * (the first failure of a run of them); polling stops for good once the
+ * device is detached.
+ */
+class StatusPoller {
+public:
+  StatusPoller(SosDevice *sosDevice, v8::Local<v8::Object> self, uint32_t intervalMs, Nan::Callback *callback);
+
+  void start();
+  // The callback is not called again; the poller deletes itself once its
+  // thread has finished.
+  void stop();
+
+private:
+  SosDevice *sosDevice;
+  Nan::Persistent<v8::Object> self;
+  Nan::Callback *callback;
+  uint64_t intervalNs;
+  bool stopped; // main thread only
+
+  uv_thread_t thread;
+  uv_async_t *eventAsync;
+  uv_mutex_t lock;
+  uv_cond_t stopCond;
+  bool stopRequested;
+  bool finished;
+  std::vector<StatusEvent> pendingEvents;
+
+  ~StatusPoller();
+
+  static void threadMain(void *arg);
+  void run();
+  bool waitUntil(uint64_t deadline);
+  void compare(const UsbInfoPacket &previous, const UsbInfoPacket &current);
+  void queueEvent(const StatusEvent &event);
+  void deliver();
+
+  #if NODE_MODULE_VERSION >= NODE_0_12_MODULE_VERSION
+    static void onEvents(uv_async_t *handle);
+  #else
+    static void onEvents(uv_async_t *handle, int status);
+  #endif
+  static void onAsyncClosed(uv_handle_t *handle);
+};
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef WIN32
+
+#include "nodeSos.h"
+
+/*
+ * Runs libusb-1.0 event handling on a dedicated thread, so transfers complete
+ * no matter what the Node event loop is doing: a busy or paused loop delays
+ * neither the thread pool, the animation thread nor the status poller, and
+ * libusb's own transfer timeouts always fire.
+ *
+ * The thread is started once with the context and runs for the life of the
+ * process. libusb_handle_events returns at least every few seconds even when
+ * nothing happens, and wakes up by itself when devices are opened or closed.
+ */
+
+static libusb_context *context = NULL;
+static uv_thread_t eventThread;
+
+static void runEvents(void *arg) {
+  for(;;) {
+    libusb_handle_events_completed(context, NULL);
+  }
+}
+
+void initUsbEvents() {
+  if(libusb_init(&context) != 0) {
+    context = NULL;
+    return;
+  }
+  if(uv_thread_create(&eventThread, runEvents, NULL) != 0) {
+    libusb_exit(context);
+    context = NULL;
+  }
+}
+
+libusb_context *usbContext() {
+  if(context == NULL) {
+    throw NodeSosException(SOS_ERROR_INIT, "libusb_init failed");
+  }
+  return context;
+}
+
+static void LIBUSB_CALL onTransferComplete(struct libusb_transfer *transfer) {
+  UsbTransferWait *wait = (UsbTransferWait*)transfer->user_data;
+  uv_mutex_lock(&wait->lock);
+  wait->done = true;
+  uv_cond_signal(&wait->cond);
+  uv_mutex_unlock(&wait->lock);
+}
+
+UsbTransferWait::UsbTransferWait() : done(false) {
+  uv_mutex_init(&lock);
+  uv_cond_init(&cond);
+}
+
+UsbTransferWait::~UsbTransferWait() {
+  uv_cond_destroy(&cond);
+  uv_mutex_destroy(&lock);
+}
+
+int submitTransferAndWait(struct libusb_transfer *transfer, UsbTransferWait *wait) {
+  transfer->callback = onTransferComplete;
+  transfer->user_data = wait;
+  wait->done = false;
+
+  int result = libusb_submit_transfer(transfer);
+  if(result < 0) {
+    return result;
+  }
+
+  uv_mutex_lock(&wait->lock);
+  while(!wait->done) {
+    uv_cond_wait(&wait->cond, &wait->lock);
+  }
+  uv_mutex_unlock(&wait->lock);
+  return 0;
+}
+
+#endif
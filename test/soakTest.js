@@ -0,0 +1,74 @@
+'use strict';
+
+var sos = require('../');
+
+var ITERATIONS = parseInt(process.env.SOS_SOAK_ITERATIONS || '1000000', 10);
+var WARMUP = Math.min(10000, ITERATIONS);
+var BATCH = 1000;
+var MAX_RSS_GROWTH = 32 * 1024 * 1024;
+
+// Makes count calls, BATCH at a time, starting the next batch once every
+// call of the last one has called back.
+function runCalls(count, call, callback) {
+  var remaining = count;
+  function batch() {
+    var n = Math.min(BATCH, remaining);
+    var pending = n;
+    remaining -= n;
+    for (var i = 0; i < n; i++) {
+      call(function() {
+        if (--pending > 0) {
+          return;
+        }
+        if (remaining > 0) {
+          return setImmediate(batch);
+        }
+        return callback();
+      });
+    }
+  }
+  batch();
+}
+
+// Runs against an emulated device so it needs no hardware. Each call opens
+// and wraps a device and closes it again, so open devices do not pile up;
+// the JS object is left to the garbage collector.
+var mockQuery = { transport: 'mock' };
+function connectCall(done) {
+  sos.connect(mockQuery, function(err, device) {
+    if (err) {
+      throw err;
+    }
+    device.close(function(err) {
+      if (err) {
+        throw err;
+      }
+      return done();
+    });
+  });
+}
+
+module.exports = {
+  "connect does not grow rss": function(test) {
+    if (!process.env.SOS_SOAK) {
+      console.log('skipping soak test, set SOS_SOAK=1 to run it');
+      return test.done();
+    }
+    var descriptor = sos.addMockDevice();
+    runCalls(WARMUP, connectCall, function() {
+      if (global.gc) {
+        global.gc();
+      }
+      var startRss = process.memoryUsage().rss;
+      runCalls(ITERATIONS, connectCall, function() {
+        if (global.gc) {
+          global.gc();
+        }
+        var growth = process.memoryUsage().rss - startRss;
+        test.ok(growth < MAX_RSS_GROWTH, 'rss grew by ' + growth + ' bytes over ' + ITERATIONS + ' calls');
+        sos.removeMockDevice(descriptor);
+        test.done();
+      });
+    });
+  }
+};
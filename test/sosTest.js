@@ -1,8 +1,391 @@
 'use strict';
 
+var sos = require('../');
+
+function connectMock(options, callback) {
+  var descriptor = sos.addMockDevice(options);
+  sos.connect({ transport: 'mock', serial: descriptor.serial }, function(err, device) {
+    callback(err, device, descriptor);
+  });
+}
 
 module.exports = {
-  "blink": function(test) {
-    test.done();
+  "list mock devices": function(test) {
+    var descriptor = sos.addMockDevice({ serial: 'LIST1' });
+    sos.list({ transport: 'mock' }, function(err, descriptors) {
+      test.ifError(err);
+      test.ok(descriptors.some(function(d) {
+        return d.serial === 'LIST1' && d.transport === 'mock';
+      }));
+      sos.removeMockDevice(descriptor);
+      test.done();
+    });
+  },
+
+  "read all info": function(test) {
+    connectMock({ version: 3, ledPatterns: ['a', 'b'], audioPatterns: ['c'] }, function(err, device, descriptor) {
+      test.ifError(err);
+      device.readAllInfo(function(err, info) {
+        test.ifError(err);
+        test.equal(info.version, 3);
+        test.deepEqual(info.ledPatterns.map(function(p) { return p.name; }), ['a', 'b']);
+        test.deepEqual(info.audioPatterns.map(function(p) { return p.name; }), ['c']);
+        sos.removeMockDevice(descriptor);
+        test.done();
+      });
+    });
+  },
+
+  "send control packet": function(test) {
+    connectMock({}, function(err, device, descriptor) {
+      test.ifError(err);
+      device.sendControlPacket({ ledMode: 2, ledPlayDuration: 5000, manualLeds1: 1 }, function(err) {
+        test.ifError(err);
+        var state = sos.inspectMockDevice(descriptor);
+        test.equal(state.ledMode, 2);
+        test.equal(state.ledPlayDuration, 500);
+        test.equal(state.manualLeds[1], 1);
+        sos.removeMockDevice(descriptor);
+        test.done();
+      });
+    });
+  },
+
+  "skip redundant control packets": function(test) {
+    connectMock({}, function(err, device, descriptor) {
+      test.ifError(err);
+      // connecting read the info, so the LEDs are known to be off
+      var packets = [
+        { ledMode: 0 },
+        { ledMode: 1, manualLeds1: 1 },
+        { manualLeds1: 1 },
+        { ledMode: 2 },
+        { ledMode: 1 },
+        // the LEDs left manual mode, so their values are sent again
+        { manualLeds1: 1 }
+      ];
+      function sendNext(i) {
+        if (i === packets.length) {
+          var stats = device.getStats();
+          test.equal(stats.controlPacketsSuppressed, 2);
+          test.equal(stats.controlPacketsWritten, 4);
+          test.equal(stats.output.control.count, 4);
+          return device.resyncState(function(err) {
+            test.ifError(err);
+            device.sendControlPacket({ manualLeds1: 1 }, function(err) {
+              test.ifError(err);
+              test.equal(device.getStats().output.control.count, 5);
+              sos.removeMockDevice(descriptor);
+              test.done();
+            });
+          });
+        }
+        device.sendControlPacket(packets[i], function(err) {
+          test.ifError(err);
+          sendNext(i + 1);
+        });
+      }
+      sendNext(0);
+    });
+  },
+
+  "skip repeated steady playback while polling": function(test) {
+    connectMock({}, function(err, device, descriptor) {
+      test.ifError(err);
+      var packet = { ledMode: 2, ledPlayDuration: 0xfffe }; // plays until changed
+      device.watchStatus({ interval: 10 });
+      device.sendControlPacket(packet, function(err) {
+        test.ifError(err);
+        // let the poller read the info a few times
+        setTimeout(function() {
+          device.sendControlPacket(packet, function(err) {
+            test.ifError(err);
+            var stats = device.getStats();
+            test.equal(stats.controlPacketsWritten, 1);
+            test.equal(stats.controlPacketsSuppressed, 1);
+            device.unwatchStatus();
+            sos.removeMockDevice(descriptor);
+            test.done();
+          });
+        }, 50);
+      });
+    });
+  },
+
+  "status poller": function(test) {
+    connectMock({ ledPatterns: ['a'] }, function(err, device, descriptor) {
+      test.ifError(err);
+      var changes = 0;
+      var watcher = device.watchStatus({ interval: 10 });
+      watcher.on('change', function() {
+        changes++;
+      });
+      watcher.on('playbackEnded', function(ended) {
+        test.equal(ended.channel, 'led');
+        test.equal(ended.mode, 2);
+        // the start state, the pattern starting and it ending
+        test.equal(changes, 3);
+        device.unwatchStatus();
+        sos.removeMockDevice(descriptor);
+        test.done();
+      });
+      setTimeout(function() {
+        device.sendControlPacket({ ledMode: 2, ledPlayDuration: 200 }, function(err) {
+          test.ifError(err);
+        });
+      }, 50);
+    });
+  },
+
+  "device group": function(test) {
+    connectMock({}, function(err, first, firstDescriptor) {
+      test.ifError(err);
+      connectMock({ latency: 20 }, function(err, second, secondDescriptor) {
+        test.ifError(err);
+        sos.group([first, second]).sendControlPacket([{ ledMode: 2 }, { ledMode: 3 }], { deadline: 1000 }, function(err, results) {
+          test.ifError(err);
+          test.equal(results.length, 2);
+          test.equal(results[0].error, null);
+          test.equal(results[1].error, null);
+          test.equal(sos.inspectMockDevice(firstDescriptor).ledMode, 2);
+          test.equal(sos.inspectMockDevice(secondDescriptor).ledMode, 3);
+          sos.removeMockDevice(firstDescriptor);
+          sos.removeMockDevice(secondDescriptor);
+          test.done();
+        });
+      });
+    });
+  },
+
+  "close and reconnect": function(test) {
+    connectMock({}, function(err, device, descriptor) {
+      test.ifError(err);
+      device.close(function(err) {
+        test.ifError(err);
+        device.readInfo(function(err) {
+          test.ok(err);
+          test.equal(err.code, 'SOS_CLOSED');
+          test.equal(err.retryable, false);
+          var watcher = device.watchStatus();
+          device.reconnect(function(err) {
+            test.ifError(err);
+          });
+          // queued behind the reconnect rather than failing
+          device.readInfo(function(err, info) {
+            test.ifError(err);
+            test.ok(info);
+            test.notEqual(device.watchStatus(), watcher);
+            device.unwatchStatus();
+            device.close();
+            sos.removeMockDevice(descriptor);
+            test.done();
+          });
+        });
+      });
+    });
+  },
+
+  "upload": function(test) {
+    connectMock({ externalMemorySize: 1024 }, function(err, device, descriptor) {
+      test.ifError(err);
+      var data = new Buffer(100);
+      for (var i = 0; i < data.length; i++) {
+        data[i] = i;
+      }
+      device.upload(64, data, function(err, result) {
+        test.ifError(err);
+        test.equal(result.bytes, 100);
+        var memory = sos.inspectMockDevice(descriptor).memory;
+        test.equal(memory.slice(64, 164).toString('hex'), data.toString('hex'));
+        // 100 bytes are four packets, so the padding ends exactly at the end of memory
+        device.upload(1024 - 128, data, function(err) {
+          test.ifError(err);
+          memory = sos.inspectMockDevice(descriptor).memory;
+          test.equal(memory.slice(896, 996).toString('hex'), data.toString('hex'));
+          test.equal(memory.slice(996, 1024).toString('hex'), new Array(29).join('ff'));
+          // the data itself ends at the end of memory, its padding does not
+          device.upload(1024 - 100, data, function(err) {
+            test.ok(err);
+            test.equal(err.code, 'SOS_OUT_OF_RANGE');
+            sos.removeMockDevice(descriptor);
+            test.done();
+          });
+        });
+      });
+    });
+  },
+
+  "stats": function(test) {
+    connectMock({ failEvery: 3 }, function(err, device, descriptor) {
+      test.ifError(err);
+      device.readInfo(function() {
+        device.readInfo(function(err) {
+          test.ok(err);
+          var stats = device.getStats();
+          test.equal(stats.input.info.count, 3);
+          test.equal(stats.input.info.errors, 1);
+          test.equal(stats.input.info.bytes, 2 * sos.INFO_PACKET_SIZE);
+          test.equal(stats.queueWait.count, 3);
+          sos.removeMockDevice(descriptor);
+          test.done();
+        });
+      });
+    });
+  },
+
+  "play animation": function(test) {
+    connectMock({}, function(err, device, descriptor) {
+      test.ifError(err);
+      var frames = [[1, 0, 0, 0, 0], [0, 1, 0, 0, 0], [0, 0, 10, 20, 30]];
+      device.playAnimation(frames, { frameRate: 100, repeat: 2 }, function(err, result) {
+        test.ifError(err);
+        test.equal(result.framesSent + result.framesDropped, 6);
+        test.equal(result.stopped, false);
+        var state = sos.inspectMockDevice(descriptor);
+        test.equal(state.ledMode, 1);
+        test.deepEqual(state.manualLeds, [0, 0, 10, 20, 30]);
+        sos.removeMockDevice(descriptor);
+        test.done();
+      });
+    });
+  },
+
+  "stop animation": function(test) {
+    connectMock({}, function(err, device, descriptor) {
+      test.ifError(err);
+      device.playAnimation(new Buffer([1, 2, 3, 4, 5]), { repeat: 0 }, function(err, result) {
+        test.ifError(err);
+        test.ok(result.stopped);
+        sos.removeMockDevice(descriptor);
+        test.done();
+      });
+      device.stopAnimation();
+    });
+  },
+
+  "retry transient errors": function(test) {
+    connectMock({ failEvery: 2, transientErrors: true }, function(err, device, descriptor) {
+      test.ifError(err);
+      device.readInfo({ retries: 1, backoff: 1 }, function(err) {
+        test.ifError(err);
+        device.readInfo({ retries: 1, backoff: 1 }, function(err) {
+          test.ifError(err);
+          test.ok(device.getStats().input.info.retries >= 1);
+          sos.removeMockDevice(descriptor);
+          test.done();
+        });
+      });
+    });
+  },
+
+  "deadline": function(test) {
+    connectMock({ latency: 50 }, function(err, device, descriptor) {
+      test.ifError(err);
+      device.setCallOptions({ timeout: 20, retries: 100, backoff: 1, deadline: 100 });
+      var start = Date.now();
+      device.readInfo(function(err) {
+        test.ok(err);
+        test.ok(err.code === 'SOS_TIMEOUT' || err.code === 'SOS_DEADLINE_EXCEEDED');
+        test.ok(Date.now() - start < 1000);
+        test.ok(device.getStats().input.info.timeouts > 1);
+        sos.removeMockDevice(descriptor);
+        test.done();
+      });
+    });
+  },
+
+  "injected errors": function(test) {
+    connectMock({ failEvery: 1 }, function(err) {
+      test.ok(err);
+      test.equal(err.code, 'SOS_IO');
+      test.done();
+    });
+  },
+
+  "broker": function(test) {
+    var socketPath = require('path').join(require('os').tmpdir(), 'sos-broker-test-' + process.pid + '.sock');
+    connectMock({ version: 3, ledPatterns: ['a', 'b'], audioPatterns: ['c'] }, function(err, device, descriptor) {
+      test.ifError(err);
+      device.startBroker(socketPath);
+      sos.connect({ transport: 'broker', path: socketPath }, function(err, client) {
+        test.ifError(err);
+        client.readInfo(function(err, info) {
+          test.ifError(err);
+          test.equal(info.version, 3);
+          client.readAllInfo(function(err, allInfo) {
+            test.ifError(err);
+            test.deepEqual(allInfo.ledPatterns.map(function(p) { return p.name; }), ['a', 'b']);
+            test.deepEqual(allInfo.audioPatterns.map(function(p) { return p.name; }), ['c']);
+            client.readLedPatterns(function(err, ledPatterns) {
+              test.ifError(err);
+              test.deepEqual(ledPatterns.map(function(p) { return p.name; }), ['a', 'b']);
+              client.sendControlPacket({ ledMode: 2, manualLeds1: 1 }, function(err) {
+                test.ifError(err);
+                var state = sos.inspectMockDevice(descriptor);
+                test.equal(state.ledMode, 2);
+                test.equal(state.manualLeds[1], 1);
+                connectMock({}, function(err, other, otherDescriptor) {
+                  test.ifError(err);
+                  // the socket is in use, so it must not be replaced
+                  test.throws(function() {
+                    other.startBroker(socketPath);
+                  }, function(err) {
+                    return err.code === 'SOS_BUSY';
+                  });
+                  client.close();
+                  device.stopBroker();
+                  sos.removeMockDevice(otherDescriptor);
+                  sos.removeMockDevice(descriptor);
+                  test.done();
+                });
+              });
+            });
+          });
+        });
+      });
+    });
+  },
+
+  "broker drops a stalled client": function(test) {
+    var socketPath = require('path').join(require('os').tmpdir(), 'sos-broker-stall-' + process.pid + '.sock');
+    connectMock({}, function(err, device, descriptor) {
+      test.ifError(err);
+      device.startBroker(socketPath, { holdTimeout: 100 });
+      var remaining = 2;
+      var finish = function() {
+        if (--remaining === 0) {
+          device.stopBroker();
+          sos.removeMockDevice(descriptor);
+          test.done();
+        }
+      };
+      // starts an operation with an info read and never releases the device
+      var stalled = require('net').connect(socketPath, function() {
+        stalled.write(new Buffer([1, 1, 1, sos.INFO_PACKET_SIZE]));
+      });
+      stalled.once('data', function() {
+        var start = Date.now();
+        device.readInfo(function(err) {
+          test.ifError(err);
+          test.ok(Date.now() - start >= 50);
+          finish();
+        });
+      });
+      stalled.on('error', function() {});
+      stalled.on('close', finish);
+    });
+  },
+
+  "removed device fails": function(test) {
+    connectMock({}, function(err, device, descriptor) {
+      test.ifError(err);
+      sos.removeMockDevice(descriptor);
+      device.readInfo(function(err) {
+        test.ok(err);
+        test.equal(err.code, 'SOS_DETACHED');
+        test.equal(err.retryable, false);
+        test.done();
+      });
+    });
   }
 };